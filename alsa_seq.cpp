@@ -0,0 +1,360 @@
+#include "alsa_seq.h"
+
+#include <spdlog/spdlog.h>
+
+#include <cerrno>
+#include <system_error>
+
+#include <poll.h>
+#include <unistd.h>
+
+using spdlog::debug;
+using spdlog::error;
+using spdlog::warn;
+
+namespace {
+
+constexpr std::size_t inputBufferSize = 64 * 1024;	//!< room for a good sized sysex in the one event
+
+void check(int err, const char* what)
+{
+	if (err < 0) throw std::system_error(-err, std::generic_category(), what);
+}
+
+/*!
+ * the sequencer address at the end of a port name, as from list()
+ */
+bool addressOf(snd_seq_t* seq, const std::string& name, snd_seq_addr_t& addr)
+{
+	const auto sp = name.rfind(' ');
+	return snd_seq_parse_address(seq, &addr, name.substr(sp == std::string::npos ? 0 : sp + 1).c_str()) >= 0;
+}
+
+}
+
+/*!
+ * \class AlsaSeq
+ * our input client on the alsa sequencer
+ *  \throws std::system_error if we can't open the sequencer
+ */
+AlsaSeq::AlsaSeq(asio::io_service& ioService, const std::string& clientName)
+	: descriptor(ioService)
+{
+	for (auto& p : portOf) p.store(-1, std::memory_order_relaxed);
+	check(snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK), "AlsaSeq: snd_seq_open");
+	snd_seq_set_client_name(seq, clientName.c_str());
+	snd_seq_set_input_buffer_size(seq, inputBufferSize);
+	client = snd_seq_client_id(seq);
+	pollfd pfd;
+	if (snd_seq_poll_descriptors(seq, &pfd, 1, POLLIN) != 1) {
+		snd_seq_close(seq);
+		throw std::system_error(EINVAL, std::generic_category(), "AlsaSeq: snd_seq_poll_descriptors");
+	}
+	descriptor.assign(::dup(pfd.fd));
+}
+
+AlsaSeq::~AlsaSeq()
+{
+	boost::system::error_code ec;
+	descriptor.close(ec);
+	snd_seq_close(seq);
+}
+
+/*!
+ * the ports we could take midi from
+ */
+std::vector<std::string> AlsaSeq::inputs()
+{
+	return list(SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ);
+}
+
+/*!
+ * the ports we could send midi to
+ */
+std::vector<std::string> AlsaSeq::outputs()
+{
+	return list(SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+}
+
+/*!
+ * the midi ports of every other client with the given capabilities
+ */
+std::vector<std::string> AlsaSeq::list(unsigned int caps)
+{
+	std::vector<std::string> names;
+	snd_seq_client_info_t* cinfo;
+	snd_seq_port_info_t* pinfo;
+	snd_seq_client_info_alloca(&cinfo);
+	snd_seq_port_info_alloca(&pinfo);
+	snd_seq_client_info_set_client(cinfo, -1);
+	while (snd_seq_query_next_client(seq, cinfo) >= 0) {
+		const int c = snd_seq_client_info_get_client(cinfo);
+		if (c == client || c == SND_SEQ_CLIENT_SYSTEM) continue;
+		snd_seq_port_info_set_client(pinfo, c);
+		snd_seq_port_info_set_port(pinfo, -1);
+		while (snd_seq_query_next_port(seq, pinfo) >= 0) {
+			const auto type = snd_seq_port_info_get_type(pinfo);
+			if ((type & (SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_SYNTH | SND_SEQ_PORT_TYPE_APPLICATION)) == 0) continue;
+			if ((snd_seq_port_info_get_capability(pinfo) & caps) != caps) continue;
+			names.push_back(fmt::format("{}:{} {}:{}", snd_seq_client_info_get_name(cinfo), snd_seq_port_info_get_name(pinfo),
+				c, snd_seq_port_info_get_port(pinfo)));
+		}
+	}
+	return names;
+}
+
+/*!
+ * make a port of ours, that what comes in on is tagged as the hub's port 'port'
+ *  \return the sequencer port, or -1 if we couldn't
+ */
+int AlsaSeq::createPort(const std::string& name, uint8_t port, unsigned int caps)
+{
+	snd_seq_port_info_t* info;
+	snd_seq_port_info_alloca(&info);
+	snd_seq_port_info_set_name(info, name.c_str());
+	snd_seq_port_info_set_capability(info, caps);
+	snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	snd_seq_port_info_set_midi_channels(info, 16);
+	if (snd_seq_create_port(seq, info) < 0) return -1;
+	const int p = snd_seq_port_info_get_port(info);
+	if (p < 0 || static_cast<std::size_t>(p) >= portOf.size()) {
+		snd_seq_delete_simple_port(seq, p);
+		return -1;
+	}
+	portOf[p].store(port, std::memory_order_release);
+	return p;
+}
+
+/*!
+ * start listening to the named port, as the hub's port 'port'
+ *  \return our sequencer port for it, for close(), or -1 if we couldn't
+ */
+int AlsaSeq::connect(const std::string& name, uint8_t port)
+{
+	snd_seq_addr_t src;
+	if (!addressOf(seq, name, src)) return -1;
+	const int p = createPort(fmt::format("Xypi midi in {}", port), port, SND_SEQ_PORT_CAP_WRITE);
+	if (p < 0) return -1;
+	snd_seq_addr_t dst;
+	dst.client = static_cast<unsigned char>(client);
+	dst.port = static_cast<unsigned char>(p);
+	snd_seq_port_subscribe_t* sub;
+	snd_seq_port_subscribe_alloca(&sub);
+	snd_seq_port_subscribe_set_sender(sub, &src);
+	snd_seq_port_subscribe_set_dest(sub, &dst);
+	const int err = snd_seq_subscribe_port(seq, sub);
+	if (err < 0) {
+		error("AlsaSeq can't connect to {}: {}", name, snd_strerror(err));
+		close(p);
+		return -1;
+	}
+	return p;
+}
+
+/*!
+ * make a port of ours that other software can connect to, as the hub's port 'port'
+ *  \return our sequencer port for it, for close(), or -1 if we couldn't
+ */
+int AlsaSeq::openVirtual(const std::string& name, uint8_t port)
+{
+	return createPort(name, port, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+}
+
+/*!
+ * stop listening on one of our ports. anything that comes in on it from now on is dropped
+ */
+void AlsaSeq::close(int seqPort)
+{
+	if (seqPort < 0 || static_cast<std::size_t>(seqPort) >= portOf.size()) return;
+	portOf[seqPort].store(-1, std::memory_order_release);
+	snd_seq_delete_simple_port(seq, seqPort);
+}
+
+/*!
+ * start handing what comes in to onMidi and onSysx, on whichever of the io context's threads the descriptor wakes. there's only ever
+ * the one wait outstanding, so they are never called concurrently
+ */
+void AlsaSeq::start(on_midi_t _onMidi, on_sysx_t _onSysx)
+{
+	onMidi = std::move(_onMidi);
+	onSysx = std::move(_onSysx);
+	await();
+}
+
+void AlsaSeq::stop()
+{
+	boost::system::error_code ec;
+	descriptor.cancel(ec);
+}
+
+void AlsaSeq::await()
+{
+	descriptor.async_wait(asio::posix::stream_descriptor::wait_read, [this](boost::system::error_code ec) {
+		if (ec == asio::error::operation_aborted) {
+			debug("AlsaSeq::await() cancelled");
+			return;
+		}
+		if (ec) {
+			error("AlsaSeq::await() fails: {}", ec.message());
+			return;
+		}
+		onReadable();
+		await();
+	});
+}
+
+/*!
+ * take every event the sequencer has for us, and pass it on. the events live in alsa's input buffer, and sysex is handed on from
+ * there too, so nothing is copied before the hub's own pools
+ */
+void AlsaSeq::onReadable()
+{
+	const auto t = clock_t::now();
+	xymsg::midi_t m;
+	for (;;) {
+		snd_seq_event_t* ev = nullptr;
+		const int err = snd_seq_event_input(seq, &ev);
+		if (err == -ENOSPC) {
+			warn("AlsaSeq input overrun, some midi was lost");
+			continue;
+		}
+		if (err < 0 || !ev) break;
+		const auto port = portOf[ev->dest.port].load(std::memory_order_acquire);
+		if (port < 0) continue;
+		if (ev->type == SND_SEQ_EVENT_SYSEX) {
+			if (ev->data.ext.len > 0) onSysx(static_cast<uint8_t>(port), static_cast<const uint8_t*>(ev->data.ext.ptr), ev->data.ext.len, t);
+		} else if (decode(*ev, m)) {
+			m.port = static_cast<uint8_t>(port);
+			onMidi(static_cast<uint8_t>(port), m, t);
+		}
+	}
+}
+
+/*!
+ * the midi message for a sequencer event, with the data bytes in the order they are on the wire
+ *  \return false for events that aren't midi we pass on
+ */
+bool AlsaSeq::decode(const snd_seq_event_t& ev, xymsg::midi_t& m)
+{
+	using xymidi::cmd;
+	const auto& n = ev.data.note;
+	const auto& c = ev.data.control;
+	switch (ev.type) {
+	case SND_SEQ_EVENT_NOTEON:
+		m = xymidi::msg::noteon(n.channel, n.note, n.velocity);
+		return true;
+	case SND_SEQ_EVENT_NOTEOFF:
+		m = xymidi::msg::noteoff(n.channel, n.note, n.velocity);
+		return true;
+	case SND_SEQ_EVENT_KEYPRESS:
+		m = xymidi::msg::keypress(n.channel, n.note, n.velocity);
+		return true;
+	case SND_SEQ_EVENT_CONTROLLER:
+		m = xymidi::msg::control(c.channel, c.param, c.value);
+		return true;
+	case SND_SEQ_EVENT_PGMCHANGE:
+		m = xymidi::msg::prog(c.channel, c.value);
+		return true;
+	case SND_SEQ_EVENT_CHANPRESS:
+		m = xymidi::msg::chanpress(c.channel, c.value);
+		return true;
+	case SND_SEQ_EVENT_PITCHBEND: {
+		const auto v = c.value + 8192;
+		m = xymidi::msg(cmd::bend | (c.channel & 0xf), v & 0x7f, (v >> 7) & 0x7f);
+		return true;
+	}
+	case SND_SEQ_EVENT_SONGPOS:
+		m = xymidi::msg((uint8_t)cmd::songPos, c.value & 0x7f, (c.value >> 7) & 0x7f);
+		return true;
+	case SND_SEQ_EVENT_SONGSEL:
+		m = xymidi::msg::songsel(c.value);
+		return true;
+	case SND_SEQ_EVENT_QFRAME:
+		m = xymidi::msg((uint8_t)cmd::timeCode, c.value);
+		return true;
+	case SND_SEQ_EVENT_TUNE_REQUEST:
+		m = xymidi::msg::tune();
+		return true;
+	case SND_SEQ_EVENT_CLOCK:
+		m = xymidi::msg::clock();
+		return true;
+	case SND_SEQ_EVENT_START:
+		m = xymidi::msg::start();
+		return true;
+	case SND_SEQ_EVENT_CONTINUE:
+		m = xymidi::msg::cont();
+		return true;
+	case SND_SEQ_EVENT_STOP:
+		m = xymidi::msg::stop();
+		return true;
+	case SND_SEQ_EVENT_SENSING:
+		m = xymidi::msg((uint8_t)cmd::sensing);
+		return true;
+	case SND_SEQ_EVENT_RESET:
+		m = xymidi::msg((uint8_t)cmd::sysReset);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*!
+ * \class AlsaSeqOut
+ * a client of our own, with one port, sending to the named port, or to whoever connects to us if it's virtual
+ *  \throws std::system_error if we can't open the sequencer or the port isn't there
+ */
+AlsaSeqOut::AlsaSeqOut(const std::string& clientName, const std::string& name, bool isVirtual)
+	: toSubscribers(isVirtual)
+{
+	check(snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0), "AlsaSeqOut: snd_seq_open");
+	snd_seq_set_client_name(seq, clientName.c_str());
+	try {
+		if (!isVirtual && !addressOf(seq, name, dest)) throw std::system_error(ENODEV, std::generic_category(), "AlsaSeqOut: " + name);
+		port = snd_seq_create_simple_port(seq, isVirtual ? name.c_str() : "Xypi midi out",
+			SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+		check(port, "AlsaSeqOut: snd_seq_create_simple_port");
+		check(snd_midi_event_new(16, &coder), "AlsaSeqOut: snd_midi_event_new");
+	} catch (...) {
+		snd_seq_close(seq);
+		throw;
+	}
+}
+
+AlsaSeqOut::~AlsaSeqOut()
+{
+	snd_midi_event_free(coder);
+	snd_seq_close(seq);
+}
+
+/*!
+ * send a sysex as it is, or encode whatever else we're given into events one at a time, and send each as it's complete
+ */
+void AlsaSeqOut::send(const unsigned char* data, std::size_t len)
+{
+	snd_seq_event_t ev;
+	if (len > 0 && data[0] == (uint8_t)xymidi::cmd::sysxStart) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_sysex(&ev, len, const_cast<unsigned char*>(data));
+		output(ev);
+		return;
+	}
+	for (std::size_t i = 0; i < len; ) {
+		snd_seq_ev_clear(&ev);
+		const long n = snd_midi_event_encode(coder, data + i, static_cast<long>(len - i), &ev);
+		if (n <= 0) break;
+		i += n;
+		if (ev.type != SND_SEQ_EVENT_NONE) output(ev);
+	}
+}
+
+void AlsaSeqOut::output(snd_seq_event_t& ev)
+{
+	snd_seq_ev_set_source(&ev, port);
+	if (toSubscribers) {
+		snd_seq_ev_set_subs(&ev);
+	} else {
+		snd_seq_ev_set_dest(&ev, dest.client, dest.port);
+	}
+	snd_seq_ev_set_direct(&ev);
+	check(snd_seq_event_output_direct(seq, &ev), "AlsaSeqOut: snd_seq_event_output_direct");
+}
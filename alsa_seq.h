@@ -0,0 +1,83 @@
+#pragma once
+
+#include "message.h"
+#include "midi_out_port.h"
+
+#include <alsa/asoundlib.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+namespace asio = boost::asio;
+
+/*!
+ * midi in through the alsa sequencer, without rtmidi in between. we are one sequencer client, with a port of our own connected to
+ * each device we listen to, and the io context wakes us when the client's descriptor has events for us. the events are decoded
+ * straight into hub messages out of alsa's own buffer, so there is no thread of our own and nothing allocated per event.
+ * ports are named as rtmidi names them on alsa, '<client>:<port> <client id>:<port id>', so the two are interchangeable.
+ */
+class AlsaSeq
+{
+public:
+	using clock_t = std::chrono::steady_clock;
+	using on_midi_t = std::function<void(uint8_t port, const xymsg::midi_t& m, clock_t::time_point t)>;
+	using on_sysx_t = std::function<void(uint8_t port, const uint8_t* data, std::size_t len, clock_t::time_point t)>;
+
+	AlsaSeq(asio::io_service& ioService, const std::string& clientName);
+	~AlsaSeq();
+
+	std::vector<std::string> inputs();
+	std::vector<std::string> outputs();
+
+	int connect(const std::string& name, uint8_t port);
+	int openVirtual(const std::string& name, uint8_t port);
+	void close(int seqPort);
+
+	void start(on_midi_t _onMidi, on_sysx_t _onSysx);
+	void stop();
+
+	static bool decode(const snd_seq_event_t& ev, xymsg::midi_t& m);
+
+private:
+	std::vector<std::string> list(unsigned int caps);
+	int createPort(const std::string& name, uint8_t port, unsigned int caps);
+	void await();
+	void onReadable();
+
+	snd_seq_t* seq = nullptr;
+	int client = -1;
+	asio::posix::stream_descriptor descriptor;	//!< a dup of the client's descriptor, so asio and alsa can each close their own
+	std::array<std::atomic<int16_t>, 256> portOf;	//!< the hub's port number for each of our sequencer ports, or -1
+	on_midi_t onMidi;
+	on_sysx_t onSysx;
+};
+
+/*!
+ * midi out to a sequencer port, encoded into events on the stack and written straight to the sequencer. each one is a client of
+ * its own, so each output port's sender has its own handle, and they never wait on one another.
+ */
+class AlsaSeqOut : public MidiOutDevice
+{
+public:
+	AlsaSeqOut(const std::string& clientName, const std::string& name, bool isVirtual);
+	~AlsaSeqOut() override;
+
+	void send(const unsigned char* data, std::size_t len) override;
+	bool batches() const override { return true; }
+
+private:
+	void output(snd_seq_event_t& ev);
+
+	snd_seq_t* seq = nullptr;
+	snd_midi_event_t* coder = nullptr;
+	int port = -1;
+	snd_seq_addr_t dest{};
+	bool toSubscribers = false;	//!< a virtual port, sending to whoever connects to it
+};
@@ -0,0 +1,98 @@
+#include "asio_waker.h"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#ifdef __linux__
+#include <boost/asio/read.hpp>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#include <spdlog/spdlog.h>
+
+#include <system_error>
+
+using spdlog::debug;
+using spdlog::error;
+
+/*!
+ * \class AsioWaker
+ *   lets a queue with a single consumer hand that consumer to the io context, rather than having a thread of its own wait for data.
+ * the queue calls notify() from its producers when the consumer has asked for it, and the consumer's handler is run on the strand.
+ */
+
+AsioWaker::AsioWaker(asio::io_service& ioService, strand_t _strand)
+	: strand(std::move(_strand))
+#ifdef __linux__
+	, descriptor(ioService)
+#endif
+{
+#ifdef __linux__
+	const int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) throw std::system_error(errno, std::generic_category(), "AsioWaker: eventfd");
+	descriptor.assign(fd);
+#endif
+}
+
+AsioWaker::~AsioWaker() = default;
+
+/*!
+ * start listening for notifications. onWake runs on the strand for each notify(), though several notifies close together may be
+ * folded into one call
+ */
+void AsioWaker::start(std::function<void()> _onWake)
+{
+	onWake = std::move(_onWake);
+#ifdef __linux__
+	asio::post(strand, [this]() { await(); });
+#endif
+}
+
+/*!
+ * stop listening. any pending wait is cancelled on the strand, so the io context can run out of work
+ */
+void AsioWaker::stop()
+{
+#ifdef __linux__
+	asio::post(strand, [this]() {
+		boost::system::error_code ec;
+		descriptor.cancel(ec);
+	});
+#endif
+}
+
+/*!
+ * producer side: wake the handler. safe from any thread
+ */
+void AsioWaker::notify()
+{
+#ifdef __linux__
+	const uint64_t one = 1;
+	if (::write(descriptor.native_handle(), &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		error("AsioWaker::notify() eventfd write fails, errno {}", errno);
+	}
+#else
+	asio::post(strand, [this]() { if (onWake) onWake(); });
+#endif
+}
+
+#ifdef __linux__
+/*!
+ * wait for the eventfd to be written, run the handler, and go round again unless we've been cancelled
+ */
+void AsioWaker::await()
+{
+	asio::async_read(descriptor, asio::buffer(&count, sizeof(count)), asio::bind_executor(strand,
+		[this](boost::system::error_code ec, std::size_t) {
+			if (ec == asio::error::operation_aborted) {
+				debug("AsioWaker::await() cancelled");
+				return;
+			}
+			if (ec) {
+				error("AsioWaker::await() eventfd read fails: {}", ec.message());
+				return;
+			}
+			onWake();
+			await();
+		}));
+}
+#endif
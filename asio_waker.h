@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#ifdef __linux__
+#include <boost/asio/posix/stream_descriptor.hpp>
+#endif
+
+namespace asio = boost::asio;
+
+/*!
+ * wakes a handler on an io context from any other thread. on linux, a notify() is a write to an eventfd the io context is already
+ * watching, so the producer never takes the io context's locks or allocates a handler. elsewhere, we just post to the strand.
+ * the handler always runs on the given strand.
+ */
+class AsioWaker
+{
+public:
+	using strand_t = asio::strand<asio::io_context::executor_type>;
+
+	AsioWaker(asio::io_service& ioService, strand_t _strand);
+	~AsioWaker();
+
+	void start(std::function<void()> _onWake);
+	void stop();
+	void notify();
+
+private:
+	void await();
+
+	strand_t strand;
+	std::function<void()> onWake;
+#ifdef __linux__
+	asio::posix::stream_descriptor descriptor;
+	uint64_t count = 0; //!< eventfd's counter, read back by each wakeup
+#endif
+};
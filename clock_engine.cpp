@@ -0,0 +1,393 @@
+#include "clock_engine.h"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std::chrono_literals;
+
+constexpr auto idleWait = 100ms;	//!< how long we sleep with no clock to send, between looks at the incoming clock
+constexpr auto minLossTimeout = 100ms;	//!< the least time without incoming clock before we let it go
+constexpr int lossTicks = 4;	//!< ticks' worth of time without incoming clock before we let it go
+constexpr int resyncTicks = 4;	//!< how far behind the incoming clock we let our ticks get before we jump to it
+constexpr float tempoStep = 0.5f;	//!< how far the incoming tempo moves before we send it on
+
+using spdlog::info;
+using spdlog::debug;
+using spdlog::warn;
+
+namespace {
+
+uint64_t absUs(ClockEngine::clock_t::duration d)
+{
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	return static_cast<uint64_t>(us < 0 ? -us : us);
+}
+
+}
+
+/*!
+ * take one incoming tick, and move the phase and period on towards it. ticks that never arrived are allowed for, by taking the
+ * nearest whole number of periods since the last one
+ *  \return how far the tick was from where we expected it, in microseconds
+ */
+double ClockEngine::pll_t::onTick(clock_t::time_point t)
+{
+	last = t;
+	if (count++ == 0) {
+		phase = t;
+		++index;
+		return 0;
+	}
+	const double sinceUs = std::chrono::duration<double, std::micro>(t - phase).count();
+	if (count == 2) {
+		periodUs = std::clamp(sinceUs, periodUsOf(maxTempo), periodUsOf(minTempo));
+		phase = t;
+		++index;
+		return 0;
+	}
+	const auto n = std::max<int64_t>(1, std::llround(sinceUs / periodUs));
+	const double err = sinceUs - n * periodUs;
+	phase += ticksOf(n, periodUs) + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double, std::micro>(alpha * err));
+	periodUs = std::clamp(periodUs + beta * err / n, periodUsOf(maxTempo), periodUsOf(minTempo));
+	index += n;
+	return err;
+}
+
+/*!
+ * when tick i should come, by the filter
+ */
+ClockEngine::clock_t::time_point ClockEngine::pll_t::predict(uint64_t i) const
+{
+	return phase + ticksOf(static_cast<double>(static_cast<int64_t>(i - index)), periodUs);
+}
+
+/*!
+ * \class ClockEngine
+ * sends midi clock through the router, and keeps the hub's transport
+ */
+ClockEngine::ClockEngine(xymsg::Router& _router, const clock_config_t& config)
+	: router(_router), lookahead(config.lookahead), sync(config.sync), tempo(std::clamp(config.tempo, minTempo, maxTempo))
+{
+}
+
+ClockEngine::~ClockEngine()
+{
+	stop();
+}
+
+/*!
+ * launch the clock thread
+ */
+void ClockEngine::run()
+{
+	if (!isRunning.exchange(true)) {
+		debug("ClockEngine::run() launching clock, {}", clockSyncNames[static_cast<std::size_t>(sync)]);
+		{
+			const std::unique_lock<std::mutex> lock(mutex);
+			anchorT = clock_t::now() + lookahead;
+			anchorN = outIndex;
+		}
+		myThread = std::thread([this]() { runner(); });
+	}
+}
+
+void ClockEngine::stop()
+{
+	if (isRunning.exchange(false)) {
+		wake.notify_all();
+		if (myThread.joinable()) myThread.join();
+	}
+}
+
+/*!
+ * the router's clock tap. we keep up with tempo messages at our own tempo, and when we follow external clock, we take its ticks
+ * and transport, and send our own in their place
+ *  \return true if we took the message
+ */
+bool ClockEngine::tap(xymsg::source from, const xymsg::msg_t& msg)
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	if (xymsg::typeOf(msg) == xymsg::typ::tempo) {
+		if (sync == clock_sync::internal) changeTempo(std::get<xymsg::TempoMsg>(msg.body).tempo);
+		return false;
+	}
+	if (sync != clock_sync::external) return false;
+	const auto& m = std::get<xymsg::MidiMsg>(msg.body).midi;
+	switch (static_cast<xymidi::cmd>(m.cmd)) {
+	case xymidi::cmd::clock:
+		onClock(msg.t);
+		return true;
+	case xymidi::cmd::start:
+	case xymidi::cmd::cont:
+	case xymidi::cmd::stop:
+		transport = m.cmd;
+		break;
+	case xymidi::cmd::songPos:
+		songPos = static_cast<uint16_t>(m.val1 | (m.val2 << 7));
+		subTick = 0;
+		songTick = static_cast<uint64_t>(songPos) * (ppqn / 4);
+		sendSongPos = true;
+		break;
+	default:
+		return false;
+	}
+	debug("ClockEngine takes transport {:#x} from {}", m.cmd, xymsg::sourceNames[static_cast<std::size_t>(from)]);
+	return true;
+}
+
+/*!
+ * switch between our own clock, following clock coming in, and none
+ */
+void ClockEngine::setSync(clock_sync _sync)
+{
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (_sync == sync) return;
+		sync = _sync;
+		following = false;
+		pll.reset();
+		anchorT = clock_t::now() + lookahead;
+		anchorN = outIndex;
+	}
+	info("ClockEngine clock is {}", clockSyncNames[static_cast<std::size_t>(_sync)]);
+	wake.notify_all();
+}
+
+/*!
+ * set our own tempo, from the next tick on, and tell everyone. it only matters when the clock is internal
+ */
+void ClockEngine::setTempo(float bpm)
+{
+	bool announce;
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		announce = changeTempo(bpm) && sync == clock_sync::internal;
+		if (announce) announced = tempo;
+	}
+	if (announce) router.route(xymsg::source::clock, xymsg::TempoMsg(std::clamp(bpm, minTempo, maxTempo)));
+	wake.notify_all();
+}
+
+/*!
+ * the transport goes out with the next tick
+ */
+void ClockEngine::startTransport()
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	transport = (uint8_t)xymidi::cmd::start;
+}
+
+void ClockEngine::stopTransport()
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	transport = (uint8_t)xymidi::cmd::stop;
+}
+
+void ClockEngine::continueTransport()
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	transport = (uint8_t)xymidi::cmd::cont;
+}
+
+/*!
+ * move the song position, in sixteenths. it goes out with the next tick, and should be followed by a continue
+ */
+void ClockEngine::setSongPos(uint16_t sixteenths)
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	songPos = sixteenths & 0x3fff;
+	subTick = 0;
+	songTick = static_cast<uint64_t>(songPos) * (ppqn / 4);
+	sendSongPos = true;
+}
+
+ClockEngine::stats_t ClockEngine::stats()
+{
+	stats_t s;
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		s.sync = sync;
+		s.running = running;
+		s.locked = sync == clock_sync::external && following;
+		s.tempo = tempoNow();
+		s.songPos = songPos;
+		s.ticks = ticks;
+		s.lateTicks = lateTicks;
+		s.driftUs = driftUs;
+	}
+	s.jitter = jitter.snapshot();
+	s.phaseError = phaseError.snapshot();
+	s.drift = drift.snapshot();
+	return s;
+}
+
+/*!
+ * the stats as json, with the tick jitter, phase error and drift in microseconds
+ */
+nlohmann::json ClockEngine::toJson(const stats_t& s)
+{
+	const auto hist = [](const locked::dwell_hist_t& d) {
+		return nlohmann::json{ {"count", d.count}, {"mean", d.meanUs()}, {"p50", d.percentile(0.5)}, {"p99", d.percentile(0.99)}, {"max", d.maxUs} };
+	};
+	return {
+		{"sync", clockSyncNames[static_cast<std::size_t>(s.sync)]}, {"running", s.running}, {"locked", s.locked},
+		{"tempo", s.tempo}, {"songPos", s.songPos}, {"ticks", s.ticks}, {"lateTicks", s.lateTicks}, {"driftUs", s.driftUs},
+		{"jitterUs", hist(s.jitter)}, {"phaseErrorUs", hist(s.phaseError)}, {"absDriftUs", hist(s.drift)}
+	};
+}
+
+/*!
+ * note an incoming tick, and how far it was from the one we sent for it. call with the mutex held
+ */
+void ClockEngine::onClock(clock_t::time_point t)
+{
+	if (t == clock_t::time_point{}) t = clock_t::now();
+	const bool wasLocked = pll.locked();
+	const double err = pll.onTick(t);
+	if (pll.count > 2) phaseError.record(static_cast<uint64_t>(std::fabs(err)));
+	const auto& s = sent[pll.index % sent.size()];
+	if (following && s.first == pll.index && s.second != clock_t::time_point{}) {
+		driftUs = std::chrono::duration_cast<std::chrono::microseconds>(t - s.second).count();
+		drift.record(absUs(t - s.second));
+	}
+	if (!wasLocked && pll.locked()) wake.notify_all();
+}
+
+/*!
+ * change our own tempo. the grid is anchored on the next tick, so the ticks already sent stay where they were. call with the mutex held
+ *  \return true if the tempo changed
+ */
+bool ClockEngine::changeTempo(float bpm)
+{
+	bpm = std::clamp(bpm, minTempo, maxTempo);
+	if (bpm == tempo) return false;
+	anchorT += ticksOf(static_cast<double>(outIndex - anchorN), periodUsOf(tempo));
+	anchorN = outIndex;
+	tempo = bpm;
+	return true;
+}
+
+/*!
+ * the tempo the ticks are going out at. call with the mutex held
+ */
+float ClockEngine::tempoNow() const
+{
+	if (sync == clock_sync::external && pll.count >= 2) return static_cast<float>(60e6 / (pll.periodUs * ppqn));
+	return tempo;
+}
+
+ClockEngine::clock_t::duration ClockEngine::ticksOf(double n, double periodUs)
+{
+	return std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double, std::micro>(n * periodUs));
+}
+
+/*!
+ * when the next tick is due, or time_point::max() if there's none to send. this is where we notice incoming clock has stopped, and
+ * where we start following it once we've locked on. call with the mutex held
+ */
+ClockEngine::clock_t::time_point ClockEngine::nextDue(clock_t::time_point now)
+{
+	switch (sync) {
+	case clock_sync::internal:
+		return anchorT + ticksOf(static_cast<double>(outIndex - anchorN), periodUsOf(tempo));
+	case clock_sync::external: {
+		if (pll.count > 0) {
+			const auto timeout = std::max<clock_t::duration>(minLossTimeout, ticksOf(lossTicks, pll.periodUs));
+			if (now - pll.last > timeout) {
+				if (following) warn("ClockEngine lost the incoming clock");
+				pll.reset();
+				pll.index = std::max(pll.index, outIndex);
+				following = false;
+			}
+		}
+		if (!pll.locked()) return clock_t::time_point::max();
+		if (!following || pll.predict(outIndex) < now - ticksOf(resyncTicks, pll.periodUs)) {
+			if (!following) info("ClockEngine locked to incoming clock at {:.1f}bpm", tempoNow());
+			outIndex = pll.index + 1;
+			following = true;
+		}
+		return pll.predict(outIndex);
+	}
+	default:
+		return clock_t::time_point::max();
+	}
+}
+
+/*!
+ * make up the messages for the next tick, each to go out at its due time, and move on to the one after. call with the mutex held
+ */
+void ClockEngine::tick(clock_t::time_point due, pending_t& out)
+{
+	out.n = 0;
+	const auto add = [&](xymidi::msg m) {
+		m.port = xymidi::allPorts;
+		auto& msg = out.msgs[out.n++];
+		msg = xymsg::MidiMsg{ m };
+		msg.setDue(due);
+	};
+	if (sendSongPos) {
+		add({ (uint8_t)xymidi::cmd::songPos, (uint8_t)(songPos & 0x7f), (uint8_t)((songPos >> 7) & 0x7f) });
+		sendSongPos = false;
+	}
+	out.tick.transport = transport;
+	if (transport != 0) {
+		add({ transport });
+		if (transport == (uint8_t)xymidi::cmd::start) {
+			songPos = 0;
+			subTick = 0;
+			songTick = 0;
+		}
+		running = transport != (uint8_t)xymidi::cmd::stop;
+		transport = 0;
+	}
+	out.tick.pos = songTick;
+	out.tick.due = due;
+	out.tick.periodUs = sync == clock_sync::external ? pll.periodUs : periodUsOf(tempo);
+	out.tick.running = running;
+	add(xymidi::msg::clock());
+	sent[outIndex % sent.size()] = { outIndex, due };
+	if (sync == clock_sync::external && outIndex % ppqn == 0 && std::fabs(tempoNow() - announced) >= tempoStep) {
+		announced = tempoNow();
+		out.msgs[out.n++] = xymsg::TempoMsg(announced);
+	}
+	++outIndex;
+	++ticks;
+	if (running) ++songTick;
+	if (running && ++subTick == ppqn / 4) {
+		subTick = 0;
+		songPos = (songPos + 1) & 0x3fff;
+	}
+}
+
+/*!
+ * main body of the clock thread. we sleep until a lookahead before each tick, and send it with its due time. we route with the
+ * mutex released, so the tap and the api are never held up behind the queues
+ */
+void ClockEngine::runner()
+{
+	pending_t out;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (isRunning) {
+		const auto now = clock_t::now();
+		const auto due = nextDue(now);
+		if (due == clock_t::time_point::max()) {
+			wake.wait_for(lock, idleWait);
+			continue;
+		}
+		const auto sendAt = due - lookahead;
+		if (now < sendAt) {
+			wake.wait_until(lock, sendAt);
+			continue;
+		}
+		jitter.record(absUs(now - sendAt));
+		if (now > due) ++lateTicks;
+		tick(due, out);
+		lock.unlock();
+		for (std::size_t i = 0; i < out.n; ++i) router.route(xymsg::source::clock, std::move(out.msgs[i]));
+		if (tickListener) tickListener(out.tick);
+		lock.lock();
+	}
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "message.h"
+#include "router.h"
+#include "locked/meter.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <nlohmann/json_fwd.hpp>
+
+/*!
+ * where the hub's midi clock comes from
+ */
+enum class clock_sync : uint8_t {
+	off = 0,		//!< we make no clock. clock coming in goes through the routes like anything else
+	internal = 1,	//!< we are the master, at our own tempo
+	external = 2	//!< we lock to clock coming in from any source, and send a clean copy of it
+};
+constexpr std::array<const char*, 3> clockSyncNames = { "off", "internal", "external" };
+
+/*!
+ *  \throws std::invalid_argument for anything but the names in clockSyncNames
+ */
+inline clock_sync parseClockSync(const std::string& name)
+{
+	for (std::size_t i = 0; i < clockSyncNames.size(); ++i) {
+		if (name == clockSyncNames[i]) return static_cast<clock_sync>(i);
+	}
+	throw std::invalid_argument("Unknown clock sync '" + name + "'");
+}
+
+struct clock_config_t {
+	clock_sync sync = clock_sync::off;
+	float tempo = 120;
+	std::chrono::microseconds lookahead{ 2000 };	//!< how long before its time each tick is sent, so the midi scheduler can send it on time
+};
+
+/*!
+ * the hub's midi clock: 24 ticks to the beat, with start, stop, continue and song position, at a tempo of our own or locked to clock
+ * coming in. ticks go through the router from the clock source, in the realtime lanes, each a little ahead of its time with its time
+ * set, so the midi ports' and the duino's schedulers send them exactly on the beat however long they took to get there, and osc
+ * sends them in bundles with their time as the timetag.
+ * we follow external clock with a phase locked loop: an alpha beta filter (a steady state kalman filter) on the tick times tracks the
+ * phase and period of the incoming clock, and we send each tick at the time the filter predicts for it, so jitter on the way in
+ * doesn't come out again. incoming transport messages are taken over in the same way, so there's only ever the one clock.
+ */
+class ClockEngine
+{
+public:
+	using clock_t = std::chrono::steady_clock;
+	static constexpr int ppqn = 24;
+	static constexpr float minTempo = 20;
+	static constexpr float maxTempo = 400;
+
+	ClockEngine(xymsg::Router& _router, const clock_config_t& config);
+	~ClockEngine();
+
+	/*!
+	 * a tick as it goes out, for whatever plays along with the clock
+	 */
+	struct tick_t {
+		uint64_t pos = 0;	//!< ticks since the start of the song, at this tick
+		clock_t::time_point due{};
+		double periodUs = 0;	//!< until the next tick, as it stands
+		uint8_t transport = 0;	//!< start, stop or continue, if one went out with this tick
+		bool running = false;	//!< the transport, after this tick's
+	};
+	using tick_listener_t = std::function<void(const tick_t& tick)>;
+
+	/*!
+	 * called on the clock thread for every tick, after it has been routed. set before run()
+	 */
+	void setTickListener(tick_listener_t f) { tickListener = std::move(f); }
+
+	void run();
+	void stop();
+
+	bool tap(xymsg::source from, const xymsg::msg_t& msg);
+
+	void setSync(clock_sync _sync);
+	void setTempo(float bpm);
+	void startTransport();
+	void stopTransport();
+	void continueTransport();
+	void setSongPos(uint16_t sixteenths);
+
+	struct stats_t {
+		clock_sync sync = clock_sync::off;
+		bool running = false;	//!< the transport, rather than the clock
+		bool locked = false;	//!< to external clock
+		float tempo = 0;
+		uint16_t songPos = 0;	//!< in sixteenths
+		uint64_t ticks = 0;		//!< ticks sent
+		uint64_t lateTicks = 0;	//!< ticks we woke too late to send ahead of their time
+		int64_t driftUs = 0;	//!< how far the last incoming tick was from the one we sent for it. positive is ours early
+		locked::dwell_hist_t jitter;	//!< how late we woke for each tick, in microseconds. how late ticks go out is each sink's scheduler's lateness
+		locked::dwell_hist_t phaseError;	//!< how far each incoming tick was from where the filter expected it
+		locked::dwell_hist_t drift;	//!< how far each incoming tick was from the one we sent for it
+	};
+	stats_t stats();
+	static nlohmann::json toJson(const stats_t& s);
+
+private:
+	/*!
+	 * tracks the phase and period of an incoming clock
+	 */
+	struct pll_t {
+		static constexpr double alpha = 0.2;	//!< how much of each phase error goes into the phase
+		static constexpr double beta = alpha * alpha / (2 - alpha);	//!< and into the period. critically damped
+
+		clock_t::time_point phase{};	//!< filtered time of the last tick
+		clock_t::time_point last{};	//!< when the last tick came in
+		double periodUs = 0;
+		uint64_t index = 0;	//!< of the last tick, counting on across resets
+		uint32_t count = 0;	//!< ticks since we started following
+
+		void reset() { count = 0; }
+		bool locked() const { return count >= ppqn; }
+		double onTick(clock_t::time_point t);
+		clock_t::time_point predict(uint64_t i) const;
+	};
+
+	/*!
+	 * what goes out with one tick: song position, transport, the tick itself and a tempo
+	 */
+	struct pending_t {
+		std::array<xymsg::msg_t, 4> msgs;
+		std::size_t n = 0;
+		tick_t tick;
+	};
+
+	void runner();
+	clock_t::time_point nextDue(clock_t::time_point now);
+	void tick(clock_t::time_point due, pending_t& out);
+	void onClock(clock_t::time_point t);
+	bool changeTempo(float bpm);
+	float tempoNow() const;
+	static clock_t::duration ticksOf(double n, double periodUs);
+	static double periodUsOf(float bpm) { return 60e6 / (bpm * ppqn); }
+
+	std::atomic<bool> isRunning{ false };
+	std::thread myThread;
+	std::mutex mutex;	//!< everything below, between our thread, the tap and the api
+	std::condition_variable wake;
+
+	xymsg::Router& router;
+	tick_listener_t tickListener;
+	std::chrono::microseconds lookahead;
+	clock_sync sync;
+	float tempo;
+	clock_t::time_point anchorT{};	//!< when tick anchorN is due, at our own tempo
+	uint64_t anchorN = 0;
+	uint64_t outIndex = 0;	//!< the next tick we send
+	bool following = false;	//!< sending ticks locked to the incoming clock
+	pll_t pll;
+	float announced = 0;	//!< the tempo we last sent out
+
+	bool running = false;
+	uint16_t songPos = 0;
+	uint8_t subTick = 0;	//!< ticks into the current sixteenth
+	uint64_t songTick = 0;	//!< ticks into the song, which unlike the song position never wraps
+	uint8_t transport = 0;	//!< start, stop or continue, to go out with the next tick, or 0
+	bool sendSongPos = false;
+
+	std::array<std::pair<uint64_t, clock_t::time_point>, 64> sent{};	//!< recent ticks' indexes and times, for the drift
+	uint64_t ticks = 0;
+	uint64_t lateTicks = 0;
+	int64_t driftUs = 0;
+	locked::hist_meter jitter;
+	locked::hist_meter phaseError;
+	locked::hist_meter drift;
+};
@@ -0,0 +1,152 @@
+#include "coalescer.h"
+
+#include <spdlog/spdlog.h>
+
+using spdlog::debug;
+
+namespace xymsg {
+
+constexpr std::size_t slotReserve = 256;	//!< controllers we make room for up front, so the usual few never allocate
+
+/*!
+ * \class Coalescer
+ * holds back controller values that come faster than a sink wants them, and sends on the last of them
+ */
+Coalescer::Coalescer(q_t& oscQ, q_t& spiQ, q_t& midiQ, const coalesce_config_t& config)
+{
+	const std::array<q_t*, nSinks> qs{ &oscQ, &spiQ, &midiQ };
+	for (std::size_t s = 0; s < nSinks; ++s) {
+		sinks[s].q = qs[s];
+		if (config.maxRate[s] == 0) continue;
+		sinks[s].interval = std::chrono::duration_cast<clock_t::duration>(std::chrono::seconds(1)) / config.maxRate[s];
+		sinks[s].slots.reserve(slotReserve);
+		sinks[s].pending.reserve(slotReserve);
+	}
+}
+
+Coalescer::~Coalescer()
+{
+	stop();
+}
+
+/*!
+ * launch the thread that sends on what we hold
+ */
+void Coalescer::run()
+{
+	if (!isRunning.exchange(true)) {
+		debug("Coalescer::run() launching sender");
+		myThread = std::thread([this]() { runner(); });
+	}
+}
+
+/*!
+ * stop, and send on whatever we still hold, so no controller is left short of its last value. we stop under the mutex, so the
+ * sender can't miss the wake, and an offer() either sees us stopped or has its value sent on here
+ */
+void Coalescer::stop()
+{
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning.exchange(false)) return;
+	}
+	wake.notify_all();
+	if (myThread.joinable()) myThread.join();
+	const std::unique_lock<std::mutex> lock(mutex);
+	for (auto& sk : sinks) {
+		for (const auto key : sk.pending) {
+			auto& slot = sk.slots[key];
+			sk.q->push(std::move(slot.msg));
+			slot.pending = false;
+		}
+		sk.pending.clear();
+	}
+}
+
+/*!
+ * look at a message on its way to a sink. it may go on now if it isn't a controller, the sink takes every value, or this
+ * controller hasn't sent a value for an interval. otherwise we keep a copy, in place of any we already had, to send later
+ *  \return true if we kept the message, false if the caller should push it now
+ */
+bool Coalescer::offer(sink to, const msg_t& msg)
+{
+	auto& sk = sinks[static_cast<std::size_t>(to)];
+	if (sk.interval == clock_t::duration::zero() || !isRunning) return false;
+	const auto key = coalesceKey(msg);
+	if (key == 0) return false;
+	const auto now = clock_t::now();
+	bool first;
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning) return false;
+		auto& slot = sk.slots[key];
+		if (!slot.pending && now >= slot.next) {
+			slot.next = now + sk.interval;
+			return false;
+		}
+		first = !slot.pending;
+		if (first) {
+			slot.pending = true;
+			sk.pending.push_back(key);
+		} else {
+			++sk.counters.merged;
+		}
+		slot.msg = msg;
+		++sk.counters.held;
+	}
+	if (first) wake.notify_one();
+	return true;
+}
+
+Coalescer::counters_t Coalescer::counters(sink to)
+{
+	const std::unique_lock<std::mutex> lock(mutex);
+	auto c = sinks[static_cast<std::size_t>(to)].counters;
+	c.pending = sinks[static_cast<std::size_t>(to)].pending.size();
+	return c;
+}
+
+/*!
+ * main body of the sender thread. we sleep until the next held value is due, and push everything that's due together, with the
+ * mutex released
+ */
+void Coalescer::runner()
+{
+	std::vector<std::pair<q_t*, msg_t>> out;
+	out.reserve(slotReserve);
+	std::unique_lock<std::mutex> lock(mutex);
+	while (isRunning) {
+		const auto now = clock_t::now();
+		auto next = clock_t::time_point::max();
+		for (auto& sk : sinks) {
+			// held values go out in the order they were first held, and what's left keeps its order too
+			const auto kept = std::remove_if(sk.pending.begin(), sk.pending.end(), [&](uint64_t key) {
+				auto& slot = sk.slots[key];
+				if (slot.next > now) {
+					next = std::min(next, slot.next);
+					return false;
+				}
+				out.emplace_back(sk.q, std::move(slot.msg));
+				slot.msg = msg_t();
+				slot.pending = false;
+				slot.next = now + sk.interval;
+				return true;
+			});
+			sk.pending.erase(kept, sk.pending.end());
+		}
+		if (!out.empty()) {
+			lock.unlock();
+			for (auto& o : out) o.first->push(std::move(o.second));
+			out.clear();
+			lock.lock();
+			continue;
+		}
+		if (next == clock_t::time_point::max()) {
+			wake.wait(lock, [this]() { return !isRunning || std::any_of(sinks.begin(), sinks.end(), [](const sink_t& sk) { return !sk.pending.empty(); }); });
+		} else {
+			wake.wait_until(lock, next);
+		}
+	}
+}
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "message.h"
+#include "router.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace xymsg {
+
+/*!
+ * the most often each sink gets a new value for any one controller, in updates a second. 0 sends every value
+ */
+struct coalesce_config_t {
+	std::array<uint32_t, nSinks> maxRate{};
+};
+
+/*!
+ * parse the coalescing rates, as given on the command line: a comma separated list of <sink>=<updates a second>, eg 'osc=100,spi=200'
+ *  \throws std::invalid_argument on a badly formed spec
+ */
+inline coalesce_config_t parseCoalesce(const std::string& spec)
+{
+	coalesce_config_t c;
+	for (std::size_t pos = 0; pos < spec.size(); ) {
+		const auto end = std::min(spec.find(',', pos), spec.size());
+		const auto item = spec.substr(pos, end - pos);
+		const auto eq = item.find('=');
+		if (eq == std::string::npos) throw std::invalid_argument("Expected <sink>=<rate> in coalescing, got '" + item + "'");
+		const auto name = item.substr(0, eq);
+		const auto s = std::find(sinkNames.begin(), sinkNames.end(), name);
+		if (s == sinkNames.end()) throw std::invalid_argument("Unknown sink '" + name + "' in coalescing");
+		try {
+			c.maxRate[s - sinkNames.begin()] = static_cast<uint32_t>(std::stoul(item.substr(eq + 1)));
+		} catch (const std::exception&) {
+			throw std::invalid_argument("Bad rate in coalescing '" + item + "'");
+		}
+		pos = end + 1;
+	}
+	return c;
+}
+
+/*!
+ * last value wins for the high rate controller streams, on the way to each sink. a controller's first value goes straight through,
+ * and any more within the sink's interval wait here, each replacing the last, until the interval is up. so a sink sees at most its
+ * rate of values for any one controller, and always the last. what counts as the same controller is coalesceKey(): notes, clock,
+ * bank select, (n)rpn and the channel mode controllers, and anything else without a key, always go straight through. values held
+ * together go out in the order they were first held.
+ * the router offers each message it's about to push to a sink, and we either let it go, or keep a copy. our thread sends on what
+ * we keep as its time comes.
+ */
+class Coalescer
+{
+public:
+	using clock_t = std::chrono::steady_clock;
+
+	Coalescer(q_t& oscQ, q_t& spiQ, q_t& midiQ, const coalesce_config_t& config);
+	~Coalescer();
+
+	void run();
+	void stop();
+
+	bool offer(sink to, const msg_t& msg);
+
+	struct counters_t {
+		uint64_t held = 0;		//!< values we held back
+		uint64_t merged = 0;	//!< held values replaced by a later one before they went out
+		std::size_t pending = 0;	//!< values waiting to go out now
+	};
+	counters_t counters(sink to);
+
+private:
+	struct slot_t {
+		msg_t msg;
+		clock_t::time_point next{};	//!< the earliest this controller may go out again
+		bool pending = false;	//!< msg is waiting to go out
+	};
+
+	/*!
+	 * the controllers we've seen on the way to one sink
+	 */
+	struct sink_t {
+		q_t* q = nullptr;
+		clock_t::duration interval{};
+		std::unordered_map<uint64_t, slot_t> slots;
+		std::vector<uint64_t> pending;	//!< keys of the slots with a msg waiting
+		counters_t counters;
+	};
+
+	void runner();
+
+	std::atomic<bool> isRunning{ false };
+	std::thread myThread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::array<sink_t, nSinks> sinks;
+};
+
+}
@@ -0,0 +1,184 @@
+#include "duino_sim.h"
+#include "pi_spi.h"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr auto spinTime = 100us;	//!< we sleep until this long before a transfer is done, then spin, since a sleep can't be trusted closer
+
+/*!
+ * \class DuinoSim
+ * a simulated duino, at the given clock rate and latency
+ */
+DuinoSim::DuinoSim(const spi_config_t& config)
+	: usPerByte(8e6 / std::max<uint32_t>(config.clockHz, 1)), latency(config.latency), echo(config.echo)
+{
+	spdlog::info("DuinoSim at {}Hz, {}us a transfer{}", config.clockHz, latency.count(), echo ? ", echoing midi" : "");
+}
+
+/*!
+ * swap the buffer's bytes for ours, and take as long about it as the spi port would
+ */
+void DuinoSim::transfer(uint8_t* buf, std::size_t len)
+{
+	using clock_t = std::chrono::steady_clock;
+	const auto start = clock_t::now();
+	for (std::size_t i = 0; i < len; ++i) buf[i] = exchange(buf[i]);
+	transfers.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(len, std::memory_order_relaxed);
+	const auto end = start + latency + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double, std::micro>(len * usPerByte));
+	if (end - clock_t::now() > spinTime) std::this_thread::sleep_until(end - spinTime);
+	while (clock_t::now() < end) {}
+}
+
+/*!
+ * one byte each way. what we send was ready before the byte coming in arrived
+ */
+uint8_t DuinoSim::exchange(uint8_t in)
+{
+	uint8_t b = xyspi::null;
+	if (outCount > 0) {
+		b = out[outHead];
+		outHead = (outHead + 1) % outSize;
+		--outCount;
+	}
+	receive(in);
+	return b;
+}
+
+/*!
+ * queue bytes to send. what doesn't fit is lost, as it would be on the duino
+ */
+void DuinoSim::send(const uint8_t* data, std::size_t len)
+{
+	if (outCount + len > outSize) {
+		overflows.fetch_add(len, std::memory_order_relaxed);
+		return;
+	}
+	for (std::size_t i = 0; i < len; ++i) out[(outHead + outCount++) % outSize] = data[i];
+}
+
+/*!
+ * the duino's end of the protocol, a byte at a time
+ */
+void DuinoSim::receive(uint8_t in)
+{
+	switch (state) {
+	case state_t::command:
+		if (in & xyspi::midi) {
+			frame[0] = in;
+			framePos = 1;
+			remaining = 3 * (in & 0x7f);
+			if (remaining > 0) state = state_t::midi;
+			break;
+		}
+		switch (in) {
+		case xyspi::null:
+			break;
+		case xyspi::ping: {
+			pings.fetch_add(1, std::memory_order_relaxed);
+			const uint8_t pong = xyspi::pong;
+			send(&pong, 1);
+			break;
+		}
+		case xyspi::send_tempo: {
+			uint8_t t[5] = { xyspi::tempo };
+			std::memcpy(&t[1], &tempo, sizeof(tempo));
+			send(t, sizeof(t));
+			break;
+		}
+		case xyspi::tempo:
+			framePos = 0;
+			remaining = sizeof(tempo);
+			state = state_t::tempo;
+			break;
+		case xyspi::cfg_button:
+		case xyspi::cfg_pedal:
+		case xyspi::cfg_xlrm8:
+			state = state_t::cfgWhich;
+			break;
+		case spiSysx:
+			state = state_t::sysxHeader;
+			break;
+		default:
+			unknown.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+		break;
+	case state_t::midi:
+		if (framePos < frame.size()) frame[framePos++] = in;
+		if (--remaining == 0) {
+			midi.fetch_add(frame[0] & 0x7f, std::memory_order_relaxed);
+			if (echo && framePos == 1 + 3u * (frame[0] & 0x7f)) send(frame.data(), framePos);
+			state = state_t::command;
+		}
+		break;
+	case state_t::tempo:
+		frame[framePos++] = in;
+		if (--remaining == 0) {
+			std::memcpy(&tempo, frame.data(), sizeof(tempo));
+			state = state_t::command;
+		}
+		break;
+	case state_t::cfgWhich:
+		state = state_t::cfgLen;
+		break;
+	case state_t::cfgLen:
+		remaining = in;
+		if (remaining > 0) {
+			state = state_t::cfgData;
+		} else {
+			configs.fetch_add(1, std::memory_order_relaxed);
+			state = state_t::command;
+		}
+		break;
+	case state_t::cfgData:
+		if (--remaining == 0) {
+			configs.fetch_add(1, std::memory_order_relaxed);
+			state = state_t::command;
+		}
+		break;
+	case state_t::sysxHeader:
+		remaining = in & sysxLenMask;
+		state = remaining > 0 ? state_t::sysxData : state_t::command;
+		break;
+	case state_t::sysxData:
+		sysx.fetch_add(1, std::memory_order_relaxed);
+		if (--remaining == 0) state = state_t::command;
+		break;
+	}
+}
+
+DuinoSim::counters_t DuinoSim::counters() const
+{
+	counters_t c;
+	c.transfers = transfers.load(std::memory_order_relaxed);
+	c.bytes = bytes.load(std::memory_order_relaxed);
+	c.pings = pings.load(std::memory_order_relaxed);
+	c.midi = midi.load(std::memory_order_relaxed);
+	c.configs = configs.load(std::memory_order_relaxed);
+	c.sysx = sysx.load(std::memory_order_relaxed);
+	c.unknown = unknown.load(std::memory_order_relaxed);
+	c.overflows = overflows.load(std::memory_order_relaxed);
+	return c;
+}
+
+/*!
+ * what the simulated duino has taken and sent
+ */
+nlohmann::json DuinoSim::toJson() const
+{
+	const auto c = counters();
+	auto j = SpiTransport::toJson();
+	j["sim"] = {
+		{"transfers", c.transfers}, {"bytes", c.bytes}, {"pings", c.pings}, {"midi", c.midi}, {"configs", c.configs},
+		{"sysx", c.sysx}, {"unknown", c.unknown}, {"overflows", c.overflows}
+	};
+	return j;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "spi_transport.h"
+#include "xypiduino/include/xyspi.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*!
+ * a duino in process, on the far end of a simulated spi link, so the spi path can be run, and measured, on any box. it speaks the
+ * xyspi protocol as the duino does: pings get a pong, a request for the tempo gets the tempo, and it takes midi, tempo, configs
+ * and sysex frames. each byte that comes in is swapped for the next byte it has to send, or null, so an answer goes out no sooner
+ * than the byte after the command that asked for it, as on the wire. a transfer takes as long as its bits would at the clock rate,
+ * plus a fixed latency. with echo, the midi it gets comes back again, as if it had been played on the duino.
+ */
+class DuinoSim : public SpiTransport
+{
+public:
+	explicit DuinoSim(const spi_config_t& config);
+
+	void transfer(uint8_t* buf, std::size_t len) override;
+	const char* name() const override { return "sim"; }
+	nlohmann::json toJson() const override;
+
+	struct counters_t {
+		uint64_t transfers = 0;
+		uint64_t bytes = 0;		//!< each way
+		uint64_t pings = 0;
+		uint64_t midi = 0;		//!< midi messages taken
+		uint64_t configs = 0;
+		uint64_t sysx = 0;		//!< sysex bytes taken
+		uint64_t unknown = 0;	//!< command bytes we didn't know
+		uint64_t overflows = 0;	//!< bytes we had to send that didn't fit in the send buffer
+	};
+	counters_t counters() const;
+
+private:
+	enum class state_t : uint8_t { command, midi, tempo, cfgWhich, cfgLen, cfgData, sysxHeader, sysxData };
+
+	uint8_t exchange(uint8_t in);
+	void receive(uint8_t in);
+	void send(const uint8_t* data, std::size_t len);
+
+	double usPerByte;
+	std::chrono::microseconds latency;
+	bool echo;
+
+	state_t state = state_t::command;
+	std::size_t remaining = 0;	//!< bytes left in the frame coming in
+	std::array<uint8_t, xyspi::maxCmdLen> frame{};	//!< the frame coming in
+	std::size_t framePos = 0;
+	float tempo = 120;
+
+	static constexpr std::size_t outSize = 256;	//!< about what the duino has to spare
+	std::array<uint8_t, outSize> out{};	//!< bytes waiting to go, as a ring
+	std::size_t outHead = 0;
+	std::size_t outCount = 0;
+
+	std::atomic<uint64_t> transfers{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+	std::atomic<uint64_t> pings{ 0 };
+	std::atomic<uint64_t> midi{ 0 };
+	std::atomic<uint64_t> configs{ 0 };
+	std::atomic<uint64_t> sysx{ 0 };
+	std::atomic<uint64_t> unknown{ 0 };
+	std::atomic<uint64_t> overflows{ 0 };
+};
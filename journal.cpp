@@ -0,0 +1,412 @@
+#include "journal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <system_error>
+
+using spdlog::info;
+using spdlog::debug;
+using spdlog::warn;
+
+namespace xymsg {
+
+namespace {
+
+constexpr char journalMagic[8] = { 'x', 'y', 'j', 'o', 'u', 'r', 'n', 'l' };
+constexpr uint32_t journalVersion = 2;	//!< 2 has each sysex chunk's index
+constexpr std::size_t maxBody = 1024;	//!< the longest body: room for a full sysex chunk, and for most ws api commands, which are cut to fit
+
+/*!
+ * a message's body, as the bytes that go in its records
+ *  \return the number of bytes, or 0 for a message we don't keep
+ */
+std::size_t encode(const msg_t& msg, uint8_t* b)
+{
+	switch (typeOf(msg)) {
+	case typ::midi: {
+		const auto& m = std::get<MidiMsg>(msg.body).midi;
+		b[0] = m.port;
+		b[1] = m.cmd;
+		b[2] = m.val1;
+		b[3] = m.val2;
+		return 4;
+	}
+	case typ::midi_list: {
+		const auto& list = *std::get<MidiListMsg>(msg.body);
+		std::size_t n = 0;
+		for (const auto& m : list) {
+			b[n++] = m.port;
+			b[n++] = m.cmd;
+			b[n++] = m.val1;
+			b[n++] = m.val2;
+		}
+		return n;
+	}
+	case typ::config_button: {
+		const auto& c = *std::get<ConfigButtonMsg>(msg.body);
+		b[0] = c.which;
+		std::memcpy(b + 1, &c.cfg, sizeof(c.cfg));
+		return 1 + sizeof(c.cfg);
+	}
+	case typ::config_pedal: {
+		const auto& c = *std::get<ConfigPedalMsg>(msg.body);
+		b[0] = c.which;
+		std::memcpy(b + 1, &c.cfg, sizeof(c.cfg));
+		return 1 + sizeof(c.cfg);
+	}
+	case typ::config_xlrm8r: {
+		const auto& c = *std::get<ConfigXlm8rMsg>(msg.body);
+		b[0] = c.which;
+		std::memcpy(b + 1, &c.cfg, sizeof(c.cfg));
+		return 1 + sizeof(c.cfg);
+	}
+	case typ::tempo: {
+		const auto tempo = std::get<TempoMsg>(msg.body).tempo;
+		std::memcpy(b, &tempo, sizeof(tempo));
+		return sizeof(tempo);
+	}
+	case typ::duino_cmd:
+		b[0] = std::get<CmdMsg>(msg.body).cmd;
+		return 1;
+	case typ::sysx: {
+		const auto& chunk = *std::get<SysxMsg>(msg.body);
+		b[0] = chunk.port;
+		b[1] = (chunk.first ? 1 : 0) | (chunk.last ? 2 : 0) | (chunk.truncated ? 4 : 0);
+		std::memcpy(b + 2, &chunk.index, sizeof(chunk.index));
+		std::memcpy(b + 4, chunk.data.data(), chunk.len);
+		return 4 + chunk.len;
+	}
+	default:
+		return 0;
+	}
+}
+
+template<typename M, typename C>
+bool decodeConfig(const uint8_t* b, std::size_t len, msg_t& msg)
+{
+	auto ref = poolOf<C>().acquire();
+	if (!ref || len != 1 + sizeof(ref->cfg)) return false;
+	ref->which = b[0];
+	std::memcpy(&ref->cfg, b + 1, sizeof(ref->cfg));
+	msg = M(std::move(ref));
+	return true;
+}
+
+/*!
+ * a message from its record's type and body
+ *  \return false if the body doesn't fit the type, or the pool for it is exhausted
+ */
+bool decode(uint8_t type, const uint8_t* b, std::size_t len, msg_t& msg)
+{
+	switch (static_cast<typ>(type)) {
+	case typ::midi:
+		if (len != 4) return false;
+		msg = MidiMsg{ midi_t(b[1], b[2], b[3], b[0]) };
+		return true;
+	case typ::midi_list: {
+		auto list = poolOf<MidiList>().acquire();
+		if (!list || len % 4 != 0 || len / 4 > maxMidiList) return false;
+		for (std::size_t i = 0; i < len; i += 4) list->push_back(midi_t(b[i + 1], b[i + 2], b[i + 3], b[i]));
+		msg = std::move(list);
+		return true;
+	}
+	case typ::config_button:
+		return decodeConfig<ConfigButtonMsg, ConfigButton>(b, len, msg);
+	case typ::config_pedal:
+		return decodeConfig<ConfigPedalMsg, ConfigPedal>(b, len, msg);
+	case typ::config_xlrm8r:
+		return decodeConfig<ConfigXlm8rMsg, ConfigXlm8r>(b, len, msg);
+	case typ::tempo: {
+		float tempo;
+		if (len != sizeof(tempo)) return false;
+		std::memcpy(&tempo, b, sizeof(tempo));
+		msg = TempoMsg(tempo);
+		return true;
+	}
+	case typ::duino_cmd:
+		if (len != 1) return false;
+		msg = CmdMsg(b[0]);
+		return true;
+	case typ::sysx: {
+		auto chunk = poolOf<SysxChunk>().acquire();
+		if (!chunk || len < 4 || len - 4 > sysxChunkLen) return false;
+		chunk->port = b[0];
+		chunk->first = b[1] & 1;
+		chunk->last = b[1] & 2;
+		chunk->truncated = b[1] & 4;
+		std::memcpy(&chunk->index, b + 2, sizeof(chunk->index));
+		chunk->len = static_cast<uint16_t>(len - 4);
+		std::memcpy(chunk->data.data(), b + 4, chunk->len);
+		msg = std::move(chunk);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/*!
+ * map a file into memory
+ *  \throws std::system_error if it can't be
+ */
+uint8_t* mapFile(int fd, std::size_t len, bool writable, const std::string& path)
+{
+	void* p = ::mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "Journal: mmap " + path);
+	return static_cast<uint8_t*>(p);
+}
+
+}
+
+/*!
+ * \class Journal
+ * a capture of all the hub's traffic, for replaying later
+ *  \param capacity bytes of records the file may hold, which it is sized for up front
+ *  \throws std::system_error if the file can't be made
+ */
+Journal::Journal(const std::string& path, std::size_t capacity)
+	: start(std::chrono::steady_clock::now())
+{
+	capacity -= capacity % journal_record_t::size;
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) throw std::system_error(errno, std::generic_category(), "Journal: open " + path);
+	mapped = journal_header_t::size + capacity;
+	if (::ftruncate(fd, static_cast<off_t>(mapped)) != 0) {
+		const auto err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category(), "Journal: ftruncate " + path);
+	}
+	try {
+		base = mapFile(fd, mapped, true, path);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	header = new (base) journal_header_t;
+	std::memcpy(header->magic, journalMagic, sizeof(journalMagic));
+	header->version = journalVersion;
+	header->recordSize = journal_record_t::size;
+	header->startUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	header->used.store(0, std::memory_order_release);
+	info("Journal recording to {}, room for {} records", path, capacity / journal_record_t::size);
+}
+
+/*!
+ * close the journal, trimming the file down to the records in it
+ */
+Journal::~Journal()
+{
+	const auto used = header->used.load(std::memory_order_acquire);
+	::msync(base, mapped, MS_SYNC);
+	::munmap(base, mapped);
+	if (::ftruncate(fd, static_cast<off_t>(journal_header_t::size + used)) != 0) warn("Journal couldn't trim the file: {}", std::strerror(errno));
+	::close(fd);
+	info("Journal closed with {} records, {} dropped", records.load(), dropped.load());
+}
+
+/*!
+ * keep a message, with the sinks it went to. safe from any thread
+ */
+void Journal::record(const msg_t& msg, uint8_t to)
+{
+	std::array<uint8_t, maxBody> body;
+	journal_record_t head;
+	head.len = static_cast<uint16_t>(encode(msg, body.data()));
+	if (head.len == 0) return;
+	head.tUs = static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(msg.t - start).count()));
+	head.dueUs = msg.dueUs;
+	head.type = static_cast<uint8_t>(typeOf(msg));
+	head.from = static_cast<uint8_t>(msg.from);
+	head.to = to;
+	append(head, body.data());
+}
+
+/*!
+ * keep a ws api command that went to the command queue, as the request it came in
+ */
+void Journal::recordCmd(const std::string& request)
+{
+	journal_record_t head;
+	head.len = static_cast<uint16_t>(std::min(request.size(), maxBody));
+	head.tUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	head.type = journal_record_t::cmdType;
+	head.from = static_cast<uint8_t>(source::ws);
+	append(head, reinterpret_cast<const uint8_t*>(request.data()));
+}
+
+/*!
+ * take the room for a record and its body, and write them. the type goes in last, so a reader never sees half a record
+ */
+void Journal::append(const journal_record_t& head, const uint8_t* body)
+{
+	const auto bytes = head.records() * journal_record_t::size;
+	const auto at = next.fetch_add(bytes, std::memory_order_relaxed);
+	if (at + bytes > mapped - journal_header_t::size) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	auto p = base + journal_header_t::size + at;
+	auto rec = head;
+	rec.type = 0;
+	const auto inlineLen = std::min<std::size_t>(head.len, journal_record_t::inlineBody);
+	std::memcpy(rec.body, body, inlineLen);
+	std::memcpy(p, &rec, sizeof(rec));
+	if (head.len > inlineLen) std::memcpy(p + journal_record_t::size, body + inlineLen, head.len - inlineLen);
+	reinterpret_cast<std::atomic<uint8_t>*>(p + offsetof(journal_record_t, type))->store(head.type, std::memory_order_release);
+	auto used = header->used.load(std::memory_order_relaxed);
+	while (used < at + bytes && !header->used.compare_exchange_weak(used, at + bytes, std::memory_order_release, std::memory_order_relaxed)) {}
+	records.fetch_add(1, std::memory_order_relaxed);
+}
+
+Journal::counters_t Journal::counters() const
+{
+	return { records.load(std::memory_order_relaxed), dropped.load(std::memory_order_relaxed),
+		static_cast<std::size_t>(header->used.load(std::memory_order_relaxed)), mapped - journal_header_t::size };
+}
+
+/*!
+ * \class JournalReplay
+ * feeds a journal back into the hub
+ *  \throws std::system_error if the file can't be read, or std::invalid_argument if it isn't a journal
+ */
+JournalReplay::JournalReplay(const std::string& path, Router& _router, double _speed, on_cmd_t _onCmd)
+	: router(_router), speed(_speed), onCmd(std::move(_onCmd))
+{
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) throw std::system_error(errno, std::generic_category(), "JournalReplay: open " + path);
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < journal_header_t::size) {
+		::close(fd);
+		throw std::invalid_argument("JournalReplay: " + path + " is too short to be a journal");
+	}
+	mapped = static_cast<std::size_t>(st.st_size);
+	try {
+		base = mapFile(fd, mapped, false, path);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	const auto header = reinterpret_cast<const journal_header_t*>(base);
+	if (std::memcmp(header->magic, journalMagic, sizeof(journalMagic)) != 0 || header->version != journalVersion
+			|| header->recordSize != journal_record_t::size) {
+		::munmap(const_cast<uint8_t*>(base), mapped);
+		::close(fd);
+		throw std::invalid_argument("JournalReplay: " + path + " isn't a journal we can read");
+	}
+	used = std::min<std::size_t>(header->used.load(std::memory_order_acquire), mapped - journal_header_t::size);
+	info("JournalReplay playing {} bytes of records from {} at {}", used, path, speed > 0 ? fmt::format("{}x", speed) : "full speed");
+}
+
+JournalReplay::~JournalReplay()
+{
+	stop();
+	::munmap(const_cast<uint8_t*>(base), mapped);
+	::close(fd);
+}
+
+void JournalReplay::run()
+{
+	if (!isRunning.exchange(true)) {
+		debug("JournalReplay::run() launching player");
+		myThread = std::thread([this]() { runner(); });
+	}
+}
+
+/*!
+ * stop, waking the player if it's waiting for a message's time
+ */
+void JournalReplay::stop()
+{
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning.exchange(false)) return;
+	}
+	wake.notify_all();
+	if (myThread.joinable()) myThread.join();
+}
+
+JournalReplay::stats_t JournalReplay::stats() const
+{
+	stats_t s;
+	s.replayed = replayed.load(std::memory_order_relaxed);
+	s.skipped = skipped.load(std::memory_order_relaxed);
+	s.total = total.load(std::memory_order_relaxed);
+	s.lateness = lateness.snapshot();
+	return s;
+}
+
+/*!
+ * main body of the player. each message is routed at its time from the first, and stamped as coming in now, with its send time
+ * scaled along with everything else
+ */
+void JournalReplay::runner()
+{
+	using clock_t = std::chrono::steady_clock;
+	const auto records = base + journal_header_t::size;
+	const auto startedAt = clock_t::now();
+	uint64_t firstUs = 0;
+	bool first = true;
+	std::array<uint8_t, maxBody> body;
+	for (std::size_t at = 0; at + journal_record_t::size <= used && isRunning; ) {
+		journal_record_t head;
+		std::memcpy(&head, records + at, sizeof(head));
+		at += head.records() * journal_record_t::size;
+		if (head.type == 0 || at > used || head.len > maxBody) {
+			skipped.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		total.fetch_add(1, std::memory_order_relaxed);
+		if (first) {
+			firstUs = head.tUs;
+			first = false;
+		}
+		const auto inlineLen = std::min<std::size_t>(head.len, journal_record_t::inlineBody);
+		std::memcpy(body.data(), head.body, inlineLen);
+		if (head.len > inlineLen) std::memcpy(body.data() + inlineLen, records + at - (head.records() - 1) * journal_record_t::size, head.len - inlineLen);
+
+		if (speed > 0) {
+			// routers racing to journal can leave a record a little before the first, which plays straight away
+			const auto sinceFirst = head.tUs > firstUs ? head.tUs - firstUs : 0;
+			const auto due = startedAt + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double, std::micro>(sinceFirst / speed));
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (wake.wait_until(lock, due, [this]() { return !isRunning; })) break;
+			}
+			const auto late = std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - due).count();
+			lateness.record(late > 0 ? static_cast<uint64_t>(late) : 0);
+		}
+		if (head.type == journal_record_t::cmdType) {
+			try {
+				if (onCmd) onCmd(std::string(reinterpret_cast<const char*>(body.data()), head.len));
+				replayed.fetch_add(1, std::memory_order_relaxed);
+			} catch (const std::exception& e) {
+				warn("JournalReplay skipping a ws api command: {}", e.what());
+				skipped.fetch_add(1, std::memory_order_relaxed);
+			}
+			continue;
+		}
+		msg_t msg;
+		if (head.from >= nSources || !decode(head.type, body.data(), head.len, msg)) {
+			skipped.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		if (head.dueUs != 0 && speed > 0) msg.setDue(clock_t::now() + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double, std::micro>(head.dueUs / speed)));
+		router.route(static_cast<source>(head.from), std::move(msg));
+		replayed.fetch_add(1, std::memory_order_relaxed);
+	}
+	const auto s = stats();
+	info("JournalReplay finished: {} of {} replayed, {} skipped, late mean {}us, p99 {}us, max {}us", s.replayed, s.total, s.skipped,
+		s.lateness.meanUs(), s.lateness.percentile(0.99), s.lateness.maxUs);
+	finished = true;
+}
+
+}
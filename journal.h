@@ -0,0 +1,138 @@
+#pragma once
+
+#include "message.h"
+#include "router.h"
+#include "locked/meter.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace xymsg {
+
+/*!
+ * the journal's fixed size record. a message's body goes in the record, and carries on into as many of the records after it as
+ * it needs, which are raw bytes
+ */
+struct journal_record_t {
+	static constexpr std::size_t size = 32;
+	static constexpr std::size_t inlineBody = 12;
+
+	uint64_t tUs = 0;	//!< when the message came into the hub, in microseconds from the start of the journal
+	uint32_t dueUs = 0;	//!< as in msg_t
+	uint16_t len = 0;	//!< bytes of body
+	uint8_t type = 0;	//!< the message typ, or cmdType for a ws api command. 0 is a record never finished
+	uint8_t from = 0;	//!< source
+	uint8_t to = 0;		//!< the sinks it went to, as a bit mask
+	uint8_t reserved[3] = {};
+	uint8_t body[inlineBody] = {};
+
+	static constexpr uint8_t cmdType = 0x80;
+
+	std::size_t records() const { return 1 + (len > inlineBody ? (len - inlineBody + size - 1) / size : 0); }
+};
+static_assert(sizeof(journal_record_t) == journal_record_t::size, "journal records are a fixed size");
+
+/*!
+ * the start of a journal file
+ */
+struct journal_header_t {
+	static constexpr std::size_t size = 64;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t startUs;	//!< wall clock time at the start of the journal, in microseconds since 1970
+	std::atomic<uint64_t> used;	//!< bytes of records written, after the header
+};
+
+/*!
+ * records everything that comes into the hub, as the router sees it, with the time it came in, where it came from and which of
+ * the queues it went to, along with the ws api commands that go to the command queue. the journal is a file mapped into memory,
+ * written by whichever thread routes the message: each record's place is taken with an atomic add, so writers never wait on one
+ * another, and a journal cut short by a crash still reads back to the last record written. when the file is full we stop, and
+ * count what we couldn't keep. what the hub makes itself, its clock and sequencer, is left out, since a replay makes it again.
+ */
+class Journal
+{
+public:
+	Journal(const std::string& path, std::size_t capacity);
+	~Journal();
+
+	void record(const msg_t& msg, uint8_t to);
+	void recordCmd(const std::string& request);
+
+	struct counters_t {
+		uint64_t records = 0;	//!< messages and commands kept
+		uint64_t dropped = 0;	//!< those we had no room for
+		std::size_t bytes = 0;
+		std::size_t capacity = 0;
+	};
+	counters_t counters() const;
+
+private:
+	void append(const journal_record_t& head, const uint8_t* body);
+
+	int fd = -1;
+	uint8_t* base = nullptr;
+	std::size_t mapped = 0;
+	journal_header_t* header = nullptr;
+	std::chrono::steady_clock::time_point start;
+	std::atomic<uint64_t> next{ 0 };	//!< where the next record goes, after the header. may run past the end once we're full
+	std::atomic<uint64_t> records{ 0 };
+	std::atomic<uint64_t> dropped{ 0 };
+};
+
+/*!
+ * plays a journal back into the hub on a thread of its own, routing each message from where it came from originally, and
+ * handing each ws api command to onCmd. messages go at their original pace, scaled by the speed, or as fast as we can for a
+ * speed of 0.
+ */
+class JournalReplay
+{
+public:
+	using on_cmd_t = std::function<void(const std::string& request)>;
+
+	JournalReplay(const std::string& path, Router& _router, double _speed, on_cmd_t _onCmd);
+	~JournalReplay();
+
+	void run();
+	void stop();
+	bool done() const { return finished; }
+
+	struct stats_t {
+		uint64_t replayed = 0;
+		uint64_t skipped = 0;	//!< records we couldn't make a message of
+		uint64_t total = 0;	//!< messages and commands in the journal
+		locked::dwell_hist_t lateness;	//!< how far behind its time each message went, in microseconds
+	};
+	stats_t stats() const;
+
+private:
+	void runner();
+
+	int fd = -1;
+	const uint8_t* base = nullptr;
+	std::size_t mapped = 0;
+	std::size_t used = 0;
+	Router& router;
+	double speed;
+	on_cmd_t onCmd;
+	std::atomic<bool> isRunning{ false };
+	std::atomic<bool> finished{ false };
+	std::thread myThread;
+	std::mutex mutex;	//!< for waiting on wake
+	std::condition_variable wake;	//!< stop() wakes the player from waiting for a message's time
+	std::atomic<uint64_t> replayed{ 0 };
+	std::atomic<uint64_t> skipped{ 0 };
+	std::atomic<uint64_t> total{ 0 };
+	locked::hist_meter lateness;
+};
+
+}
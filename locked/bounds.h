@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace locked {
+
+/*!
+ * what a bounded queue does with a push when it is already at capacity
+ */
+enum class overflow : uint8_t {
+	unbounded = 0,	//!< no limit. the queue grows until we run out of memory
+	drop_oldest = 1,	//!< discard the head of the queue to make room
+	drop_newest = 2,	//!< discard the element being pushed
+	block = 3,		//!< wait up to the timeout for the consumer to make room, then drop the element being pushed
+	coalesce = 4	//!< overwrite a queued element with the same key, otherwise drop the oldest
+};
+
+/*!
+ * capacity and overflow policy for a queue
+ */
+struct bounds_t {
+	std::size_t capacity = 0;
+	overflow policy = overflow::unbounded;
+	std::chrono::milliseconds timeout{ 5 }; //!< how long a push may wait with the 'block' policy
+};
+
+/*!
+ * overflow accounting for a bounded queue
+ */
+struct counters_t {
+	uint64_t overflows = 0;	//!< elements dropped because the queue was full
+	uint64_t coalesced = 0;	//!< elements merged into a queued element with the same key
+	std::size_t highWater = 0;	//!< the deepest the queue has been
+};
+
+/*!
+ * parse a queue bounds spec, as given on the command line: <capacity>[:<policy>[:<timeout ms>]]
+ * where policy is one of drop_oldest, drop_newest, block or coalesce. a capacity of 0 is unbounded.
+ *  \throws std::invalid_argument on a badly formed spec
+ */
+inline bounds_t parseBounds(const std::string& spec)
+{
+	bounds_t b;
+	const auto p1 = spec.find(':');
+	try {
+		b.capacity = std::stoul(spec.substr(0, p1));
+	} catch (const std::exception&) {
+		throw std::invalid_argument("Bad queue capacity in '" + spec + "'");
+	}
+	if (b.capacity == 0) return b;
+	b.policy = overflow::drop_oldest;
+	if (p1 == std::string::npos) return b;
+
+	const auto p2 = spec.find(':', p1 + 1);
+	const auto policy = spec.substr(p1 + 1, p2 == std::string::npos ? std::string::npos : p2 - p1 - 1);
+	if (policy == "drop_oldest") b.policy = overflow::drop_oldest;
+	else if (policy == "drop_newest") b.policy = overflow::drop_newest;
+	else if (policy == "block") b.policy = overflow::block;
+	else if (policy == "coalesce") b.policy = overflow::coalesce;
+	else throw std::invalid_argument("Unknown queue overflow policy '" + policy + "'");
+
+	if (p2 != std::string::npos) {
+		try {
+			b.timeout = std::chrono::milliseconds(std::stoul(spec.substr(p2 + 1)));
+		} catch (const std::exception&) {
+			throw std::invalid_argument("Bad queue timeout in '" + spec + "'");
+		}
+	}
+	return b;
+}
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace locked {
+
+/*!
+ * thread safe map of values that expire. the map is split into S shards, each with its own lock, so callers on different keys
+ * rarely contend, and a foreach() only ever holds one shard's lock at a time.
+ * every value lives for the same time-to-live, so each shard's insertion order is also its expiry order, and expired values are
+ * cleared from the oldest end as we go: the shard being inserted into, and one other shard in turn. values also carry a size,
+ * and if the total goes over the memory cap, the oldest values in the inserting shard make way.
+ */
+template<typename K, typename V, std::size_t S = 16>
+class expiring_map
+{
+	using clock = std::chrono::steady_clock;
+public:
+	/*!
+	 * set the time-to-live for new values, and the total size of values we'll hold. a max of 0 is unlimited
+	 */
+	void configure(std::chrono::seconds _ttl, std::size_t _maxBytes)
+	{
+		ttl = _ttl;
+		maxBytes = _maxBytes;
+	}
+
+	/*!
+	 * safely inserts the element, replacing any existing value for the key.
+	 *  \param bytes the memory the value accounts for against the cap
+	 */
+	void insert(const K& key, V&& value, std::size_t bytes)
+	{
+		const auto now = clock::now();
+		{
+			auto& s = shardOf(key);
+			const std::unique_lock<std::mutex> lock(s.mutex);
+			auto it = s.imap.find(key);
+			if (it != s.imap.end()) erase(s, it);
+			s.order.push_back(key);
+			s.imap.emplace(key, entry_t{ std::move(value), now + ttl, bytes, std::prev(s.order.end()) });
+			totalBytes += bytes;
+			expire(s, now);
+			while (maxBytes > 0 && totalBytes > maxBytes && s.order.size() > 1) {
+				erase(s, s.imap.find(s.order.front()));
+				++evicted;
+			}
+		}
+		auto& other = shards[nextSweep++ % S];
+		const std::unique_lock<std::mutex> lock(other.mutex);
+		expire(other, now);
+	}
+
+	/*!
+	 * grabs the element from the map matching 'key', and removing it if found.
+	 *  \return the value, and false if not available or expired
+	 */
+	std::pair<V, bool> fetch(const K& key)
+	{
+		auto& s = shardOf(key);
+		const std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.imap.find(key);
+		if (it == s.imap.end()) return { V(), false };
+		const bool live = it->second.expires > clock::now();
+		auto v = std::move(it->second.value);
+		erase(s, it);
+		if (!live) return { V(), false };
+		return { std::move(v), true };
+	}
+
+	/*!
+	 * runs the given function over every live element in the map, one shard at a time
+	 */
+	void foreach(std::function<void(const K&, const V&)> f)
+	{
+		const auto now = clock::now();
+		for (auto& s : shards) {
+			const std::unique_lock<std::mutex> lock(s.mutex);
+			for (auto const& it : s.imap) {
+				if (it.second.expires > now) f(it.first, it.second.value);
+			}
+		}
+	}
+
+	std::size_t bytes() const { return totalBytes.load(); }
+	uint64_t expiredCount() const { return expired.load(); }
+	uint64_t evictedCount() const { return evicted.load(); }
+
+private:
+	struct entry_t {
+		V value;
+		clock::time_point expires;
+		std::size_t bytes;
+		typename std::list<K>::iterator pos; //!< where we are in the shard's insertion order
+	};
+
+	struct shard_t {
+		std::mutex mutex;
+		std::unordered_map<K, entry_t> imap;
+		std::list<K> order; //!< oldest first
+	};
+
+	shard_t& shardOf(const K& key) { return shards[std::hash<K>{}(key) % S]; }
+
+	/*!
+	 * drop everything in s that has passed its time. called with the shard locked
+	 */
+	void expire(shard_t& s, clock::time_point now)
+	{
+		while (!s.order.empty()) {
+			auto it = s.imap.find(s.order.front());
+			if (it->second.expires > now) break;
+			erase(s, it);
+			++expired;
+		}
+	}
+
+	void erase(shard_t& s, typename std::unordered_map<K, entry_t>::iterator it)
+	{
+		totalBytes -= it->second.bytes;
+		s.order.erase(it->second.pos);
+		s.imap.erase(it);
+	}
+
+	std::array<shard_t, S> shards;
+	std::chrono::seconds ttl{ 300 };
+	std::size_t maxBytes = 0;
+	std::atomic<std::size_t> totalBytes{ 0 };
+	std::atomic<std::size_t> nextSweep{ 0 };
+	std::atomic<uint64_t> expired{ 0 };
+	std::atomic<uint64_t> evicted{ 0 };
+};
+
+}
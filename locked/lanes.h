@@ -0,0 +1,282 @@
+#pragma once
+
+#include "bounds.h"
+#include "meter.h"
+#include "waiter.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace locked {
+
+/*!
+ * an element, stamped with the time it was queued
+ */
+template<typename T>
+struct stamped {
+	T value;
+	std::chrono::steady_clock::time_point t;
+
+	bool operator==(const stamped& o) const { return value == o.value; }
+};
+
+/*!
+ * how a multi lane queue picks the lane it takes from next
+ *	- strict: always empty the highest priority (lowest numbered) lane first
+ *	- weighted: take up to weights[i] elements from each lane in turn. a lane without a weight gets 1
+ */
+struct lane_policy_t {
+	bool weighted = false;
+	std::vector<uint32_t> weights;
+};
+
+/*!
+ * parse a lane policy, as given on the command line: 'strict', or 'weighted:<w0>,<w1>,...'
+ *  \throws std::invalid_argument on a badly formed spec
+ */
+inline lane_policy_t parseLanePolicy(const std::string& spec)
+{
+	lane_policy_t p;
+	if (spec == "strict") return p;
+	const std::string prefix = "weighted:";
+	if (spec.compare(0, prefix.size(), prefix) != 0) throw std::invalid_argument("Unknown lane policy '" + spec + "'");
+	p.weighted = true;
+	for (std::size_t pos = prefix.size(); pos < spec.size(); ) {
+		const auto end = std::min(spec.find(',', pos), spec.size());
+		try {
+			p.weights.push_back(std::max<uint32_t>(1, std::stoul(spec.substr(pos, end - pos))));
+		} catch (const std::exception&) {
+			throw std::invalid_argument("Bad lane weight in '" + spec + "'");
+		}
+		pos = end + 1;
+	}
+	return p;
+}
+
+/*!
+ * a queue made of N priority lanes, each an inner queue of stamped<T> (a locked::queue or one of the rings), that a classifier
+ * function sorts pushes into. a single consumer drain()s across the lanes by the lane policy, which is strict priority by default,
+ * so a burst in a low priority lane never holds up a high priority one.
+ * the inner queues don't wait themselves: we wait for the consumer here, across all the lanes at once.
+ */
+template<typename T, typename Q, std::size_t N>
+class lanes
+{
+public:
+	using stamped_t = stamped<T>;
+	using classifier_t = std::function<std::size_t(const T&)>;
+
+	lanes()
+	{
+		for (auto& l : lane) {
+			l.enable();
+			l.disableWait();
+		}
+	}
+
+	/*!
+	 * clear any threads waiting on this queue. the queue will still function safely if not 'enabled' but will not block the drain()
+	 * method while waiting for data.
+	 */
+	void disableWait() { waiting.disable(); }
+
+	/*!
+	 * enable pushes to the queue. there should be a running consumer
+	 */
+	void enable(bool _en=true) { isRunning.store(_en); }
+
+	/*!
+	 * enable a wait for data on the drain() method
+	 */
+	void enableWait() { waiting.enable(); }
+
+	/*!
+	 * check that blocking mode is enabled
+	 */
+	bool waitEnabled() { return waiting.enabled(); }
+
+	/*!
+	 * select how the consumer waits for data
+	 */
+	void setWaitMode(wait_mode _mode) { waiting.setMode(_mode); }
+
+	/*!
+	 * have pushes call notify after the consumer arm()s the queue, for a consumer that runs as a handler rather than waiting on a
+	 * thread of its own. see waiter::arm()
+	 */
+	void setNotify(std::function<void()> _notify) { waiting.setNotify(std::move(_notify)); }
+
+	/*!
+	 * consumer side: ask to be notified of the next push.
+	 *  \return true if there is already data to drain, in which case there'll be no notification
+	 */
+	bool arm() { return waiting.arm([this]() { return !empty(); }); }
+
+	void disarm() { waiting.disarm(); }
+
+	/*!
+	 * set the function that picks a lane for each pushed element. without one, everything goes in lane 0. set this, and the policy,
+	 * before the queue is enabled.
+	 */
+	void setClassifier(classifier_t _classify) { classify = std::move(_classify); }
+
+	void setPolicy(const lane_policy_t& _policy) { policy = _policy; }
+
+	/*!
+	 * bound each lane to the given capacity and overflow policy. the capacity is each lane's, so the queue as a whole holds up to
+	 * N times as much
+	 */
+	void setBounds(const bounds_t& _bounds, std::function<uint64_t(const T&)> keyOf = nullptr)
+	{
+		for (auto& l : lane) {
+			if (keyOf) {
+				l.setBounds(_bounds, [keyOf](const stamped_t& s) { return keyOf(s.value); });
+			} else {
+				l.setBounds(_bounds);
+			}
+		}
+	}
+
+	/*!
+	 * push r-value to the back of its lane. only what the lane takes is metered: a value it drops or coalesces is counted in its
+	 * overflow counters instead
+	 */
+	void push(T&& value)
+	{
+		if (!isRunning.load(std::memory_order_relaxed)) return;
+		const auto l = classify ? std::min(classify(value), N - 1) : 0;
+		if (!lane[l].push(stamped_t{ std::move(value), std::chrono::steady_clock::now() })) return;
+		meters[l].pushed();
+		waiting.signal();
+	}
+
+	/*!
+	 * push a copy to the back of its lane, for values that are cheap to copy and go to more than one queue
+	 */
+	void push(const T& value) { push(T(value)); }
+
+	/*!
+	 * moves up to max_n elements into out, highest priority lanes first (or by weight). out is cleared first, and keeps its
+	 * capacity. if waiting is enabled, this blocks until there is at least one element. consumer thread only.
+	 *  \return the number of elements now in out
+	 */
+	std::size_t drain(std::vector<T>& out, std::size_t max_n)
+	{
+		return drainUntil(out, max_n, std::chrono::steady_clock::time_point::max());
+	}
+
+	/*!
+	 * as drain(), but gives up waiting after the timeout
+	 */
+	template<typename Rep, typename Period>
+	std::size_t drain(std::vector<T>& out, std::size_t max_n, const std::chrono::duration<Rep, Period> timeout)
+	{
+		return drainUntil(out, max_n, std::chrono::steady_clock::now() + timeout);
+	}
+
+	bool empty()
+	{
+		return std::all_of(lane.begin(), lane.end(), [](Q& l) { return l.empty(); });
+	}
+
+	/*!
+	 * overflow accounting summed over all the lanes. the high water mark is the sum of the lanes' marks, so it is an upper bound
+	 */
+	counters_t counters()
+	{
+		counters_t c;
+		for (auto& l : lane) {
+			const auto lc = l.counters();
+			c.overflows += lc.overflows;
+			c.coalesced += lc.coalesced;
+			c.highWater += lc.highWater;
+		}
+		return c;
+	}
+
+	counters_t counters(std::size_t l) { return lane[l].counters(); }
+
+	/*!
+	 * depth, throughput and dwell time through lane l. the rates are since the last time lane l's stats were taken
+	 */
+	queue_stats_t stats(std::size_t l)
+	{
+		return rates[l].stats(lane[l].size(), meters[l].enqueuedCount(), meters[l].dwell());
+	}
+
+	/*!
+	 * as stats(l), across all the lanes
+	 */
+	queue_stats_t stats()
+	{
+		std::size_t depth = 0;
+		uint64_t enqueued = 0;
+		dwell_hist_t d;
+		for (std::size_t l = 0; l < N; ++l) {
+			depth += lane[l].size();
+			enqueued += meters[l].enqueuedCount();
+			d.add(meters[l].dwell());
+		}
+		return rates[N].stats(depth, enqueued, d);
+	}
+
+	static constexpr std::size_t laneCount() { return N; }
+
+private:
+	std::size_t drainUntil(std::vector<T>& out, std::size_t max_n, std::chrono::steady_clock::time_point deadline)
+	{
+		out.clear();
+		if (!waiting.await([this]() { return !empty(); }, deadline)) return 0;
+		if (!policy.weighted) {
+			for (std::size_t l = 0; l < N && out.size() < max_n; ++l) {
+				take(l, max_n - out.size(), out);
+			}
+		} else {
+			// keep going round while some lane might still have more than its share waiting
+			for (bool more = true; more && out.size() < max_n; ) {
+				more = false;
+				for (std::size_t l = 0; l < N && out.size() < max_n; ++l) {
+					const std::size_t w = l < policy.weights.size() ? policy.weights[l] : 1;
+					if (take(l, std::min(w, max_n - out.size()), out) == w) more = true;
+				}
+			}
+		}
+		return out.size();
+	}
+
+	/*!
+	 * move up to n elements from lane l to out, noting how long each sat in the lane
+	 */
+	std::size_t take(std::size_t l, std::size_t n, std::vector<T>& out)
+	{
+		if (lane[l].drain(scratch, n) == 0) return 0;
+		const auto now = std::chrono::steady_clock::now();
+		for (auto& s : scratch) {
+			meters[l].popped(std::chrono::duration_cast<std::chrono::microseconds>(now - s.t).count());
+			out.push_back(std::move(s.value));
+		}
+		const auto n_taken = scratch.size();
+		scratch.clear();
+		return n_taken;
+	}
+
+	std::array<Q, N> lane;
+	std::array<queue_meter, N> meters;
+	std::array<rate_meter, N + 1> rates;	//!< one per lane, and one for the whole queue
+	std::vector<stamped_t> scratch;	//!< consumer's buffer for draining a single lane
+	classifier_t classify;
+	lane_policy_t policy;
+	waiter waiting;
+	std::atomic<bool> isRunning{ false };	//!< we have a running worker to remove things from the queue
+};
+
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace locked {
+
+/*!
+ * what a queue can tell us about how it's doing
+ */
+struct queue_stats_t {
+	std::size_t depth = 0;		//!< elements queued right now
+	uint64_t enqueued = 0;		//!< pushes since we started, including any later dropped as overflows
+	uint64_t dequeued = 0;		//!< elements taken by the consumer since we started
+	double enqueueRate = 0;	//!< per second, since the previous stats were taken
+	double dequeueRate = 0;
+	uint64_t meanUs = 0;	//!< dwell: how long elements waited in the queue before the consumer took them
+	uint64_t p50Us = 0;
+	uint64_t p99Us = 0;
+	uint64_t maxUs = 0;
+};
+
+/*!
+ * histogram of dwell times in microseconds, in power of two buckets: bucket 0 is under 1us, and bucket i holds [2^(i-1), 2^i)
+ */
+struct dwell_hist_t {
+	static constexpr std::size_t nBuckets = 40;
+
+	std::array<uint64_t, nBuckets> buckets{};
+	uint64_t count = 0;
+	uint64_t totalUs = 0;
+	uint64_t maxUs = 0;
+
+	static std::size_t bucketOf(uint64_t us)
+	{
+		std::size_t b = 0;
+		for (; us > 0 && b < nBuckets - 1; us >>= 1) ++b;
+		return b;
+	}
+
+	void add(const dwell_hist_t& o)
+	{
+		for (std::size_t i = 0; i < nBuckets; ++i) buckets[i] += o.buckets[i];
+		count += o.count;
+		totalUs += o.totalUs;
+		maxUs = std::max(maxUs, o.maxUs);
+	}
+
+	uint64_t meanUs() const { return count > 0 ? totalUs / count : 0; }
+
+	/*!
+	 * the dwell time p (0..1) of the elements came in under, interpolated within its bucket
+	 */
+	uint64_t percentile(double p) const
+	{
+		if (count == 0) return 0;
+		const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(p * count + 0.5));
+		uint64_t below = 0;
+		for (std::size_t i = 0; i < nBuckets; ++i) {
+			if (below + buckets[i] >= target) {
+				const uint64_t lo = i == 0 ? 0 : uint64_t(1) << (i - 1);
+				const uint64_t hi = uint64_t(1) << i;
+				return std::min(maxUs, lo + (hi - lo) * (target - below) / buckets[i]);
+			}
+			below += buckets[i];
+		}
+		return maxUs;
+	}
+};
+
+/*!
+ * a histogram of times, in microseconds, that any number of threads may record() into, alongside a reader taking a snapshot
+ */
+class hist_meter
+{
+public:
+	void record(uint64_t us)
+	{
+		buckets[dwell_hist_t::bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		totalUs.fetch_add(us, std::memory_order_relaxed);
+		uint64_t mx = maxUs.load(std::memory_order_relaxed);
+		while (us > mx && !maxUs.compare_exchange_weak(mx, us, std::memory_order_relaxed)) {}
+	}
+
+	dwell_hist_t snapshot() const
+	{
+		dwell_hist_t d;
+		for (std::size_t i = 0; i < dwell_hist_t::nBuckets; ++i) d.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		d.count = count.load(std::memory_order_relaxed);
+		d.totalUs = totalUs.load(std::memory_order_relaxed);
+		d.maxUs = maxUs.load(std::memory_order_relaxed);
+		return d;
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, dwell_hist_t::nBuckets> buckets{};
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> totalUs{ 0 };
+	std::atomic<uint64_t> maxUs{ 0 };
+};
+
+/*!
+ * counts elements in and out of a queue, and how long they waited. pushed() is safe from any number of producers, and popped() from
+ * the consumer; either may run alongside a reader taking a snapshot.
+ */
+class queue_meter
+{
+public:
+	void pushed(uint64_t n = 1) { enqueued.fetch_add(n, std::memory_order_relaxed); }
+	void popped(uint64_t us) { hist.record(us); }
+
+	uint64_t enqueuedCount() const { return enqueued.load(std::memory_order_relaxed); }
+	dwell_hist_t dwell() const { return hist.snapshot(); }
+
+private:
+	std::atomic<uint64_t> enqueued{ 0 };
+	hist_meter hist;
+};
+
+/*!
+ * turns running totals into rates over the time since we were last asked
+ */
+class rate_meter
+{
+	using clock = std::chrono::steady_clock;
+public:
+	/*!
+	 * put together the stats for a queue from its totals and dwell histogram, with rates since the last call
+	 */
+	queue_stats_t stats(std::size_t depth, uint64_t enqueued, const dwell_hist_t& d)
+	{
+		queue_stats_t s;
+		s.depth = depth;
+		s.enqueued = enqueued;
+		s.dequeued = d.count;
+		s.meanUs = d.meanUs();
+		s.p50Us = d.percentile(0.5);
+		s.p99Us = d.percentile(0.99);
+		s.maxUs = d.maxUs;
+
+		const std::unique_lock<std::mutex> lock(mutex);
+		const auto now = clock::now();
+		const double secs = std::chrono::duration<double>(now - last).count();
+		if (secs > 0) {
+			s.enqueueRate = (enqueued - lastEnqueued) / secs;
+			s.dequeueRate = (d.count - lastDequeued) / secs;
+		}
+		last = now;
+		lastEnqueued = enqueued;
+		lastDequeued = d.count;
+		return s;
+	}
+
+private:
+	std::mutex mutex;
+	clock::time_point last = clock::now();
+	uint64_t lastEnqueued = 0;
+	uint64_t lastDequeued = 0;
+};
+
+}
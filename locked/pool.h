@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace locked {
+
+template<typename T> class slab_pool;
+
+/*!
+ * occupancy accounting for a slab pool
+ */
+struct pool_counters_t {
+	std::size_t capacity = 0;
+	std::size_t inUse = 0;		//!< slots held right now
+	std::size_t highWater = 0;	//!< the most slots ever held at once
+	uint64_t acquired = 0;		//!< slots handed out since we started
+	uint64_t exhausted = 0;		//!< acquires that failed because every slot was in use
+};
+
+/*!
+ * a slot in a slab pool: the value, its reference count, and its link in the pool's free list
+ */
+template<typename T>
+struct pool_slot {
+	T value;
+	std::atomic<uint32_t> refs{ 0 };
+	std::atomic<uint32_t> next{ 0 };	//!< next free slot, while we're free
+	slab_pool<T>* pool = nullptr;
+};
+
+/*!
+ * shared reference to a value in a slab pool, counted in the slot itself. copies share the slot, and the last reference to go
+ * hands it back to the pool. a default constructed ref, or one from an exhausted pool, is empty.
+ */
+template<typename T>
+class pool_ref
+{
+public:
+	pool_ref() = default;
+	pool_ref(const pool_ref& o) : slot(o.slot) { if (slot) slot->refs.fetch_add(1, std::memory_order_relaxed); }
+	pool_ref(pool_ref&& o) noexcept : slot(std::exchange(o.slot, nullptr)) {}
+	~pool_ref() { reset(); }
+
+	pool_ref& operator=(const pool_ref& o)
+	{
+		if (o.slot) o.slot->refs.fetch_add(1, std::memory_order_relaxed);
+		reset();
+		slot = o.slot;
+		return *this;
+	}
+
+	pool_ref& operator=(pool_ref&& o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			slot = std::exchange(o.slot, nullptr);
+		}
+		return *this;
+	}
+
+	void reset()
+	{
+		if (slot && slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) slot->pool->release(slot);
+		slot = nullptr;
+	}
+
+	T& operator*() const { return slot->value; }
+	T* operator->() const { return &slot->value; }
+	explicit operator bool() const { return slot != nullptr; }
+	bool operator==(const pool_ref& o) const { return slot == o.slot; }
+	uint32_t use_count() const { return slot ? slot->refs.load(std::memory_order_relaxed) : 0; }
+
+private:
+	friend class slab_pool<T>;
+	explicit pool_ref(pool_slot<T>* _slot) : slot(_slot) {}
+
+	pool_slot<T>* slot = nullptr;
+};
+
+/*!
+ * fixed number of preallocated T, handed out as pool_refs. acquire() and the release of the last ref are lock free, and safe from
+ * any thread, so a midi callback and the io threads don't meet in the allocator. when the pool runs out, acquire() gives an empty
+ * ref, and counts it, rather than allocating more.
+ * the free list is a stack of slot indices, with a tag in the top half of the head to stop an ABA mixup between acquires.
+ * the pool must outlive every ref to it.
+ */
+template<typename T>
+class slab_pool
+{
+public:
+	explicit slab_pool(std::size_t _capacity)
+		: capacity(static_cast<uint32_t>(_capacity)), slots(std::make_unique<pool_slot<T>[]>(_capacity))
+	{
+		for (uint32_t i = 0; i < capacity; ++i) {
+			slots[i].pool = this;
+			slots[i].next.store(i + 1 < capacity ? i + 1 : none, std::memory_order_relaxed);
+		}
+		head.store(capacity > 0 ? 0 : none);
+	}
+
+	slab_pool(const slab_pool&) = delete;
+	slab_pool& operator=(const slab_pool&) = delete;
+
+	/*!
+	 * take a free slot, reset to a default T.
+	 *  \return the ref, or an empty ref if the pool is exhausted
+	 */
+	pool_ref<T> acquire()
+	{
+		uint64_t h = head.load(std::memory_order_acquire);
+		for (;;) {
+			const auto i = static_cast<uint32_t>(h);
+			if (i == none) {
+				exhausted.fetch_add(1, std::memory_order_relaxed);
+				return {};
+			}
+			const uint64_t next = slots[i].next.load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(h, ((h >> 32) + 1) << 32 | next, std::memory_order_acquire)) {
+				auto& slot = slots[i];
+				slot.value = T();
+				slot.refs.store(1, std::memory_order_relaxed);
+				acquired.fetch_add(1, std::memory_order_relaxed);
+				const auto n = inUse.fetch_add(1, std::memory_order_relaxed) + 1;
+				auto hw = highWater.load(std::memory_order_relaxed);
+				while (n > hw && !highWater.compare_exchange_weak(hw, n, std::memory_order_relaxed)) {}
+				return pool_ref<T>(&slot);
+			}
+		}
+	}
+
+	pool_counters_t counters() const
+	{
+		pool_counters_t c;
+		c.capacity = capacity;
+		c.inUse = inUse.load(std::memory_order_relaxed);
+		c.highWater = highWater.load(std::memory_order_relaxed);
+		c.acquired = acquired.load(std::memory_order_relaxed);
+		c.exhausted = exhausted.load(std::memory_order_relaxed);
+		return c;
+	}
+
+private:
+	friend class pool_ref<T>;
+
+	void release(pool_slot<T>* slot)
+	{
+		const auto i = static_cast<uint32_t>(slot - slots.get());
+		uint64_t h = head.load(std::memory_order_relaxed);
+		do {
+			slot->next.store(static_cast<uint32_t>(h), std::memory_order_relaxed);
+		} while (!head.compare_exchange_weak(h, ((h >> 32) + 1) << 32 | i, std::memory_order_release, std::memory_order_relaxed));
+		inUse.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	static constexpr uint32_t none = 0xffffffff;
+
+	const uint32_t capacity;
+	std::unique_ptr<pool_slot<T>[]> slots;
+	std::atomic<uint64_t> head{ none };	//!< tag << 32 | index of the first free slot
+	std::atomic<std::size_t> inUse{ 0 };
+	std::atomic<std::size_t> highWater{ 0 };
+	std::atomic<uint64_t> acquired{ 0 };
+	std::atomic<uint64_t> exhausted{ 0 };
+};
+
+}
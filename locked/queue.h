@@ -1,17 +1,24 @@
 #pragma once
 
+#include "bounds.h"
+
+#include <algorithm>
 #include <condition_variable>
 #include <functional>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <utility>
+#include <vector>
 #include <chrono>
 
 namespace locked {
 /*!
  * quick and dirty thread safe queue. better solutions exist but with tradeoffs (libcds, Honeycomb, folly, tbb)
- * a condition variable can be enabled to force blocking waits for a non empty queue
+ * a condition variable can be enabled to force blocking waits for a non empty queue.
+ * the queue is unbounded unless setBounds() gives it a capacity and an overflow policy.
+ * list nodes taken off the queue are kept for reuse, up to the capacity (or maxSpare when unbounded), so once the queue has been
+ * as deep as it's going to get, pushes and drains don't touch the heap.
  */
 template<typename T>
 class queue
@@ -45,24 +52,31 @@ public:
 
 	/*!
 	 * push r-value to the back of the queue
+	 *  \return false if it was dropped or merged into an element already queued, or the queue isn't enabled
 	 */
-	void push(T&& value)
+	bool push(T&& value)
 	{
-		const std::unique_lock<std::mutex> lock(mutex);
-		if (!isRunning) return;
-		iqueue.push_back(std::move(value));
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning) return false;
+		if (!makeRoom(lock, value)) return false;
+		iqueue.splice(iqueue.end(), spare, node(std::move(value)));
+		noteDepth();
 		ready.notify_all(); //! TODO: or notify one???
+		return true;
 	}
 
 	/*!
 	 * push r-value to the front of the queue
 	 */
-	void push_front(T&& value)
+	bool push_front(T&& value)
 	{
-		const std::unique_lock<std::mutex> lock(mutex);
-		if (!isRunning) return;
-		iqueue.push_front(std::move(value));
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning) return false;
+		if (!makeRoom(lock, value)) return false;
+		iqueue.splice(iqueue.begin(), spare, node(std::move(value)));
+		noteDepth();
 		ready.notify_all(); //! TODO: or notify one???
+		return true;
 	}
 
 	/*!
@@ -81,12 +95,31 @@ public:
 	std::pair<T, bool> front(const std::chrono::duration<long> timeout)
 	{
 		std::unique_lock<std::mutex> conditionLock(mutex);
-		ready.wait_for(conditionLock, timeout, [&]() { return !isBlocking || !queue.empty(); });
+		ready.wait_for(conditionLock, timeout, [&]() { return !isBlocking || !iqueue.empty(); });
 		if (iqueue.empty()) return { T(), false };
 
 		return{ iqueue.front(), true };
 	}
 
+	/*!
+	 * moves up to max_n elements from the head of the queue into out, taking the lock once. out is cleared first, and keeps its
+	 * capacity, so a worker can reuse the one batch vector without allocating. if waiting is enabled, this blocks until there is
+	 * at least one element.
+	 *  \return the number of elements now in out
+	 */
+	std::size_t drain(std::vector<T>& out, std::size_t max_n)
+	{
+		out.clear();
+		std::unique_lock<std::mutex> conditionLock(mutex);
+		ready.wait(conditionLock, [&]() { return !isBlocking || !iqueue.empty(); });
+		while (!iqueue.empty() && out.size() < max_n) {
+			out.push_back(std::move(iqueue.front()));
+			recycleFront();
+		}
+		if (!out.empty() && bounds.policy == overflow::block) space.notify_all();
+		return out.size();
+	}
+
 	/*!
 	 * removes the v element from the queue
 	 */
@@ -94,6 +127,7 @@ public:
 	{
 		const std::unique_lock<std::mutex> lock(mutex);
 		iqueue.remove(v);
+		if (bounds.policy == overflow::block) space.notify_all();
 	}
 
 	/*!
@@ -128,10 +162,108 @@ public:
 		return iqueue.empty();
 	}
 
+	std::size_t size()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		return iqueue.size();
+	}
+
+	/*!
+	 * limit the queue to a capacity, with a policy for what to do with pushes when it is full.
+	 *  \param keyOf for the 'coalesce' policy, gives the key that identifies elements that may replace one another. a key of 0
+	 *  means the element never coalesces.
+	 */
+	void setBounds(const bounds_t& _bounds, std::function<uint64_t(const T&)> _keyOf = nullptr)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		bounds = _bounds;
+		keyOf = std::move(_keyOf);
+		space.notify_all();
+	}
+
+	/*!
+	 * overflow and depth accounting since the queue was created
+	 */
+	counters_t counters()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		return stats;
+	}
+
 private:
+	/*!
+	 * apply the overflow policy before adding v to a full queue. called with the lock held.
+	 *  \return true if v should now be added, false if it was dropped or merged into an existing element
+	 */
+	bool makeRoom(std::unique_lock<std::mutex>& lock, T& v)
+	{
+		if (bounds.policy == overflow::unbounded || bounds.capacity == 0 || iqueue.size() < bounds.capacity) return true;
+		switch (bounds.policy) {
+		case overflow::drop_newest:
+			break;
+		case overflow::block:
+			if (space.wait_for(lock, bounds.timeout, [&]() { return !isRunning || iqueue.size() < bounds.capacity; })) {
+				return isRunning;
+			}
+			break;
+		case overflow::coalesce: {
+			const auto key = keyOf ? keyOf(v) : 0;
+			if (key != 0) {
+				auto it = std::find_if(iqueue.rbegin(), iqueue.rend(), [&](const T& q) { return keyOf(q) == key; });
+				if (it != iqueue.rend()) {
+					*it = std::move(v);
+					++stats.coalesced;
+					return false;
+				}
+			}
+		}
+		[[fallthrough]];
+		case overflow::drop_oldest:
+		default:
+			recycleFront();
+			++stats.overflows;
+			return true;
+		}
+		++stats.overflows;
+		return false;
+	}
+
+	void noteDepth() { stats.highWater = std::max(stats.highWater, iqueue.size()); }
+
+	/*!
+	 * a spare node holding v, ready to splice into the queue. only allocates if we've no spares. called with the lock held.
+	 */
+	typename std::list<T>::iterator node(T&& v)
+	{
+		if (spare.empty()) return spare.emplace(spare.end(), std::move(v));
+		spare.front() = std::move(v);
+		return spare.begin();
+	}
+
+	/*!
+	 * take the head element's node off the queue, keeping it as a spare if we're not already holding plenty. called with the lock held.
+	 */
+	void recycleFront()
+	{
+		const auto maxSpares = bounds.capacity > 0 ? bounds.capacity : maxSpare;
+		if (spare.size() < maxSpares) {
+			iqueue.front() = T();	// let go of anything a dropped element holds now, not when the node is reused
+			spare.splice(spare.begin(), iqueue, iqueue.begin());
+		} else {
+			iqueue.pop_front();
+		}
+	}
+
+	static constexpr std::size_t maxSpare = 1024;	//!< spare nodes kept by an unbounded queue
+
 	std::list<T> iqueue;
+	std::list<T> spare;	//!< nodes to reuse for pushes. their values are stale
 	std::mutex mutex;
 	std::condition_variable ready;
+	std::condition_variable space;	//!< signalled as elements are removed, for producers waiting with the 'block' policy
+	bounds_t bounds;
+	std::function<uint64_t(const T&)> keyOf;
+	counters_t stats;
 	bool isBlocking = true;
 	bool isRunning = false;	//!< we have a running worker to remove things from the queue
 };
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "bounds.h"
+#include "waiter.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace locked {
+
+/*!
+ * size we pad the producer and consumer indices out to, so they don't share a cache line. 64 is right for the pi's
+ * cortex-a cores and for pretty much any x86 we'd build on.
+ */
+constexpr std::size_t cacheLine = 64;
+
+/*!
+ * common waiting and enable/disable logic for the lock free rings. this mirrors the interface of locked::queue closely enough
+ * that the workers can use either. the derived ring supplies tryPush(), peek() and popHead(), which must only be called by
+ * a single consumer thread.
+ */
+template<typename D, typename T>
+class ring_base
+{
+public:
+	/*!
+	 * clear any threads waiting on this queue. the queue will still function safely if not 'enabled' but will not block the front()
+	 * method while waiting for data.
+	 */
+	void disableWait() { waiting.disable(); }
+
+	/*!
+	 * enable pushes to the queue. there should be a running consumer
+	 */
+	void enable(bool _en=true) { isRunning.store(_en); }
+
+	/*!
+	 * enable a wait for data on the front() method
+	 */
+	void enableWait() { waiting.enable(); }
+
+	/*!
+	 * check that blocking mode is enabled
+	 */
+	bool waitEnabled() { return waiting.enabled(); }
+
+	/*!
+	 * select how the consumer waits for data
+	 */
+	void setWaitMode(wait_mode _mode) { waiting.setMode(_mode); }
+
+	/*!
+	 * push r-value to the back of the queue.
+	 *  \return false if the ring is full (counted as an overflow) or not enabled, in which case the value is dropped
+	 */
+	bool push(T&& value)
+	{
+		if (!isRunning.load(std::memory_order_relaxed)) return false;
+		if (!admit(value)) {
+			overflows.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		waiting.signal();
+		return true;
+	}
+
+	bool push(const T& value) { return push(T(value)); }
+
+	/*!
+	 * returns a copy of the head element of the queue if it's not empty, leaving it in place. if waiting is enabled, this call will
+	 * block or spin, waiting for data to arrive. consumer thread only.
+	 */
+	std::pair<T, bool> front()
+	{
+		auto p = waiting.await([this]() { return self().peek() != nullptr; });
+		if (!p) return { T(), false };
+		return { *self().peek(), true };
+	}
+
+	template<typename Rep, typename Period>
+	std::pair<T, bool> front(const std::chrono::duration<Rep, Period> timeout)
+	{
+		auto p = waiting.await([this]() { return self().peek() != nullptr; }, std::chrono::steady_clock::now() + timeout);
+		if (!p) return { T(), false };
+		return { *self().peek(), true };
+	}
+
+	/*!
+	 * moves the head element out of the queue, waiting as for front(). consumer thread only.
+	 */
+	std::pair<T, bool> pop()
+	{
+		auto p = waiting.await([this]() { return self().peek() != nullptr; });
+		if (!p) return { T(), false };
+		return { self().popHead(), true };
+	}
+
+	/*!
+	 * moves up to max_n elements from the head of the ring into out, waiting as for front(). out is cleared first, and keeps its
+	 * capacity. consumer thread only.
+	 *  \return the number of elements now in out
+	 */
+	std::size_t drain(std::vector<T>& out, std::size_t max_n)
+	{
+		out.clear();
+		if (!waiting.await([this]() { return self().peek() != nullptr; })) return 0;
+		while (out.size() < max_n && self().peek()) {
+			out.push_back(self().popHead());
+		}
+		return out.size();
+	}
+
+	/*!
+	 * removes the head element from the queue. as we have exactly one consumer, and nothing can be pushed ahead of the head,
+	 * the element last returned by front() is always the head, and the argument is only there to match the locked::queue interface
+	 */
+	void remove(T&)
+	{
+		if (self().peek()) self().popHead();
+	}
+
+	bool empty() { return self().peek() == nullptr; }
+
+	/*!
+	 * limit the ring to less than its full size, and set what happens when it's full. this should be done before the ring is enabled.
+	 * there is no safe way for a producer to take an element off the head of a lock free ring, so 'drop_oldest' and 'coalesce'
+	 * behave as 'drop_newest' here. the key function is accepted to match locked::queue, and ignored.
+	 */
+	void setBounds(const bounds_t& _bounds, std::function<uint64_t(const T&)> = nullptr)
+	{
+		limit = _bounds.capacity > 0 ? std::min(_bounds.capacity, D::capacity()) : D::capacity();
+		blockOnFull = _bounds.policy == overflow::block;
+		blockTimeout = _bounds.timeout;
+	}
+
+	/*!
+	 * overflow and depth accounting since the ring was created
+	 */
+	counters_t counters()
+	{
+		counters_t c;
+		c.overflows = overflows.load(std::memory_order_relaxed);
+		c.highWater = highWater.load(std::memory_order_relaxed);
+		return c;
+	}
+
+protected:
+	D& self() { return static_cast<D&>(*this); }
+
+	/*!
+	 * producer side: try to get the value into the ring, waiting for room if we've been asked to block
+	 */
+	bool admit(T& value)
+	{
+		if (tryAdmit(value)) return true;
+		if (!blockOnFull) return false;
+		const auto deadline = std::chrono::steady_clock::now() + blockTimeout;
+		do {
+			std::this_thread::yield();
+			if (tryAdmit(value)) return true;
+		} while (isRunning.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() < deadline);
+		return false;
+	}
+
+	bool tryAdmit(T& value)
+	{
+		const auto depth = self().size();
+		if (depth >= limit || !self().tryPush(std::move(value))) return false;
+		auto hw = highWater.load(std::memory_order_relaxed);
+		while (depth + 1 > hw && !highWater.compare_exchange_weak(hw, depth + 1, std::memory_order_relaxed)) {}
+		return true;
+	}
+
+private:
+	waiter waiting;
+	std::atomic<bool> isRunning{ false };	//!< we have a running worker to remove things from the queue
+
+	std::size_t limit = D::capacity();
+	bool blockOnFull = false;
+	std::chrono::milliseconds blockTimeout{ 0 };
+	std::atomic<uint64_t> overflows{ 0 };
+	std::atomic<std::size_t> highWater{ 0 };
+};
+
+/*!
+ * bounded lock free single producer, single consumer ring. N must be a power of 2.
+ * the producer and consumer each keep a cached copy of the other's index so the shared ones are only touched when the
+ * cached view says we're full or empty.
+ */
+template<typename T, std::size_t N>
+class spsc_ring : public ring_base<spsc_ring<T, N>, T>
+{
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "spsc_ring size must be a power of 2");
+	friend class ring_base<spsc_ring<T, N>, T>;
+public:
+	static constexpr std::size_t capacity() { return N; }
+	std::size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+private:
+	bool tryPush(T&& value)
+	{
+		const auto t = tail.load(std::memory_order_relaxed);
+		if (t - headCache >= N) {
+			headCache = head.load(std::memory_order_acquire);
+			if (t - headCache >= N) return false;
+		}
+		slots[t & (N - 1)] = std::move(value);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	T* peek()
+	{
+		const auto h = head.load(std::memory_order_relaxed);
+		if (h == tailCache) {
+			tailCache = tail.load(std::memory_order_acquire);
+			if (h == tailCache) return nullptr;
+		}
+		return &slots[h & (N - 1)];
+	}
+
+	T popHead()
+	{
+		const auto h = head.load(std::memory_order_relaxed);
+		T v = std::move(slots[h & (N - 1)]);
+		slots[h & (N - 1)] = T();
+		head.store(h + 1, std::memory_order_release);
+		return v;
+	}
+
+	alignas(cacheLine) std::atomic<std::size_t> tail{ 0 };
+	std::size_t headCache = 0; //!< producer's view of head
+	alignas(cacheLine) std::atomic<std::size_t> head{ 0 };
+	std::size_t tailCache = 0; //!< consumer's view of tail
+	alignas(cacheLine) std::array<T, N> slots;
+};
+
+/*!
+ * bounded lock free multiple producer, single consumer ring. N must be a power of 2.
+ * each slot carries a sequence number (after Vyukov's bounded mpmc queue): producers claim a position with a CAS on the tail and
+ * publish by bumping the slot's sequence, so the single consumer never has to touch the tail at all.
+ */
+template<typename T, std::size_t N>
+class mpsc_ring : public ring_base<mpsc_ring<T, N>, T>
+{
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "mpsc_ring size must be a power of 2");
+	friend class ring_base<mpsc_ring<T, N>, T>;
+public:
+	mpsc_ring()
+	{
+		for (std::size_t i = 0; i < N; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	static constexpr std::size_t capacity() { return N; }
+	std::size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+private:
+	struct slot_t {
+		std::atomic<std::size_t> seq;
+		T value;
+	};
+
+	bool tryPush(T&& value)
+	{
+		auto pos = tail.load(std::memory_order_relaxed);
+		slot_t* s;
+		for (;;) {
+			s = &slots[pos & (N - 1)];
+			const auto seq = s->seq.load(std::memory_order_acquire);
+			const auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+			if (dif == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (dif < 0) {
+				return false; // full
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		s->value = std::move(value);
+		s->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	T* peek()
+	{
+		const auto h = head.load(std::memory_order_relaxed);
+		auto& s = slots[h & (N - 1)];
+		return s.seq.load(std::memory_order_acquire) == h + 1 ? &s.value : nullptr;
+	}
+
+	T popHead()
+	{
+		const auto h = head.load(std::memory_order_relaxed);
+		auto& s = slots[h & (N - 1)];
+		T v = std::move(s.value);
+		s.value = T();
+		s.seq.store(h + N, std::memory_order_release);
+		head.store(h + 1, std::memory_order_release);
+		return v;
+	}
+
+	alignas(cacheLine) std::atomic<std::size_t> tail{ 0 };
+	alignas(cacheLine) std::atomic<std::size_t> head{ 0 };
+	alignas(cacheLine) std::array<slot_t, N> slots;
+};
+
+}
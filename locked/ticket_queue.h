@@ -0,0 +1,190 @@
+#pragma once
+
+#include "meter.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace locked {
+
+/*!
+ * thread safe queue of keyed work, where the position of any key in the queue can be found without walking it.
+ * every element takes a ticket as it is pushed: pushing to the back takes the ticket after the tail, pushing to the front takes
+ * the ticket before the head. as elements only ever leave from the head, the queued tickets are always the contiguous range
+ * [head, tail), and an element's position is just its ticket less the head ticket.
+ * elements taken by a worker stay known to the queue as 'running' until the worker reports them done().
+ */
+template<typename K, typename T>
+class ticket_queue
+{
+public:
+	enum class state : uint8_t {
+		unknown = 0,	//!< never queued, or done
+		queued = 1,
+		running = 2
+	};
+
+	/*!
+	 * clear any threads waiting on this queue. the queue will still function safely if not 'enabled' but will not block the drain()
+	 * method while waiting for data.
+	 */
+	void disableWait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		isBlocking = false;
+		ready.notify_all();
+	}
+
+	/*!
+	 * enable pushes to the queue. there should be a running worker to take them off
+	 */
+	void enable(bool _en=true)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		isRunning = _en;
+	}
+
+	/*!
+	 * enable a wait for data on the drain() method
+	 */
+	void enableWait()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		isBlocking = true;
+	}
+
+	/*!
+	 * check that blocking mode is enabled
+	 */
+	bool waitEnabled()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		return isBlocking;
+	}
+
+	/*!
+	 * push r-value to the back of the queue
+	 */
+	void push(const K& key, T&& value)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning) return;
+		iqueue.push_back({ key, std::move(value), std::chrono::steady_clock::now() });
+		index[key] = { tail++, state::queued };
+		meter.pushed();
+		ready.notify_one();
+	}
+
+	/*!
+	 * push r-value to the front of the queue
+	 */
+	void push_front(const K& key, T&& value)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		if (!isRunning) return;
+		iqueue.push_front({ key, std::move(value), std::chrono::steady_clock::now() });
+		index[key] = { --head, state::queued };
+		meter.pushed();
+		ready.notify_one();
+	}
+
+	/*!
+	 * moves up to max_n elements from the head of the queue into out, marking them as running. out is cleared first. if waiting
+	 * is enabled, this blocks until there is at least one element.
+	 *  \return the number of elements now in out
+	 */
+	std::size_t drain(std::vector<T>& out, std::size_t max_n)
+	{
+		out.clear();
+		std::unique_lock<std::mutex> conditionLock(mutex);
+		ready.wait(conditionLock, [&]() { return !isBlocking || !iqueue.empty(); });
+		const auto now = std::chrono::steady_clock::now();
+		while (!iqueue.empty() && out.size() < max_n) {
+			auto& e = iqueue.front();
+			index[e.key].second = state::running;
+			meter.popped(std::chrono::duration_cast<std::chrono::microseconds>(now - e.t).count());
+			out.push_back(std::move(e.value));
+			iqueue.pop_front();
+			++head;
+		}
+		return out.size();
+	}
+
+	/*!
+	 * the worker has finished with the element for key, so we can forget it
+	 */
+	void done(const K& key)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		index.erase(key);
+	}
+
+	/*!
+	 * where the element for key currently is.
+	 *  \return the state, and for a queued element, its position from the head of the queue
+	 */
+	std::pair<state, int64_t> find(const K& key)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		auto it = index.find(key);
+		if (it == index.end()) return { state::unknown, -1 };
+		if (it->second.second == state::running) return { state::running, -1 };
+		return { state::queued, it->second.first - head };
+	}
+
+	/*!
+	 * runs the given function over every queued element
+	 */
+	void foreach(std::function<void(const T&)> f)
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		for (auto const& it : iqueue) { f(it.value); }
+	}
+
+	bool empty()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		return iqueue.empty();
+	}
+
+	std::size_t size()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		return iqueue.size();
+	}
+
+	/*!
+	 * depth, throughput and how long work waited to be picked up. the rates are since the last call
+	 */
+	queue_stats_t stats()
+	{
+		return rates.stats(size(), meter.enqueuedCount(), meter.dwell());
+	}
+
+private:
+	struct entry_t {
+		K key;
+		T value;
+		std::chrono::steady_clock::time_point t;	//!< when it was queued
+	};
+
+	std::deque<entry_t> iqueue;
+	std::unordered_map<K, std::pair<int64_t, state>> index; //!< ticket and state for each key we know about
+	int64_t head = 0;	//!< ticket of the element at the front of the queue
+	int64_t tail = 0;	//!< ticket the next push to the back will take
+	std::mutex mutex;
+	std::condition_variable ready;
+	bool isBlocking = true;
+	bool isRunning = false;	//!< we have a running worker to remove things from the queue
+	queue_meter meter;
+	rate_meter rates;
+};
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace locked {
+
+/*!
+ * how a consumer waits for data when waiting is enabled.
+ *	- block: sleep on a condition variable. producers only take the lock to signal if the consumer is actually asleep
+ *	- spin: busy poll, yielding the cpu every so often. lowest latency, but burns a core
+ */
+enum class wait_mode : uint8_t {
+	block = 0,
+	spin = 1
+};
+
+/*!
+ * consumer side waiting for the queues that don't do their own locking. a single consumer calls await() with a predicate that
+ * checks for data, and producers call signal() after they've published something.
+ * a consumer that doesn't have a thread of its own to wait with (a handler on an io context, say) can instead arm() the waiter,
+ * and the next signal() calls the notify function once.
+ */
+class waiter
+{
+public:
+	/*!
+	 * stop waiting, and release the consumer if it is currently waiting
+	 */
+	void disable()
+	{
+		isBlocking.store(false);
+		wake();
+	}
+
+	void enable() { isBlocking.store(true); }
+	bool enabled() { return isBlocking.load(); }
+	void setMode(wait_mode _mode) { mode.store(_mode); }
+
+	/*!
+	 * producer side: wake the consumer only if it has gone to sleep. the fence pairs with the one in await(), so either we see
+	 * the sleeper flag or the sleeper sees our element
+	 */
+	void signal()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (armed.load(std::memory_order_relaxed) && armed.exchange(false)) notify();
+		if (sleeping.load(std::memory_order_relaxed)) wake();
+	}
+
+	/*!
+	 * set the function signal() calls when the waiter is armed. it is called on the producer's thread, so should be quick and must
+	 * not block. set this before there are any producers
+	 */
+	void setNotify(std::function<void()> _notify) { notify = std::move(_notify); }
+
+	/*!
+	 * consumer side: ask for the next signal() to notify. the fence pairs with the one in signal(), so either the producer sees
+	 * us armed, or we see its element in pred().
+	 *  \return true if pred() is already true and no producer has taken the notification, so the consumer should carry on itself
+	 */
+	template<typename P>
+	bool arm(P pred)
+	{
+		armed.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!pred()) return false;
+		return armed.exchange(false);
+	}
+
+	/*!
+	 * take back an arm(), so that no further notifications are sent
+	 */
+	void disarm() { armed.store(false); }
+
+	void wake()
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		ready.notify_one();
+	}
+
+	/*!
+	 * consumer side wait until pred() is true, waiting is disabled, or the deadline passes
+	 *  \return the final value of pred()
+	 */
+	template<typename P>
+	bool await(P pred, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+	{
+		if (pred()) return true;
+		if (!isBlocking.load(std::memory_order_relaxed)) return false;
+		if (mode.load(std::memory_order_relaxed) == wait_mode::spin) {
+			for (uint32_t i = 1; isBlocking.load(std::memory_order_relaxed); ++i) {
+				if (pred()) return true;
+				if ((i & 0x3f) == 0) {
+					if (std::chrono::steady_clock::now() >= deadline) break;
+					std::this_thread::yield();
+				}
+			}
+			return pred();
+		}
+		std::unique_lock<std::mutex> conditionLock(mutex);
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const auto awake = [&]() { return !isBlocking.load() || pred(); };
+		if (deadline == std::chrono::steady_clock::time_point::max()) {
+			ready.wait(conditionLock, awake);
+		} else {
+			ready.wait_until(conditionLock, deadline, awake);
+		}
+		sleeping.store(false, std::memory_order_relaxed);
+		return pred();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::function<void()> notify;
+	std::atomic<bool> sleeping{ false };
+	std::atomic<bool> armed{ false };
+	std::atomic<bool> isBlocking{ true };
+	std::atomic<wait_mode> mode{ wait_mode::block };
+};
+
+}
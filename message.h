@@ -4,15 +4,31 @@
 #include "xycfg.h"
 
 // TODO: ASAP find a better solution than this
+#include "locked/lanes.h"
+#include "locked/pool.h"
+#ifdef LOCKFREE_QUEUES
+#include "locked/ring.h"
+#else
 #include "locked/queue.h"
+#endif
 
-#include <memory>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 namespace xymsg {
 
 /*!
- * base class for messages and commands submitted to the various midi/osc/hardware workers
- * these are messages or commands that are sent to and from the duino via SPI, and broadcast via OSC, and possibly sent to locally connected midi devices
+ * messages and commands submitted to the various midi/osc/hardware workers
+ * these are messages or commands that are sent to and from the duino via SPI, and broadcast via OSC, and possibly sent to locally connected midi devices.
+ * each type is a small struct, or a reference to one in a pool, and a msg_t holds any one of them by value, so messages go through the
+ * queues without touching the heap.
+ * the order of the types in body_t matches typ, so the variant's index is the message type.
  */
 enum class typ : uint8_t {
 	none = 0,
@@ -22,70 +38,390 @@ enum class typ : uint8_t {
 	config_pedal = 4,
 	config_xlrm8r = 5,
 	tempo = 6,
-	duino_cmd = 7
+	duino_cmd = 7,
+	sysx = 8
 };
 
-struct msg_t {
-	msg_t(typ _type = typ::none): type(_type) {}
-	virtual ~msg_t() = default;
-
-	const typ type;
+/*!
+ * priority lanes our queues sort messages into. lower lanes go first, or get the larger share when the lanes are weighted
+ */
+enum class lane : uint8_t {
+	realtime = 0,	//!< midi clock and transport, tempo
+	musical = 1,	//!< notes, controllers and the rest of the channel messages
+	control = 2,	//!< commands to the duino
+	bulk = 3		//!< config and sysex
 };
+constexpr std::size_t nLanes = 4;
 
-using q_t = locked::queue<std::shared_ptr<msg_t>>;
 using midi_t = xymidi::msg;
+constexpr std::size_t maxBatch = 64; //!< most messages a worker takes off its queue at a time
+constexpr std::size_t maxMidiList = 8; //!< most midi messages in a MidiListMsg
+constexpr std::size_t sysxChunkLen = 256; //!< most sysex bytes in a SysxMsg
 
-class MidiMsg : public msg_t {
-public:
-	MidiMsg() : msg_t(typ::midi) {}
+struct NoneMsg {};
+
+
+struct MidiMsg {
 	midi_t midi;
 };
 
 
-class MidiListMsg : public msg_t {
-public:
-	MidiListMsg() : msg_t(typ::midi_list) {}
-	std::vector<midi_t> midi;
+/*!
+ * a short run of midi messages that go out together. the list is held inline, so it is bounded by maxMidiList
+ */
+struct MidiList {
+	std::array<midi_t, maxMidiList> midi;
+	uint8_t count = 0;
+
+	/*! \return false if the list is already full */
+	bool push_back(const midi_t& m)
+	{
+		if (count >= maxMidiList) return false;
+		midi[count++] = m;
+		return true;
+	}
+	std::size_t size() const { return count; }
+	const midi_t* begin() const { return midi.data(); }
+	const midi_t* end() const { return midi.data() + count; }
 };
 
 
-class ConfigButtonMsg : public msg_t {
-public:
-	ConfigButtonMsg() : msg_t(typ::config_button), which(0) {}
-	uint8_t which;
+struct ConfigButton {
+	uint8_t which = 0;
 	config::button cfg;
 };
 
 
-class ConfigPedalMsg : public msg_t {
-public:
-	ConfigPedalMsg() : msg_t(typ::config_pedal), which(0) {}
-	uint8_t which;
+struct ConfigPedal {
+	uint8_t which = 0;
 	config::pedal cfg;
 };
 
 
-class ConfigXlm8rMsg : public msg_t {
-public:
-	ConfigXlm8rMsg() : msg_t(typ::config_xlrm8r), which(0) {}
-	uint8_t which;
+struct ConfigXlm8r {
+	uint8_t which = 0;
 	config::xlrm8r cfg;
 };
 
+/*!
+ * a piece of a sysex. a sysex of any length goes through the hub as a run of these, in order, through the bulk lane, so a large
+ * dump never holds up the realtime or musical lanes. the bytes are as they are on the wire: the first chunk starts with the 0xf0,
+ * and the last ends with the 0xf7, unless we ran out of chunks and had to cut it short.
+ */
+struct SysxChunk {
+	std::array<uint8_t, sysxChunkLen> data;
+	uint16_t len = 0;
+	uint8_t port = 0;
+	bool first = false;
+	bool last = false;
+	bool truncated = false;	//!< the last chunk of a sysex we had to drop the end of
+	uint16_t index = 0;	//!< of the chunk in its sysex, so a sink can tell if one went missing on the way
 
-class TempoMsg : public msg_t {
-public:
-	TempoMsg(const float _tempo=120) : msg_t(typ::tempo), tempo(_tempo) {}
+	const uint8_t* begin() const { return data.data(); }
+	const uint8_t* end() const { return data.data() + len; }
+};
+
+/*!
+ * the larger messages live in slab pools, and the message holds a counted reference, so msg_t stays small and the one list or
+ * config can go to several queues without a copy or a malloc. get one with poolOf<T>().acquire(), which gives an empty ref if the
+ * pool is exhausted.
+ */
+using MidiListMsg = locked::pool_ref<MidiList>;
+using ConfigButtonMsg = locked::pool_ref<ConfigButton>;
+using ConfigPedalMsg = locked::pool_ref<ConfigPedal>;
+using ConfigXlm8rMsg = locked::pool_ref<ConfigXlm8r>;
+using SysxMsg = locked::pool_ref<SysxChunk>;
+
+template<typename T> inline constexpr std::size_t poolSize = 32;	//!< slots in the pool for T
+template<> inline constexpr std::size_t poolSize<MidiList> = 256;
+template<> inline constexpr std::size_t poolSize<SysxChunk> = 256;	//!< enough for 64k of sysex in flight
+
+template<typename T>
+locked::slab_pool<T>& poolOf()
+{
+	static locked::slab_pool<T> pool(poolSize<T>);
+	return pool;
+}
+
+
+struct TempoMsg {
+	TempoMsg(const float _tempo=120) : tempo(_tempo) {}
 	float tempo; // a 32 bit float!!
 };
 
 
+struct CmdMsg {
+	CmdMsg(uint8_t _cmd=0) : cmd(_cmd) {}
+	uint8_t cmd;
+};
+
+using body_t = std::variant<NoneMsg, MidiMsg, MidiListMsg, ConfigButtonMsg, ConfigPedalMsg, ConfigXlm8rMsg, TempoMsg, CmdMsg, SysxMsg>;
+
+static_assert(std::is_same_v<std::variant_alternative_t<(std::size_t)typ::midi, body_t>, MidiMsg>, "body_t must be in typ order");
+static_assert(std::is_same_v<std::variant_alternative_t<(std::size_t)typ::duino_cmd, body_t>, CmdMsg>, "body_t must be in typ order");
+static_assert(std::is_same_v<std::variant_alternative_t<(std::size_t)typ::sysx, body_t>, SysxMsg>, "body_t must be in typ order");
+
+/*!
+ * where messages come into the hub
+ */
+enum class source : uint8_t {
+	midi = 0,	//!< local midi ports
+	osc = 1,
+	spi = 2,	//!< the duino
+	ws = 3,
+	clock = 4,	//!< the hub's own clock engine
+	seq = 5		//!< the hub's pattern sequencer
+};
+constexpr std::size_t nSources = 6;
+constexpr std::array<const char*, nSources> sourceNames = { "midi", "osc", "spi", "ws", "clock", "seq" };
+
+/*!
+ * a message, with where and when it came into the hub, so we can tell how long it took to get out again, and when it should go out.
+ * any of the message types converts to a msg_t, with no time stamp yet: the router stamps it, if the source hasn't already.
+ * the send time is kept as an offset from the ingress time, so it fits in the padding. only the midi out scheduler looks at it.
+ */
+struct msg_t {
+	using clock_t = std::chrono::steady_clock;
+
+	msg_t() = default;
+	template<typename B, typename = std::enable_if_t<!std::is_same_v<std::decay_t<B>, msg_t>>>
+	msg_t(B&& _body) : body(std::forward<B>(_body)) {}
 
-class CmdMsg : public msg_t {
+	/*!
+	 * hold the message back until the given time. stamps the message now, if it hasn't been already. times in the past, or more
+	 * than an hour or so ahead, send it as soon as we can
+	 */
+	void setDue(clock_t::time_point due)
+	{
+		if (t == clock_t::time_point{}) t = clock_t::now();
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(due - t).count();
+		dueUs = us > 0 && us <= 0xffffffff ? static_cast<uint32_t>(us) : 0;
+	}
+
+	bool hasDue() const { return dueUs != 0; }
+	clock_t::time_point due() const { return t + std::chrono::microseconds(dueUs); }
+
+	body_t body;
+	clock_t::time_point t{};	//!< ingress time, or the epoch if not stamped yet
+	source from = source::midi;
+	uint32_t dueUs = 0;	//!< when to send, in microseconds after t. 0 sends as soon as we can
+};
+
+static_assert(sizeof(msg_t) <= 32, "msg_t is copied through the queues and rings, so keep it small");
+
+inline typ typeOf(const msg_t& msg) { return static_cast<typ>(msg.body.index()); }
+
+#ifdef LOCKFREE_QUEUES
+constexpr std::size_t qCapacity = 1024; //!< slots in each bounded ring. a push to a full ring is dropped
+using lane_q_t = locked::mpsc_ring<locked::stamped<msg_t>, qCapacity>;
+#else
+using lane_q_t = locked::queue<locked::stamped<msg_t>>;
+#endif
+using q_t = locked::lanes<msg_t, lane_q_t, nLanes>;
+
+/*!
+ * controllers whose every value counts, and counts in order with what's around it: bank select goes before the program change it
+ * picks a bank for, (n)rpn numbers go before their data entry, and the channel mode messages, like all notes off, before the notes
+ * after them
+ */
+inline bool isOrderedCtrl(uint8_t ctrl)
+{
+	return ctrl == 0 || ctrl == 32 || ctrl == 6 || ctrl == 38 || (ctrl >= 96 && ctrl <= 101) || ctrl >= 120;
+}
+
+/*!
+ * key for messages that may overwrite one another when a queue coalesces on overflow: controller, key pressure, channel pressure
+ * and bend on the same port and channel, the tempo, and config for the same control. notes, clock, the controllers that go in
+ * order and anything else give 0, and are never coalesced.
+ */
+inline uint64_t coalesceKey(const msg_t& msg)
+{
+	const auto t = static_cast<uint64_t>(msg.body.index()) << 32;
+	switch (typeOf(msg)) {
+	case typ::midi: {
+		const auto& m = std::get<MidiMsg>(msg.body).midi;
+		switch (m.cmd & 0xf0) {
+		case (uint8_t)xymidi::cmd::ctrl:
+			if (isOrderedCtrl(m.val1)) return 0;
+			return t | (m.port << 16) | (m.cmd << 8) | m.val1;
+		case (uint8_t)xymidi::cmd::keyPress:
+			return t | (m.port << 16) | (m.cmd << 8) | m.val1;
+		case (uint8_t)xymidi::cmd::chanPress:
+		case (uint8_t)xymidi::cmd::bend:
+			return t | (m.port << 16) | (m.cmd << 8);
+		}
+		return 0;
+	}
+	case typ::config_button:
+		return t | std::get<ConfigButtonMsg>(msg.body)->which;
+	case typ::config_pedal:
+		return t | std::get<ConfigPedalMsg>(msg.body)->which;
+	case typ::config_xlrm8r:
+		return t | std::get<ConfigXlm8rMsg>(msg.body)->which;
+	case typ::tempo:
+		return t;
+	default:
+		return 0;
+	}
+}
+
+constexpr std::array<const char*, 9> typNames = {
+	"none", "midi", "midi_list", "config_button", "config_pedal", "config_xlrm8r", "tempo", "duino_cmd", "sysx"
+};
+constexpr std::array<const char*, nLanes> laneNames = { "realtime", "musical", "control", "bulk" };
+
+/*!
+ * the lane each message type goes in, used as the classifier for our queues. midi system realtime messages (clock, start,
+ * continue, stop) always go in the realtime lane, whatever lane the other midi messages are in.
+ */
+struct lane_map_t {
+	std::array<lane, typNames.size()> byType = {
+		lane::control, lane::musical, lane::musical, lane::bulk, lane::bulk, lane::bulk, lane::realtime, lane::control, lane::bulk
+	};
+
+	std::size_t operator()(const msg_t& msg) const
+	{
+		if (typeOf(msg) == typ::midi && std::get<MidiMsg>(msg.body).midi.cmd >= (uint8_t)xymidi::cmd::clock) {
+			return static_cast<std::size_t>(lane::realtime);
+		}
+		const auto t = msg.body.index();
+		return static_cast<std::size_t>(t < byType.size() ? byType[t] : lane::bulk);
+	}
+};
+
+/*!
+ * cuts a stream of sysex bytes into pooled chunks, handing each to emit(msg_t&&) as it fills, and the last one at finish(). bytes
+ * that come before a start() are dropped. if the pool runs dry part way through, the chunk we have goes out as the last, marked as
+ * truncated, and we drop the rest of the stream, so no sink is left waiting on an end that won't come.
+ */
+class sysx_builder
+{
 public:
-	CmdMsg(uint8_t _cmd) : msg_t(typ::tempo), cmd(0) {}
-	uint8_t cmd;
+	/*!
+	 * start a new sysex on the given port. anything left of the last one goes out, cut short
+	 */
+	template<typename F>
+	void start(uint8_t _port, F&& emit)
+	{
+		if (chunk) {
+			chunk->truncated = true;
+			finish(emit);
+		}
+		port = _port;
+		first = true;
+		index = 0;
+		open = true;
+	}
+
+	template<typename F>
+	void append(const uint8_t* data, std::size_t len, F&& emit)
+	{
+		for (std::size_t i = 0; open && i < len; ) {
+			if (!chunk || chunk->len == chunk->data.size()) {
+				auto next = poolOf<SysxChunk>().acquire();
+				if (!next) {
+					++dropped;
+					if (chunk) chunk->truncated = true;
+					finish(emit);
+					return;
+				}
+				if (chunk) emit(msg_t(std::move(chunk)));
+				chunk = std::move(next);
+				chunk->port = port;
+				chunk->first = std::exchange(first, false);
+				chunk->index = index++;
+			}
+			const auto n = std::min(len - i, chunk->data.size() - chunk->len);
+			std::copy(data + i, data + i + n, chunk->data.begin() + chunk->len);
+			chunk->len += static_cast<uint16_t>(n);
+			i += n;
+		}
+	}
+
+	template<typename F>
+	void finish(F&& emit)
+	{
+		if (chunk) {
+			chunk->last = true;
+			emit(msg_t(std::move(chunk)));
+		}
+		chunk.reset();
+		open = false;
+	}
+
+	bool isOpen() const { return open; }
+	uint64_t droppedCount() const { return dropped; }	//!< sysex cut short for want of a chunk
+
+private:
+	SysxMsg chunk;
+	uint8_t port = 0;
+	bool first = false;
+	uint16_t index = 0;	//!< of the next chunk
+	bool open = false;
+	uint64_t dropped = 0;
+};
+
+/*!
+ * follows the chunks of sysex on their way out of a sink, so only a whole sysex goes out: every chunk of it, in order, and not cut
+ * short. a full queue may have dropped a chunk on the way, and the pool may have run dry while it was built. a sink holds on to
+ * what it has of a sysex while next() says it's good, and throws it all away when it isn't
+ */
+class sysx_check
+{
+public:
+	/*!
+	 * take the next chunk. a first chunk starts a new sysex, and what's left of one that didn't finish is lost
+	 *  \return false if the chunk doesn't carry on the sysex we're following, or ends it cut short, so it's lost
+	 */
+	bool next(const SysxChunk& c)
+	{
+		if (c.first) {
+			if (following) ++lost;
+			following = true;
+			index = 0;
+		}
+		if (!following) return false;
+		if (c.index != index++ || c.truncated) {
+			++lost;
+			following = false;
+			return false;
+		}
+		if (c.last) following = false;
+		return true;
+	}
+
+	uint64_t lostCount() const { return lost; }	//!< sysex we let go of, missing a chunk or cut short
+
+private:
+	bool following = false;
+	uint16_t index = 0;	//!< of the chunk we want next
+	uint64_t lost = 0;
 };
 
+/*!
+ * parse changes to the default lanes, as given on the command line: a comma separated list of <type>=<lane>,
+ * eg 'tempo=control,config_button=control'
+ *  \throws std::invalid_argument on a badly formed spec
+ */
+inline lane_map_t parseLaneMap(const std::string& spec)
+{
+	lane_map_t m;
+	auto indexOf = [](const auto& names, const std::string& name) -> std::size_t {
+		for (std::size_t i = 0; i < names.size(); ++i) {
+			if (name == names[i]) return i;
+		}
+		throw std::invalid_argument("Unknown name '" + name + "' in lane map");
+	};
+	for (std::size_t pos = 0; pos < spec.size(); ) {
+		const auto end = std::min(spec.find(',', pos), spec.size());
+		const auto item = spec.substr(pos, end - pos);
+		const auto eq = item.find('=');
+		if (eq == std::string::npos) throw std::invalid_argument("Expected <type>=<lane> in lane map, got '" + item + "'");
+		m.byType[indexOf(typNames, item.substr(0, eq))] = static_cast<lane>(indexOf(laneNames, item.substr(eq + 1)));
+		pos = end + 1;
+	}
+	return m;
+}
+
 
 };
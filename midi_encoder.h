@@ -0,0 +1,83 @@
+#pragma once
+
+#include "xypi_midi.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace xymidi {
+
+/*!
+ * packs midi messages into a fixed buffer, ready to hand to the output port in one go. every message keeps its status byte: the
+ * apis that take a batch parse it back into events, and the driver under them chooses what goes on the wire.
+ */
+class encoder
+{
+public:
+	static constexpr std::size_t capacity = 256;
+
+	/*!
+	 * bytes in a message with the given status byte, or 0 for anything we don't send this way: sysex, and undefined status bytes
+	 */
+	static std::size_t lengthOf(uint8_t status)
+	{
+		switch (status & 0xf0) {
+		case (uint8_t)cmd::noteOff:
+		case (uint8_t)cmd::noteOn:
+		case (uint8_t)cmd::keyPress:
+		case (uint8_t)cmd::ctrl:
+		case (uint8_t)cmd::bend:
+			return 3;
+		case (uint8_t)cmd::prog:
+		case (uint8_t)cmd::chanPress:
+			return 2;
+		}
+		switch (status) {
+		case (uint8_t)cmd::songPos:
+			return 3;
+		case (uint8_t)cmd::timeCode:
+		case (uint8_t)cmd::songSel:
+			return 2;
+		case (uint8_t)cmd::tuneReq:
+		case (uint8_t)cmd::clock:
+		case (uint8_t)cmd::start:
+		case (uint8_t)cmd::cont:
+		case (uint8_t)cmd::stop:
+		case (uint8_t)cmd::sensing:
+		case (uint8_t)cmd::sysReset:
+			return 1;
+		}
+		return 0;
+	}
+
+	/*!
+	 * add a message to the buffer. messages we don't send this way are skipped
+	 *  \return false if there isn't room, in which case the buffer wants sending first
+	 */
+	bool add(const msg& m)
+	{
+		const auto n = lengthOf(m.cmd);
+		if (n == 0) return true;
+		if (len + n > buf.size()) return false;
+		buf[len++] = m.cmd;
+		if (n > 1) buf[len++] = m.val1 & 0x7f;
+		if (n > 2) buf[len++] = m.val2 & 0x7f;
+		return true;
+	}
+
+	/*!
+	 * empty the buffer, after it's been sent
+	 */
+	void clear() { len = 0; }
+
+	bool empty() const { return len == 0; }
+	const unsigned char* data() const { return buf.data(); }
+	std::size_t size() const { return len; }
+
+private:
+	std::array<unsigned char, capacity> buf;
+	std::size_t len = 0;
+};
+
+}
@@ -0,0 +1,186 @@
+#include "midi_out_port.h"
+#include "router.h"
+
+#include <spdlog/spdlog.h>
+
+using namespace std::chrono_literals;
+
+constexpr auto spinWindow = 300us;	//!< how long before a scheduled message is due we stop waiting on the queue and spin
+constexpr std::size_t sysxOutReserve = 16 * xymsg::sysxChunkLen;	//!< room for the usual sysex, so we only grow for big dumps
+
+using spdlog::error;
+using spdlog::debug;
+using spdlog::warn;
+
+/*!
+ * \class MidiOutPort
+ * takes an open port, and sends whatever is pushed onto its queue out of it
+ */
+MidiOutPort::MidiOutPort(std::unique_ptr<MidiOutDevice> _midiOut, uint8_t _port, std::string _name, const midi_config_t& config)
+	: midiOut(std::move(_midiOut)), portNo(_port), portName(std::move(_name))
+{
+	sysxOut.reserve(sysxOutReserve);
+	encoded.reserve(xymsg::maxBatch);
+	outQ.setBounds(config.portQ, xymsg::coalesceKey);
+	outQ.setClassifier(config.lanes);
+	outQ.setPolicy(config.lanePolicy);
+}
+
+MidiOutPort::~MidiOutPort()
+{
+	stop();
+}
+
+/*!
+ * launch the port's sender thread, and take messages on its queue from now on
+ */
+void MidiOutPort::run()
+{
+	if (!isRunning.exchange(true)) {
+		debug("MidiOutPort::run() launching sender for {}", portName);
+		outQ.enable();
+		outQ.enableWait();
+		myThread = std::thread([this]() { runner(); });
+	}
+}
+
+/*!
+ * stop taking messages, and wait for the sender thread to finish
+ */
+void MidiOutPort::stop()
+{
+	if (isRunning.exchange(false)) {
+		outQ.disableWait();
+		outQ.enable(false);
+		if (myThread.joinable()) myThread.join();
+	}
+}
+
+/*!
+ * add a midi message to what's going out in the next flush(), if it's for this port. apis that can't take more than one message at
+ * a time get it straight away. a message for allPorts is for us too
+ *  \return false if it was for another port
+ */
+bool MidiOutPort::sendMIDI(xymsg::midi_t m)
+{
+	if (m.port != portNo && m.port != xymidi::allPorts) return false;
+	if (!encoder.add(m)) {
+		flush();
+		encoder.add(m);
+	}
+	if (!midiOut->batches()) flush();
+	return true;
+}
+
+/*!
+ * send whatever we've encoded since the last flush, in a single call to the port, and note how long each message took to get here
+ */
+void MidiOutPort::flush()
+{
+	try {
+		if (!encoder.empty()) midiOut->send(encoder.data(), encoder.size());
+		for (const auto msg : encoded) xymsg::latency().record(*msg, xymsg::sink::midi);
+	} catch (const std::exception& e) {
+		error("MidiOutPort::flush() gets exception on {}: {}", portName, e.what());
+	}
+	encoder.clear();
+	encoded.clear();
+}
+
+/*!
+ * put the chunks of a sysex back together, and send it when we have the last. the device wants a sysex in one piece, and that keeps
+ * anything else from being sent in the middle of it. a sysex that lost a chunk on the way, or was cut short, never goes out
+ *  \return true if this chunk finished a sysex, and it went out
+ */
+bool MidiOutPort::sendSysx(const xymsg::SysxChunk& chunk)
+{
+	if (chunk.first) {
+		if (!sysxOut.empty()) warn("MidiOutPort dropping {} bytes of unfinished sysex on {}", sysxOut.size(), portName);
+		sysxOut.clear();
+	}
+	if (!sysxCheck.next(chunk)) {
+		if (!sysxOut.empty() || chunk.first) warn("MidiOutPort dropping a sysex on {} that lost a chunk or was cut short", portName);
+		sysxOut.clear();
+		return false;
+	}
+	sysxOut.insert(sysxOut.end(), chunk.begin(), chunk.end());
+	if (!chunk.last) return false;
+	if (sysxOut.back() != (uint8_t)xymidi::cmd::sysxEnd) sysxOut.push_back((uint8_t)xymidi::cmd::sysxEnd);
+	midiOut->send(sysxOut.data(), sysxOut.size());
+	sysxOut.clear();
+	return true;
+}
+
+/*!
+ * send a message out of the port, or at least into the encoder for the next flush(). the message must last until then. a list may
+ * hold messages for other ports as well, and we only send our own
+ */
+void MidiOutPort::send(const xymsg::msg_t& msg)
+{
+	try {
+		switch (xymsg::typeOf(msg)) {
+		case xymsg::typ::midi:
+			if (sendMIDI(std::get<xymsg::MidiMsg>(msg.body).midi)) encoded.push_back(&msg);
+			break;
+		case xymsg::typ::midi_list: {
+			bool ours = false;
+			for (const auto &m: *std::get<xymsg::MidiListMsg>(msg.body)) {
+				ours = sendMIDI(m) || ours;
+			}
+			if (ours) encoded.push_back(&msg);
+			break;
+		}
+		case xymsg::typ::sysx:
+			flush();
+			if (sendSysx(*std::get<xymsg::SysxMsg>(msg.body))) xymsg::latency().record(msg, xymsg::sink::midi);
+			break;
+		default:
+			break;
+		}
+		if (encoded.size() == encoded.capacity()) flush();
+	} catch (const std::exception& e) {
+		error("MidiOutPort() gets exception on {}: {}", portName, e.what());
+	}
+}
+
+/*!
+ * main body of the port's queue processor. messages go out as soon as we take them off the queue, unless they have a send time in
+ * the future, in which case they wait in the scheduler. we sleep on the queue until just before the next scheduled message is due,
+ * and spin from there, so it goes out on time however late the queue wakes us.
+ */
+void MidiOutPort::runner()
+{
+	std::vector<xymsg::msg_t> batch;
+	batch.reserve(xymsg::maxBatch);
+	while (isRunning) {
+		std::size_t n = 0;
+		if (scheduler.empty()) {
+			n = outQ.drain(batch, xymsg::maxBatch);
+		} else {
+			const auto wait = scheduler.nextDue() - spinWindow - std::chrono::steady_clock::now();
+			if (wait > 0us) n = outQ.drain(batch, xymsg::maxBatch, wait);
+		}
+		if (n > 0) {
+			const auto now = std::chrono::steady_clock::now();
+			for (auto& msg : batch) {
+				if (msg.hasDue() && msg.due() > now && scheduler.schedule(std::move(msg))) continue;
+				send(msg);
+			}
+			flush();
+			batch.clear();
+		} else {
+			if (isRunning && !outQ.waitEnabled()) std::this_thread::sleep_for(10us);
+		}
+		if (!scheduler.empty()) {
+			const auto due = scheduler.nextDue();
+			auto now = std::chrono::steady_clock::now();
+			if (due - now <= spinWindow) {
+				while (now < due) now = std::chrono::steady_clock::now();
+				scheduler.release(now, [this](const xymsg::msg_t& msg) {
+					send(msg);
+					flush();
+				});
+			}
+		}
+	}
+}
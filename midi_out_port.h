@@ -0,0 +1,78 @@
+#pragma once
+
+#include "message.h"
+#include "midi_encoder.h"
+#include "midi_scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * somewhere midi goes out: an rtmidi port, or a destination on the alsa sequencer
+ */
+class MidiOutDevice
+{
+public:
+	virtual ~MidiOutDevice() = default;
+
+	/*!
+	 * send a whole sysex, or one or more other messages if batches(). may throw
+	 */
+	virtual void send(const unsigned char* data, std::size_t len) = 0;
+	virtual bool batches() const = 0;	//!< takes more than one message in a send()
+};
+
+/*!
+ * how we drive the midi ports
+ */
+struct midi_config_t {
+	bool alsaSeq = false;	//!< use the alsa sequencer directly rather than through rtmidi, if we're built with it
+	locked::bounds_t portQ{ 256, locked::overflow::drop_oldest };	//!< bounds on each output port's queue
+	xymsg::lane_map_t lanes;	//!< lanes for the output port queues, as for the hub's queues
+	locked::lane_policy_t lanePolicy;
+	std::chrono::milliseconds scanInterval{ 2000 };	//!< how often we look for midi ports coming and going. 0 never looks again
+};
+
+/*!
+ * one midi output port, with its own queue, scheduler and thread, so a slow or stuck device only holds up its own messages
+ */
+class MidiOutPort
+{
+public:
+	MidiOutPort(std::unique_ptr<MidiOutDevice> _midiOut, uint8_t _port, std::string _name, const midi_config_t& config);
+	~MidiOutPort();
+
+	void run();
+	void stop();
+
+	uint8_t port() const { return portNo; }
+	const std::string& name() const { return portName; }
+	xymsg::q_t& queue() { return outQ; }
+	MidiScheduler::stats_t schedulerStats() const { return scheduler.stats(); }
+
+private:
+	void runner();
+	void send(const xymsg::msg_t& msg);
+	bool sendMIDI(xymsg::midi_t m);
+	void flush();
+	bool sendSysx(const xymsg::SysxChunk& chunk);
+
+private:
+	std::atomic<bool> isRunning{ false };
+	std::thread myThread;
+
+	std::unique_ptr<MidiOutDevice> midiOut;
+	uint8_t portNo;
+	std::string portName;
+	xymsg::q_t outQ;
+
+	std::vector<unsigned char> sysxOut;	//!< sysex going out, put back together from its chunks
+	xymsg::sysx_check sysxCheck;	//!< that we have every chunk of it
+	MidiScheduler scheduler;	//!< midi waiting for its time to go out
+	xymidi::encoder encoder;	//!< midi going out in the next flush()
+	std::vector<const xymsg::msg_t*> encoded;	//!< the messages in the encoder, for their latency once they're sent
+};
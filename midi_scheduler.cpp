@@ -0,0 +1,38 @@
+#include "midi_scheduler.h"
+
+/*!
+ * \class MidiScheduler
+ * a time ordered store for midi that isn't to go out yet. it never allocates once it is made
+ */
+MidiScheduler::MidiScheduler()
+{
+	heap.reserve(capacity);
+}
+
+/*!
+ * hold back a message until its due time
+ *  \return false if the schedule is full, in which case the message is left for the caller to send now
+ */
+bool MidiScheduler::schedule(xymsg::msg_t&& msg)
+{
+	if (heap.size() >= capacity) {
+		overflows.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	const auto due = msg.due();
+	heap.push_back({ due, seq++, std::move(msg) });
+	std::push_heap(heap.begin(), heap.end(), later);
+	pending.store(heap.size(), std::memory_order_relaxed);
+	scheduled.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+MidiScheduler::stats_t MidiScheduler::stats() const
+{
+	stats_t s;
+	s.pending = pending.load(std::memory_order_relaxed);
+	s.scheduled = scheduled.load(std::memory_order_relaxed);
+	s.overflows = overflows.load(std::memory_order_relaxed);
+	s.lateness = lateness.snapshot();
+	return s;
+}
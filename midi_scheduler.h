@@ -0,0 +1,73 @@
+#pragma once
+
+#include "message.h"
+#include "locked/meter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/*!
+ * holds back midi going out until it is due. the midi worker puts anything with a send time in the future in here, and takes it
+ * out again in time order, as close to the time as it can: it waits on its queue until just before the next one is due, and spins
+ * for the rest. how late each one is released goes in a histogram.
+ * only the midi worker's thread touches the schedule, though stats() may be called from anywhere.
+ */
+class MidiScheduler
+{
+public:
+	using clock_t = std::chrono::steady_clock;
+	static constexpr std::size_t capacity = 4096;	//!< most messages we hold back at once. more than this go out straight away
+
+	MidiScheduler();
+
+	bool schedule(xymsg::msg_t&& msg);
+	bool empty() const { return heap.empty(); }
+	clock_t::time_point nextDue() const { return heap.front().due; }
+
+	/*!
+	 * hand everything due by 'now' to send(const msg_t&), in time order, and in the order they were scheduled for equal times
+	 *  \return the number released
+	 */
+	template<typename F>
+	std::size_t release(clock_t::time_point now, F&& send)
+	{
+		std::size_t n = 0;
+		while (!heap.empty() && heap.front().due <= now) {
+			std::pop_heap(heap.begin(), heap.end(), later);
+			auto e = std::move(heap.back());
+			heap.pop_back();
+			pending.store(heap.size(), std::memory_order_relaxed);
+			const auto late = std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - e.due).count();
+			lateness.record(late > 0 ? static_cast<uint64_t>(late) : 0);
+			send(e.msg);
+			++n;
+		}
+		return n;
+	}
+
+	struct stats_t {
+		std::size_t pending = 0;
+		uint64_t scheduled = 0;		//!< messages held back since we started
+		uint64_t overflows = 0;		//!< messages sent early because the schedule was full
+		locked::dwell_hist_t lateness;	//!< how long after their time scheduled messages were released, in microseconds
+	};
+	stats_t stats() const;
+
+private:
+	struct entry_t {
+		clock_t::time_point due;
+		uint64_t seq;
+		xymsg::msg_t msg;
+	};
+	static bool later(const entry_t& a, const entry_t& b) { return a.due > b.due || (a.due == b.due && a.seq > b.seq); }
+
+	std::vector<entry_t> heap;	//!< min heap on due time, reserved to capacity
+	uint64_t seq = 0;
+	std::atomic<std::size_t> pending{ 0 };
+	std::atomic<uint64_t> scheduled{ 0 };
+	std::atomic<uint64_t> overflows{ 0 };
+	locked::hist_meter lateness;
+};
@@ -1,33 +1,122 @@
 #include "midi_worker.h"
+#ifdef ALSA_MIDI
+#include "alsa_seq.h"
+#endif
 
 #include "rtmidi/RtMidi.h"
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <chrono>
 
 using namespace std::chrono_literals;
 
+constexpr auto maxArrivalSkew = 2ms;	//!< how far we trust rtmidi's deltas to drift from our clock before we start over from now
+
 using spdlog::info;
 using spdlog::error;
 using spdlog::debug;
 using spdlog::warn;
 
 
-MidiWorker::MidiWorker(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, xymsg::q_t &_midiInQ)
-	: spiInQ(_spiInQ), oscInQ(_oscInQ), midiOutQ(_midiInQ)
+namespace {
+
+const std::string clientPrefix = "xypi midi";	//!< our own ports, as they show up in the lists. we don't connect to those
+const std::string virtualInName = "Xypi midi in";
+const std::string virtualOutName = "Xypi midi out";
+
+/*!
+ * open the port with the given name, if it is still there. the lists shift as devices come and go, so we look for it again
+ * rather than trusting its place in an older one
+ */
+template<typename M>
+bool openByName(M& midi, const std::string& name, const std::string& ourName)
+{
+	const uint32_t n = midi.getPortCount();
+	for (uint32_t i = 0; i < n; i++) {
+		if (midi.getPortName(i) == name) {
+			midi.openPort(i, ourName);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*!
+ * the names of the ports a probe can see
+ */
+std::vector<std::string> listPorts(RtMidi* probe)
+{
+	std::vector<std::string> names;
+	if (!probe) return names;
+	try {
+		const uint32_t n = probe->getPortCount();
+		for (uint32_t i = 0; i < n; i++) {
+			names.push_back(probe->getPortName(i));
+		}
+	} catch (const RtMidiError &e) {
+		error(e.getMessage());
+	}
+	return names;
+}
+
+/*!
+ * leave our own ports out of a list of names
+ */
+std::vector<std::string> notOurs(std::vector<std::string> names)
+{
+	names.erase(std::remove_if(names.begin(), names.end(), [](const std::string& name) {
+		return name.compare(0, clientPrefix.size(), clientPrefix) == 0;
+	}), names.end());
+	return names;
+}
+
+/*!
+ * an rtmidi output port. alsa and coremidi take several messages in one send
+ */
+class RtMidiOutDevice : public MidiOutDevice
+{
+public:
+	explicit RtMidiOutDevice(std::unique_ptr<RtMidiOut> _midiOut) : midiOut(std::move(_midiOut)), api(midiOut->getCurrentApi()) {}
+
+	void send(const unsigned char* data, std::size_t len) override { midiOut->sendMessage(data, len); }
+	bool batches() const override { return api == RtMidi::LINUX_ALSA || api == RtMidi::MACOSX_CORE; }
+
+private:
+	std::unique_ptr<RtMidiOut> midiOut;
+	RtMidi::Api api;
+};
+
+}
+
+MidiWorker::MidiWorker(boost::asio::io_service& ioService, xymsg::Router& _router, xymsg::q_t& _midiOutQ, const midi_config_t& _config)
+	: config(_config), ports(std::make_shared<port_table_t>()), router(_router), midiOutQ(_midiOutQ)
 {
- 	try {
- 		midiIn = std::make_unique<RtMidiIn>(RtMidi::Api::UNSPECIFIED, "xypi midi in");
-	} catch ( RtMidiError &e ) {
+#ifdef ALSA_MIDI
+	if (config.alsaSeq) {
+		try {
+			alsaSeq = std::make_unique<AlsaSeq>(ioService, "xypi midi in");
+		} catch (const std::system_error& e) {
+			error("MidiWorker can't use the alsa sequencer, so it's rtmidi: {}", e.what());
+		}
+	}
+#else
+	if (config.alsaSeq) warn("MidiWorker isn't built with the alsa sequencer, so it's rtmidi");
+#endif
+	try {
+		inProbe = std::make_unique<RtMidiIn>(RtMidi::Api::UNSPECIFIED, "xypi midi in");
+	} catch (const RtMidiError &e) {
 		error(e.getMessage());
 	}
- 	try {
-		midiOut = std::make_unique<RtMidiOut>(RtMidi::Api::UNSPECIFIED, "xypi midi out");
-	} catch ( RtMidiError &e ) {
+	try {
+		outProbe = std::make_unique<RtMidiOut>(RtMidi::Api::UNSPECIFIED, "xypi midi out");
+	} catch (const RtMidiError &e) {
 		error(e.getMessage());
 	}
 	scanPorts();
-	openPorts();
+	// with nothing to talk to, we open ports of our own for other software to connect to, where the api allows it
+	const auto table = std::atomic_load(&ports);
+	if (table->in.empty() && table->out.empty() && hasVirtualPorts()) updatePorts({ virtualInName }, { virtualOutName });
 }
 
 MidiWorker::~MidiWorker()
@@ -36,190 +125,355 @@ MidiWorker::~MidiWorker()
 }
 
 /*!
- * let's see what we can talk to
+ * let's see what we can talk to. ports that have turned up are opened, and ports that have gone are closed. once we're running,
+ * this is the monitor's job, and it shouldn't be called from anywhere else
  */
 void MidiWorker::scanPorts()
 {
-	midiInPorts.clear();
-	midiOutPorts.clear();
-	if (midiIn) {
-		uint32_t nInPorts = midiIn->getPortCount();
-		std::string portName;
-		for (uint32_t i=0; i<nInPorts; i++) {
-			try {
-				portName = midiIn->getPortName(i);
-				midiInPorts.push_back(portName);
-			} catch (const RtMidiError &error ) {
-				error.printMessage();
-				break;
-			}
-			info(">> Input Port #{}: {}", i+1 , portName);
-		}
- 	}
-	if (midiOut) {
-		uint32_t nOutPorts = midiIn->getPortCount();
-		std::string portName;
-		for (uint32_t i=0; i<nOutPorts; i++) {
-			try {
-				portName = midiIn->getPortName(i);
-				midiOutPorts.push_back(portName);
-			} catch (const RtMidiError &error ) {
-				error.printMessage();
-				break;
-			}
-			info(">> Output Port #{}: {}", i+1 , portName);
-		}
-	}
-}
-
-void MidiWorker::openPorts()
-{
-	auto hvp = hasVirtualPorts();
-	if (midiInPorts.size() > 0) {
-		midiIn->setCallback([](double deltaTime, std::vector<unsigned char> *imsg, void *data) {
-			const auto *worker = static_cast<MidiWorker*>(data);
-			const auto msglen = imsg->size();
-			if (msglen <= 3) {
-				const auto omsgp = std::make_shared<xymsg::MidiMsg>();
-				auto &omdi = omsgp->midi;
-				omdi.cmd = imsg->at(0);
-				if (msglen > 1) {
-					omdi.val1 = imsg->at(1);
-					if (msglen > 2) {
-						omdi.val2 = imsg->at(2);
-					}
-				}
-				worker->oscInQ.push(omsgp);
-				worker->spiInQ.push(omsgp);
-			} else { // for the moment assume this is just not going to happen except for sysx
-				warn("unexpected midi length for {}: {}", imsg->at(0), imsg->size());
-			}
-		}, this);
-		midiIn->ignoreTypes(false, false, false);
-		if (hvp) {
-			midiIn->openPort(0, "Xypi midi in");
-		} else {
-			midiIn->openVirtualPort("Xypi midi in");
+#ifdef ALSA_MIDI
+	if (alsaSeq) {
+		updatePorts(notOurs(alsaSeq->inputs()), notOurs(alsaSeq->outputs()));
+		return;
+	}
+#endif
+	updatePorts(notOurs(listPorts(inProbe.get())), notOurs(listPorts(outProbe.get())));
+}
+
+/*!
+ * bring the port table into line with the ports that are there now. we open the new ports and build a new table before swapping it
+ * in, so traffic to the ports we already had never waits on a device being opened. ports keep their numbers, which is how messages
+ * find them, for as long as we run: a new port gets the lowest number no port has had, and a port that comes back gets its old one.
+ */
+void MidiWorker::updatePorts(const std::vector<std::string>& inNames, const std::vector<std::string>& outNames)
+{
+	auto listed = [](const std::vector<std::string>& names, const std::string& name) {
+		return std::find(names.begin(), names.end(), name) != names.end();
+	};
+	const auto old = std::atomic_load(&ports);
+	auto table = std::make_shared<port_table_t>(*old);
+	std::vector<std::shared_ptr<in_port_t>> closedIn;
+	std::vector<std::shared_ptr<MidiOutPort>> closedOut;
+
+	for (auto& p : table->in) {
+		if (p && p->name != virtualInName && !listed(inNames, p->name)) {
+			info("<< Input Port #{} gone: {}", p->port, p->name);
+#ifdef ALSA_MIDI
+			if (alsaSeq) alsaSeq->close(p->seqPort);
+#endif
+			closedIn.push_back(std::move(p));
+			p.reset();
 		}
 	}
-	if (midiOutPorts.size() > 0) {
-		if (hvp) {
-			midiOut->openPort(0, "Xypi midi out");
-		} else {
-			midiOut->openVirtualPort("Xypi midi out");
+	for (auto& p : table->out) {
+		if (p && p->name() != virtualOutName && !listed(outNames, p->name())) {
+			info("<< Output Port #{} gone: {}", p->port(), p->name());
+			closedOut.push_back(std::move(p));
+			p.reset();
 		}
 	}
+	bool changed = !closedIn.empty() || !closedOut.empty();
+	for (const auto& name : inNames) {
+		if (std::any_of(table->in.begin(), table->in.end(), [&name](const auto& p) { return p && p->name == name; })) continue;
+		const auto n = portNumber(inNumbers, name);
+		if (n < 0) continue;
+		if (auto p = openIn(static_cast<uint8_t>(n), name, name == virtualInName)) {
+			if (table->in.size() <= static_cast<std::size_t>(n)) table->in.resize(n + 1);
+			table->in[n] = std::move(p);
+			changed = true;
+		}
+	}
+	for (const auto& name : outNames) {
+		if (std::any_of(table->out.begin(), table->out.end(), [&name](const auto& p) { return p && p->name() == name; })) continue;
+		const auto n = portNumber(outNumbers, name);
+		if (n < 0) continue;
+		if (auto p = openOut(static_cast<uint8_t>(n), name, name == virtualOutName)) {
+			if (isRunning) p->run();
+			if (table->out.size() <= static_cast<std::size_t>(n)) table->out.resize(n + 1);
+			table->out[n] = std::move(p);
+			changed = true;
+		}
+	}
+	if (!changed) return;
+	while (!table->in.empty() && !table->in.back()) table->in.pop_back();
+	while (!table->out.empty() && !table->out.back()) table->out.pop_back();
+	std::atomic_store(&ports, std::shared_ptr<const port_table_t>(std::move(table)));
+	// the dispatcher may still be pushing to the old table's ports, but a stopped port just drops them
+	for (auto& p : closedOut) p->stop();
+}
+
+/*!
+ * the number for a port, by name: the one it had before, or the lowest that no port has had
+ *  \return the number, or -1 if we've run out
+ */
+int MidiWorker::portNumber(std::map<std::string, uint8_t>& numbers, const std::string& name)
+{
+	const auto it = numbers.find(name);
+	if (it != numbers.end()) return it->second;
+	std::vector<bool> taken(256);
+	for (const auto& n : numbers) taken[n.second] = true;
+	const auto free = std::find(taken.begin(), taken.end(), false);
+	if (free == taken.end()) {
+		warn("MidiWorker has no port number left for {}", name);
+		return -1;
+	}
+	const auto n = static_cast<uint8_t>(free - taken.begin());
+	numbers[name] = n;
+	return n;
+}
+
+std::shared_ptr<MidiWorker::in_port_t> MidiWorker::openIn(uint8_t port, const std::string& name, bool isVirtual)
+{
+	auto in = std::make_shared<in_port_t>();
+	in->worker = this;
+	in->port = port;
+	in->name = name;
+#ifdef ALSA_MIDI
+	if (alsaSeq) {
+		in->seqPort = isVirtual ? alsaSeq->openVirtual(name, port) : alsaSeq->connect(name, port);
+		if (in->seqPort < 0) return nullptr;
+		info(">> Input Port #{}: {}", port, name);
+		return in;
+	}
+#endif
+	try {
+		in->midiIn = std::make_unique<RtMidiIn>(RtMidi::Api::UNSPECIFIED, "xypi midi in");
+		in->midiIn->setCallback([](double deltaTime, std::vector<unsigned char> *imsg, void *data) {
+			auto *in = static_cast<in_port_t*>(data);
+			in->worker->receive(*in, deltaTime, *imsg);
+		}, in.get());
+		in->midiIn->ignoreTypes(false, false, false);
+		if (isVirtual) {
+			in->midiIn->openVirtualPort(name);
+		} else if (!openByName(*in->midiIn, name, virtualInName)) {
+			return nullptr;
+		}
+	} catch (const RtMidiError &e) {
+		error("MidiWorker can't open input port {}: {}", name, e.getMessage());
+		return nullptr;
+	}
+	info(">> Input Port #{}: {}", port, name);
+	return in;
+}
+
+std::shared_ptr<MidiOutPort> MidiWorker::openOut(uint8_t port, const std::string& name, bool isVirtual)
+{
+#ifdef ALSA_MIDI
+	if (alsaSeq) {
+		try {
+			auto midiOut = std::make_unique<AlsaSeqOut>("xypi midi out", name, isVirtual);
+			info(">> Output Port #{}: {}", port, name);
+			return std::make_shared<MidiOutPort>(std::move(midiOut), port, name, config);
+		} catch (const std::system_error& e) {
+			error("MidiWorker can't open output port {}: {}", name, e.what());
+			return nullptr;
+		}
+	}
+#endif
+	try {
+		auto midiOut = std::make_unique<RtMidiOut>(RtMidi::Api::UNSPECIFIED, "xypi midi out");
+		if (isVirtual) {
+			midiOut->openVirtualPort(name);
+		} else if (!openByName(*midiOut, name, virtualOutName)) {
+			return nullptr;
+		}
+		info(">> Output Port #{}: {}", port, name);
+		return std::make_shared<MidiOutPort>(std::make_unique<RtMidiOutDevice>(std::move(midiOut)), port, name, config);
+	} catch (const RtMidiError &e) {
+		error("MidiWorker can't open output port {}: {}", name, e.getMessage());
+		return nullptr;
+	}
+}
+
+/*!
+ * look for ports coming and going, every so often, until we stop
+ */
+void MidiWorker::monitor()
+{
+	std::unique_lock<std::mutex> lock(monitorMutex);
+	while (isRunning) {
+		monitorWake.wait_for(lock, config.scanInterval, [this]() { return !isRunning; });
+		if (!isRunning) break;
+		lock.unlock();
+		scanPorts();
+		lock.lock();
+	}
+}
+
+/*!
+ * pass on a message from an input port's callback, tagged with the port it came in on
+ */
+void MidiWorker::receive(in_port_t& in, double deltaTime, const std::vector<unsigned char>& imsg)
+{
+	const auto msglen = imsg.size();
+	if (msglen == 0) return;
+	const auto t = arrivalTime(in, deltaTime);
+	const auto status = imsg[0];
+	if (status == (uint8_t)xymidi::cmd::sysxStart || !xymidi::isCmdByte(status)) {
+		receiveSysx(in, imsg.data(), msglen, t);
+	} else if (msglen <= 3) {
+		xymsg::MidiMsg omsg;
+		auto &omdi = omsg.midi;
+		omdi.cmd = status;
+		omdi.port = in.port;
+		if (msglen > 1) {
+			omdi.val1 = imsg[1];
+			if (msglen > 2) {
+				omdi.val2 = imsg[2];
+			}
+		}
+		xymsg::msg_t msg(omsg);
+		msg.t = t;
+		router.route(xymsg::source::midi, std::move(msg));
+	} else {
+		warn("unexpected midi length for {} on port {}: {}", status, in.port, msglen);
+	}
+}
+
+/*!
+ * when a midi message arrived, from rtmidi's delta since the one before: the backend stamps messages as they come in, which is
+ * earlier than our callback gets them when several arrive together. we chain the deltas from the last arrival on the same port,
+ * and fall back on the time now for the first message, or when the chain has drifted off our own clock.
+ */
+std::chrono::steady_clock::time_point MidiWorker::arrivalTime(in_port_t& in, double deltaTime)
+{
+	const auto now = std::chrono::steady_clock::now();
+	auto t = in.lastArrival + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(deltaTime));
+	if (in.lastArrival == std::chrono::steady_clock::time_point{} || t > now || now - t > maxArrivalSkew) t = now;
+	in.lastArrival = t;
+	return t;
+}
+
+/*!
+ * pass on a sysex from an input port's callback, in chunks. most apis give us the whole thing at once, but some hand over a long
+ * one in pieces, so anything that doesn't start with a status byte carries on from the last
+ */
+void MidiWorker::receiveSysx(in_port_t& in, const uint8_t* data, std::size_t len, std::chrono::steady_clock::time_point t)
+{
+	auto emit = [this, t](xymsg::msg_t&& msg) {
+		msg.t = t;
+		router.route(xymsg::source::midi, std::move(msg));
+	};
+	if (data[0] == (uint8_t)xymidi::cmd::sysxStart) in.sysxIn.start(in.port, emit);
+	in.sysxIn.append(data, len, emit);
+	if (data[len - 1] == (uint8_t)xymidi::cmd::sysxEnd) in.sysxIn.finish(emit);
 }
 
 bool MidiWorker::hasVirtualPorts()
 {
+#ifdef ALSA_MIDI
+	if (alsaSeq) return true;
+#endif
 	std::vector<RtMidi::Api> apis;
-	midiIn->getCompiledApi(apis);
+	RtMidi::getCompiledApi(apis);
 	return std::find(apis.begin(), apis.end(), RtMidi::WINDOWS_MM) == apis.end();
 }
 
 /*!
- * launch the OSCWorker and return immediately. we check that the dongle is open here, and if we have enough permission,
- * we list whatever files we find.
+ * launch the output ports' senders, our own thread to hand them their messages, and the port monitor, and return immediately. with
+ * the alsa sequencer, input is read on the io context from now on
  */
 void MidiWorker::run()
 {
 	if (!isRunning.exchange(true)) {
-		debug("OSCWorker::run() launching main thread");
+		debug("MidiWorker::run() launching main thread");
+		forEachOutPort([](MidiOutPort& p) { p.run(); });
 		myThread = std::thread([this]() { runner(); });
+#ifdef ALSA_MIDI
+		if (alsaSeq) {
+			alsaSeq->start([this](uint8_t, const xymsg::midi_t& m, std::chrono::steady_clock::time_point t) {
+				xymsg::msg_t msg(xymsg::MidiMsg{ m });
+				msg.t = t;
+				router.route(xymsg::source::midi, std::move(msg));
+			}, [this](uint8_t port, const uint8_t* data, std::size_t len, std::chrono::steady_clock::time_point t) {
+				const auto table = std::atomic_load(&ports);
+				if (port < table->in.size() && table->in[port]) receiveSysx(*table->in[port], data, len, t);
+			});
+		}
+#endif
+		if (config.scanInterval.count() > 0) monitorThread = std::thread([this]() { monitor(); });
 	}
 }
 
 
 /*!
- * stop the worker thread and wait until it completes. then clean up the dongle
+ * stop the monitor, the inputs and the worker thread and wait until they complete, then the output ports' senders
  */
 void MidiWorker::stop()
 {
 	if (isRunning.exchange(false)) {
+		{
+			std::lock_guard<std::mutex> lock(monitorMutex);
+		}
+		monitorWake.notify_all();
+		if (monitorThread.joinable()) monitorThread.join();
+#ifdef ALSA_MIDI
+		if (alsaSeq) alsaSeq->stop();
+#endif
+		// closing an input waits for its callback, so nothing we take in is routed once we've stopped
+		for (const auto& in : std::atomic_load(&ports)->in) {
+			if (in && in->midiIn) in->midiIn->closePort();
+		}
 		midiOutQ.disableWait();
 		midiOutQ.enable(false);
 		if (myThread.joinable()) myThread.join();
+		forEachOutPort([](MidiOutPort& p) { p.stop(); });
 	}
 }
 
 /*!
- *
+ * push a message onto an output port's queue. the queues are bounded, so a port that has stopped taking messages never holds up
+ * the others: its queue overflows instead
  */
-inline void MidiWorker::sendMIDI(xymsg::midi_t m)
+void MidiWorker::toPort(const port_table_t& table, uint8_t port, const xymsg::msg_t& msg)
 {
-	const auto chan_cmd = m.cmd & 0xf0;
-	std::vector<unsigned char> msg;
-	if (chan_cmd == 0xf0) {
-		switch (m.cmd) {
-		case (uint8_t)xymidi::cmd::songPos:
-			msg.assign({m.cmd, m.val1, m.val2});
-			break;
-		case (uint8_t)xymidi::cmd::timeCode:
-		case (uint8_t)xymidi::cmd::songSel:
-			msg.assign({m.cmd, m.val1});
-			break;
-		case (uint8_t)xymidi::cmd::clock:
-		case (uint8_t)xymidi::cmd::start:
-		case (uint8_t)xymidi::cmd::cont:
-		case (uint8_t)xymidi::cmd::stop:
-		case (uint8_t)xymidi::cmd::sensing:
-		case (uint8_t)xymidi::cmd::tuneReq:
-			msg.assign({m.cmd});
-			break;
-
-		case (uint8_t)xymidi::cmd::sysxStart: /*! shouldn't see anyway. handle separately */
-		case (uint8_t)xymidi::cmd::sysxEnd:
-		default:
-			return;
-		}
+	if (port == xymidi::allPorts) {
+		for (auto& p : table.out) if (p) p->queue().push(msg);
+	} else if (port < table.out.size() && table.out[port]) {
+		table.out[port]->queue().push(msg);
 	} else {
-		switch (chan_cmd) {
-		case (uint8_t)xymidi::cmd::noteOn:
-		case (uint8_t)xymidi::cmd::noteOff:
-		case (uint8_t)xymidi::cmd::keyPress:
-		case (uint8_t)xymidi::cmd::ctrl:
-		case (uint8_t)xymidi::cmd::bend:
-			msg.assign({m.cmd, m.val1, m.val2});
-			break;
-		case (uint8_t)xymidi::cmd::prog:
-		case (uint8_t)xymidi::cmd::chanPress:
-			msg.assign({m.cmd, m.val1});
-			break;
-		default:
-			return;
+		unknownPort.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+/*!
+ * hand a message to the port it's for. a list goes to each port that has something in it, and the port picks out its own
+ */
+void MidiWorker::dispatch(const port_table_t& table, xymsg::msg_t&& msg)
+{
+	switch (xymsg::typeOf(msg)) {
+	case xymsg::typ::midi:
+		toPort(table, std::get<xymsg::MidiMsg>(msg.body).midi.port, msg);
+		break;
+	case xymsg::typ::sysx:
+		toPort(table, std::get<xymsg::SysxMsg>(msg.body)->port, msg);
+		break;
+	case xymsg::typ::midi_list: {
+		const auto& list = *std::get<xymsg::MidiListMsg>(msg.body);
+		for (auto m = list.begin(); m != list.end(); ++m) {
+			if (std::none_of(list.begin(), m, [m](const xymsg::midi_t& o) { return o.port == m->port; })) toPort(table, m->port, msg);
 		}
+		break;
+	}
+	default:
+		break;
 	}
-	midiOut->sendMessage(&msg);
 }
 
 /*!
- * main body of the work queue processor
+ * main body of the work queue processor. all we do is sort messages onto the output ports' queues, which never blocks for long, so
+ * the midi queue keeps moving whatever the ports are up to. each batch goes by the port table as it was when we took it
  */
 void MidiWorker::runner()
 {
 	midiOutQ.enable();
 	midiOutQ.enableWait();
+	std::vector<xymsg::msg_t> batch;
+	batch.reserve(xymsg::maxBatch);
 	while (isRunning) {
-		auto optMsg = midiOutQ.front();
-		if (optMsg.second) {
-			// specifically make a new reference to the shared_ptr to work with, so we can leave the work at the top of q
-			// workRef should still be valid even if it is no longer front
-			const auto &msg = optMsg.first;
-			try {
-				if (msg->type == xymsg::typ::midi) {
-					const auto &mmsg = std::reinterpret_pointer_cast<xymsg::MidiMsg>(msg)->midi;
-					sendMIDI(mmsg);
-				} else if (msg->type == xymsg::typ::midi) {
-					const auto &mlmsg = std::reinterpret_pointer_cast<xymsg::MidiListMsg>(msg)->midi;
-					for (const auto &m: mlmsg) {
-						sendMIDI(m);
-					}
-				}
-			} catch (const std::exception& e) {
-				error("MidiWorker() gets exception: {}", e.what());
-			}
-			midiOutQ.remove(optMsg.first); // now it's safe to remove!
+		if (midiOutQ.drain(batch, xymsg::maxBatch) > 0) {
+			const auto table = std::atomic_load(&ports);
+			for (auto& msg : batch) dispatch(*table, std::move(msg));
+			batch.clear();
 		} else {
 			if (isRunning && !midiOutQ.waitEnabled()) std::this_thread::sleep_for(10us);
 		}
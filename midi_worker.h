@@ -1,41 +1,107 @@
 #pragma once
 
 #include "message.h"
+#include "midi_out_port.h"
+#include "router.h"
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <thread>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
 
 class RtMidiIn;
 class RtMidiOut;
+#ifdef ALSA_MIDI
+class AlsaSeq;
+#endif
 
 class MidiWorker
 {
 public:
-	MidiWorker(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, xymsg::q_t& _midiInQ);
+	MidiWorker(boost::asio::io_service& ioService, xymsg::Router& _router, xymsg::q_t& _midiOutQ, const midi_config_t& config = {});
 	~MidiWorker();
 
 	void run();
 	void stop();
 
 	void scanPorts();
-	void openPorts();
 
 	bool hasVirtualPorts();
+
+	/*!
+	 * call f(MidiOutPort&) for each of the output ports we have open right now
+	 */
+	template<typename F>
+	void forEachOutPort(F f)
+	{
+		const auto table = std::atomic_load(&ports);
+		for (auto& p : table->out) if (p) f(*p);
+	}
+
+	uint64_t unknownPortCount() const { return unknownPort.load(std::memory_order_relaxed); }
+
 private:
+	/*!
+	 * an input port, and what its callback needs to keep between messages. the port is last, so it is closed, and the callback
+	 * stopped, before the rest goes
+	 */
+	struct in_port_t {
+		MidiWorker* worker = nullptr;
+		uint8_t port = 0;
+		std::string name;
+		std::chrono::steady_clock::time_point lastArrival{};	//!< when the previous midi in arrived
+		xymsg::sysx_builder sysxIn;	//!< sysex coming in
+#ifdef ALSA_MIDI
+		int seqPort = -1;	//!< our alsa sequencer port for it, if we use the sequencer
+#endif
+		std::unique_ptr<RtMidiIn> midiIn;
+	};
+
+	/*!
+	 * the ports we have open, by port number, with gaps for any that have gone. a table is never changed once it is published:
+	 * the monitor makes a new one, and swaps it in
+	 */
+	struct port_table_t {
+		std::vector<std::shared_ptr<in_port_t>> in;
+		std::vector<std::shared_ptr<MidiOutPort>> out;
+	};
+
 	void runner();
-	void sendMIDI(xymsg::midi_t m);
+	void monitor();
+	void updatePorts(const std::vector<std::string>& inNames, const std::vector<std::string>& outNames);
+	static int portNumber(std::map<std::string, uint8_t>& numbers, const std::string& name);
+	std::shared_ptr<in_port_t> openIn(uint8_t port, const std::string& name, bool isVirtual);
+	std::shared_ptr<MidiOutPort> openOut(uint8_t port, const std::string& name, bool isVirtual);
+	void dispatch(const port_table_t& table, xymsg::msg_t&& msg);
+	void toPort(const port_table_t& table, uint8_t port, const xymsg::msg_t& msg);
+	void receive(in_port_t& in, double deltaTime, const std::vector<unsigned char>& imsg);
+	void receiveSysx(in_port_t& in, const uint8_t* data, std::size_t len, std::chrono::steady_clock::time_point t);
+	static std::chrono::steady_clock::time_point arrivalTime(in_port_t& in, double deltaTime);
 private:
-	std::atomic<bool> isRunning;
+	std::atomic<bool> isRunning{ false };
 	std::thread myThread;
+	std::thread monitorThread;	//!< looks for ports coming and going
+	std::mutex monitorMutex;
+	std::condition_variable monitorWake;
+
+	midi_config_t config;
+	std::unique_ptr<RtMidiIn> inProbe;	//!< for listing the ports. only the monitor uses these, once we're running
+	std::unique_ptr<RtMidiOut> outProbe;
+#ifdef ALSA_MIDI
+	std::unique_ptr<AlsaSeq> alsaSeq;	//!< when we use the alsa sequencer instead of rtmidi
+#endif
+	std::map<std::string, uint8_t> inNumbers;	//!< the number each port we've seen has, so a device plugged back in gets its old one
+	std::map<std::string, uint8_t> outNumbers;
+	std::shared_ptr<const port_table_t> ports;	//!< only ever read or written with atomic_load() and atomic_store()
+	std::atomic<uint64_t> unknownPort{ 0 };	//!< messages for an output port we don't have
 
-	std::unique_ptr<RtMidiIn> midiIn;
-	std::unique_ptr<RtMidiOut> midiOut;
-	
-	std::vector<std::string> midiInPorts;
-	std::vector<std::string> midiOutPorts;
-	
-	xymsg::q_t& spiInQ;
-	xymsg::q_t& oscInQ;
+	xymsg::Router& router;
 	xymsg::q_t& midiOutQ;
-};
\ No newline at end of file
+};
@@ -8,6 +8,7 @@
 #include <oscpp/client.hpp>
 #include <oscpp/print.hpp>
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 
@@ -30,13 +31,69 @@ using regex = boost::regex;
 using midi_cmd = xymidi::cmd;
 
 namespace oscapi {
-	regex osc_re("/(?<MDI>midi(?<PRT>[0-9])?)");
+	constexpr uint64_t ntpUnixOffset = 2208988800ull; // seconds from 1900 to 1970
+
+	/*!
+	 * our clock's time for an osc timetag: ntp seconds since 1900 in the top 32 bits, and the fraction of a second in the bottom.
+	 * 1 means now, which we give as the epoch, as for a message with no time
+	 */
+	std::chrono::steady_clock::time_point fromTimetag(uint64_t timetag)
+	{
+		if (timetag <= 1) return {};
+		const auto since1970 = std::chrono::seconds((timetag >> 32) - ntpUnixOffset)
+			+ std::chrono::nanoseconds(((timetag & 0xffffffff) * 1000000000ull) >> 32);
+		const auto at = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(since1970));
+		return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(at - std::chrono::system_clock::now());
+	}
+
+	/*!
+	 * the osc timetag for a time by our clock
+	 */
+	uint64_t toTimetag(std::chrono::steady_clock::time_point at)
+	{
+		const auto since1970 = std::chrono::duration_cast<std::chrono::nanoseconds>((std::chrono::system_clock::now()
+			+ std::chrono::duration_cast<std::chrono::system_clock::duration>(at - std::chrono::steady_clock::now())).time_since_epoch());
+		const auto secs = std::chrono::duration_cast<std::chrono::seconds>(since1970);
+		const auto frac = static_cast<uint64_t>((since1970 - secs).count());
+		return (static_cast<uint64_t>(secs.count()) + ntpUnixOffset) << 32 | ((frac << 32) / 1000000000ull);
+	}
+
+	regex osc_re("/(?:(?<MDI>midi(?<PRT>[0-9]{1,3})?)|(?<SYX>sysx(?<SPRT>[0-9]{1,3})?)|(?<STA>state))");
+
+	/*!
+	 * the port from a path's suffix, or 0 if it hasn't one
+	 *  \return false if it's no port we could have. allPorts is a path with no suffix
+	 */
+	bool portOf(const boost::csub_match& suffix, uint8_t& port)
+	{
+		const auto n = suffix.matched ? std::stoul(suffix.str()) : 0;
+		if (n >= xymidi::allPorts) return false;
+		port = static_cast<uint8_t>(n);
+		return true;
+	}
+
+	/*!
+	 * the path midi for a port goes out on
+	 */
+	std::string midiPath(uint8_t port)
+	{
+		std::string base("/midi");
+		if (port > 0 && port != xymidi::allPorts) {
+			base += std::to_string(port);
+		}
+		return base;
+	}
+
+	/*!
+	 * how much an osc string takes, with its terminator and the padding to 4 bytes
+	 */
+	constexpr std::size_t padded(std::size_t len) { return (len + 4) & ~std::size_t(3); }
 
 	/*!
 	 * \class oscapi::Parser
 	 * main unit handling translation to and from packed OSC data and internal structures for MIDI and other items of interest
 	 */
-	Processor::Processor(xymsg::q_t& _outq) : outq(_outq) {}
+	Processor::Processor(xymsg::Router& _router) : router(_router) {}
 
 	/*!
 	 * main wrapper decoding an OSC encoded buffer
@@ -48,31 +105,39 @@ namespace oscapi {
 	}
 
 	/*!
-	 * pack one of our recognized midi/whatever messages as OSC
+	 * pack one of our recognized midi/whatever messages as OSC. one with a send time goes in a bundle with it as the timetag, so the
+	 * client can play it on time
+	 *  \return false if it isn't one we have a path for, or doesn't fit
 	 */
-	bool Processor::pack(uint8_t* buffer, std::size_t& size, const std::shared_ptr<xymsg::msg_t> msg)
+	bool Processor::pack(uint8_t* buffer, std::size_t& size, const xymsg::msg_t& msg)
 	{
+		const auto mcp = std::get_if<xymsg::MidiMsg>(&msg.body);
+		const auto scp = std::get_if<xymsg::SysxMsg>(&msg.body);
+		if (!mcp && !scp) {
+			debug("Processor::pack has no path for {}", xymsg::typNames[static_cast<std::size_t>(xymsg::typeOf(msg))]);
+			return false;
+		}
+		if (scp && (*scp)->truncated) {
+			// blobs already sent can't be taken back, but leaving off the end means a client never takes the sysex as whole
+			debug("Processor::pack dropping the end of a sysex that was cut short");
+			return false;
+		}
 		try {
-			if (msg->type == xymsg::typ::midi) {
-				auto mcp = std::static_pointer_cast<xymsg::MidiMsg>(msg);
-				if (!mcp) {
-					return false;
-				}
-				OSCPP::Client::Packet packet(buffer, size);
-				/*
-				packet       // Open a bundle with a timetag
-					.openBundle(1234ULL)
-				*/
-				std::string base("/midi");
-				if (mcp->midi.port > 0) {
-					base += ('0' + mcp->midi.port);
+			OSCPP::Client::Packet packet(buffer, size);
+			if (msg.hasDue()) packet.openBundle(toTimetag(msg.due()));
+			if (mcp) {
+				packet.openMessage(midiPath(mcp->midi.port).c_str(), 1).midi({mcp->midi.cmd, mcp->midi.val1, mcp->midi.val2, mcp->midi.port}).closeMessage();
+			} else {
+				// each chunk goes as a blob of its own. the first starts with the 0xf0 and the last ends with the 0xf7
+				const auto& chunk = **scp;
+				std::string base("/sysx");
+				if (chunk.port > 0) {
+					base += std::to_string(chunk.port);
 				}
-				packet.openMessage(base.c_str(), 1).midi({mcp->midi.cmd, mcp->midi.val1, mcp->midi.val2, mcp->midi.port}).closeMessage();
-				/*
-				packet.closeBundle();
-				*/
-				size = packet.size();
+				packet.openMessage(base.c_str(), 1).blob(OSCPP::Blob(chunk.begin(), chunk.len)).closeMessage();
 			}
+			if (msg.hasDue()) packet.closeBundle();
+			size = packet.size();
 		} catch (const std::exception& e) {
 			debug("Processor::pack throws {}", e.what());
 			return false;
@@ -80,6 +145,35 @@ namespace oscapi {
 		return true;
 	}
 
+	/*!
+	 * pack as many of msgs as fit, from 'from' on, as one bundle to be acted on straight away. only midi has a path, so anything
+	 * else is passed over
+	 *  \return where the next bundle starts: msgs.size() once all of them are packed, or 'from' if not even one fits
+	 */
+	std::size_t Processor::pack(uint8_t* buffer, std::size_t& size, const std::vector<xymsg::msg_t>& msgs, std::size_t from)
+	{
+		constexpr std::size_t bundleHead = 16;	// "#bundle" and the timetag
+		std::size_t n = from;
+		try {
+			OSCPP::Client::Packet packet(buffer, size);
+			packet.openBundle(1);
+			for (std::size_t need = bundleHead; n < msgs.size(); ++n) {
+				const auto mcp = std::get_if<xymsg::MidiMsg>(&msgs[n].body);
+				if (!mcp) continue;
+				const auto path = midiPath(mcp->midi.port);
+				need += 4 + padded(path.size()) + 4 + 4;	// the element's size, its path, the ",m" type tag and the midi
+				if (need > size) break;
+				packet.openMessage(path.c_str(), 1).midi({mcp->midi.cmd, mcp->midi.val1, mcp->midi.val2, mcp->midi.port}).closeMessage();
+			}
+			packet.closeBundle();
+			size = packet.size();
+		} catch (const std::exception& e) {
+			debug("Processor::pack throws {}", e.what());
+			return from;
+		}
+		return n;
+	}
+
 	/*!
 	 * pack an arbitrary message with a path and possible int params as OSC
 	 */
@@ -107,7 +201,10 @@ namespace oscapi {
 		//	m_workq.foreach([](const std::shared_ptr<oscapi::work_t>& v) { debug("> work id {}", v->id); });
 	}
 
-	void Processor::handlePacket(OSCPP::Server::Packet & packet)
+	/*!
+	 * route the messages in a packet. a bundle's messages are due at its timetag, unless it is inside another bundle with a later one
+	 */
+	void Processor::handlePacket(OSCPP::Server::Packet & packet, std::chrono::steady_clock::time_point due)
 	{
 		if (packet.isBundle()) {
 			// Convert to a PacketStream, iterate over all packets, and call handlePacket recursively.
@@ -115,8 +212,9 @@ namespace oscapi {
 			OSCPP::Server::Bundle bundle(packet);
 			OSCPP::Server::PacketStream packets(bundle.packets());
 			debug("bundle {}", bundle.time());
+			const auto bundleDue = std::max(due, fromTimetag(bundle.time()));
 			while (!packets.atEnd()) {
-				handlePacket(packets.next());
+				handlePacket(packets.next(), bundleDue);
 			}
 		} else {
 			// Convert to message, stream arguments
@@ -126,14 +224,44 @@ namespace oscapi {
 			if (boost::regex_match(msg.address(), results, osc_re, boost::match_extra)) {
 				if (results["MDI"].matched) {
 					debug("matches and recognises midi path '{}', cmd '{}'", results["MDI"].str(), results["CMD"].str());
-					uint8_t port = results["PRT"].matched ? results["PRT"].str()[0] - '0' : 0;
+					uint8_t port = 0;
+					if (!portOf(results["PRT"], port)) {
+						debug("no port {}", results["PRT"].str());
+						return;
+					}
 					try {
 						const auto m = args.midi();
-						xymidi::msg mbuf(m.status, m.data1, m.data2, m.port);
+						xymsg::MidiMsg mmsg;
+						mmsg.midi = xymidi::msg(m.status, m.data1, m.data2, results["PRT"].matched ? port : m.port);
+						xymsg::msg_t msg(mmsg);
+						if (due != std::chrono::steady_clock::time_point{}) msg.setDue(due);
+						router.route(xymsg::source::osc, std::move(msg));
 					}
 					catch (const OSCPP::Error &e) {
 						debug("Oscpp error processing {}: {}", results["CMD"].str(), e.what());
 					}
+				} else if (results["SYX"].matched) {
+					// a blob starting with 0xf0 starts a sysex, and one ending with 0xf7 ends it. anything else carries on the last one
+					uint8_t port = 0;
+					if (!portOf(results["SPRT"], port)) {
+						debug("no port {}", results["SPRT"].str());
+						return;
+					}
+					try {
+						const auto b = args.blob();
+						const auto data = static_cast<const uint8_t*>(b.data);
+						if (b.size == 0) return;
+						auto emit = [this](xymsg::msg_t&& msg) { router.route(xymsg::source::osc, std::move(msg)); };
+						if (data[0] == (uint8_t)midi_cmd::sysxStart) sysxIn.start(port, emit);
+						sysxIn.append(data, b.size, emit);
+						if (data[b.size - 1] == (uint8_t)midi_cmd::sysxEnd) sysxIn.finish(emit);
+					}
+					catch (const OSCPP::Error &e) {
+						debug("Oscpp error processing sysex: {}", e.what());
+					}
+				} else if (results["STA"].matched) {
+					debug("state requested");
+					if (onStateRequest) onStateRequest();
 				}
 			}
 		}
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <string>
 
 #include "message.h"
+#include "router.h"
 
 namespace OSCPP { namespace Server { class Packet; } };
 
@@ -11,21 +14,29 @@ namespace oscapi {
 	/*!
 	 * \brief main OSC processor, parses buffers of incoming OSC message to the internal msg structureand handles formatting of out message
 	 * queue structure into OSC, ready for broadcast on the OSC socket
-	 * the incoming message are sent to queues them ready to be directed to a local midi connection or SPI connect, 
+	 * the incoming messages go to the router, which queues them ready to be directed to a local midi connection or SPI connect
 	 */
 	class Processor
 	{
 	public:
-		Processor(xymsg::q_t& _outq);
+		Processor(xymsg::Router& _router);
 
 		void parse(uint8_t *data, std::size_t size);
-		bool pack(uint8_t *data, std::size_t &size, const std::shared_ptr<xymsg::msg_t> _msg);
+		bool pack(uint8_t *data, std::size_t &size, const xymsg::msg_t& _msg);
 		bool pack(uint8_t *data, std::size_t &size, const std::string& path, const std::vector<int> & params = {});
+		std::size_t pack(uint8_t *data, std::size_t &size, const std::vector<xymsg::msg_t>& msgs, std::size_t from);
 		void debugDump();
 
+		/*!
+		 * what to do when a client asks for the state with '/state': send it everything it needs to catch up
+		 */
+		void setStateRequest(std::function<void()> f) { onStateRequest = std::move(f); }
+
 	private:
-		void handlePacket(OSCPP::Server::Packet &packet);
+		void handlePacket(OSCPP::Server::Packet &packet, std::chrono::steady_clock::time_point due = {});
 
-		xymsg::q_t& outq;
+		xymsg::Router& router;
+		xymsg::sysx_builder sysxIn;	//!< sysex arriving over osc, in one or more blobs
+		std::function<void()> onStateRequest;
 	};
 };
@@ -1,11 +1,14 @@
 #include "osc_server.h"
 #include "osc_handler.h"
+#include "router.h"
 
 // hack to avoid a warning about deprecated boost headers included by boost. seriously.
 #include <boost/core/scoped_enum.hpp>
 #define BOOST_DETAIL_SCOPED_ENUM_EMULATION_HPP
 #include <boost/bind/bind.hpp>
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/placeholders.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/ip/multicast.hpp>
 #include <spdlog/spdlog.h>
 #include <memory>
@@ -28,6 +31,7 @@ using udp = boost::asio::ip::udp;
 
 OSCServer::OSCServer(asio::io_service& _ioService, uint16_t port, std::shared_ptr<oscapi::Processor> _handler)
 	: socket(_ioService, udp::endpoint(udp::v4(), port)),
+	  strand(asio::make_strand(_ioService)),
 	  sigWaiter(_ioService, SIGINT, SIGTERM),
 	  ioService(_ioService),
 	  handler(_handler)
@@ -46,7 +50,7 @@ void OSCServer::start()
 	start_receive();
 	sigWaiter.async_wait([this](boost::system::error_code, int sig) {
 		info("OSCServer::async_wait() SIGTERM received");
-		ioService.post([this]() { socket.cancel(); });
+		asio::post(strand, [this]() { socket.cancel(); });
 	});
 
 }
@@ -81,7 +85,7 @@ void OSCServer::start_receive() {
 	socket.async_receive_from(
 		boost::asio::buffer(*inBuf),
 		*srcEndpoint,
-		boost::bind(&OSCServer::recv_handler, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, inBuf, srcEndpoint)
+		asio::bind_executor(strand, boost::bind(&OSCServer::recv_handler, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, inBuf, srcEndpoint))
 	);
 }
 
@@ -97,7 +101,7 @@ void OSCServer::send_handler(boost::system::error_code ec, std::size_t bytes_sen
  * TODO:
  *	- possibly shift the buffer type to a vector so we can be a bit more flexible. but 1024 as here should be adequate in almost any sane case.
  */
-void OSCServer::send_message(const std::shared_ptr<xymsg::msg_t> msg) {
+void OSCServer::send_message(const xymsg::msg_t& msg) {
 	auto outBuf = std::make_shared<buf_t>();
 	auto dstEndpoint = std::make_shared<udp::endpoint>(currentDestination);
 	std::size_t outBufLen = outBuf->size();
@@ -107,6 +111,7 @@ void OSCServer::send_message(const std::shared_ptr<xymsg::msg_t> msg) {
 			*dstEndpoint,
 			boost::bind(&OSCServer::send_handler, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, outBuf, dstEndpoint)
 		);
+		xymsg::latency().record(msg, xymsg::sink::osc);
 	}
 }
 
@@ -128,6 +133,30 @@ void OSCServer::send_message(const std::string & path, const std::vector<int> &
 	}
 }
 
+/*!
+ * send a lot of messages at once, straight on the socket in as few bundles as they fit in, rather than one by one through a queue.
+ * for catching a client up, where there's too much to go through the bounded lanes without being dropped
+ */
+void OSCServer::send_messages(const std::vector<xymsg::msg_t>& msgs)
+{
+	for (std::size_t from = 0; from < msgs.size();) {
+		auto outBuf = std::make_shared<buf_t>();
+		auto dstEndpoint = std::make_shared<udp::endpoint>(currentDestination);
+		std::size_t outBufLen = outBuf->size();
+		const auto next = handler->pack(outBuf->data(), outBufLen, msgs, from);
+		if (next == from) {
+			warn("OSCServer::send_messages can't pack message {} of {}, dropping the rest", from, msgs.size());
+			return;
+		}
+		socket.async_send_to(
+			boost::asio::buffer(*outBuf, outBufLen),
+			*dstEndpoint,
+			boost::bind(&OSCServer::send_handler, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, outBuf, dstEndpoint)
+		);
+		from = next;
+	}
+}
+
 /*!
  * make our current target(s).
  * todo: in the bigger picture needs to be threadsafe
@@ -6,6 +6,7 @@
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/strand.hpp>
 
 #include "message.h"
 
@@ -15,7 +16,8 @@ namespace oscapi {
 using udp = boost::asio::ip::udp;
 
 /*!
- * manage the osc socket threads and connections
+ * manage the osc socket threads and connections. everything that touches the socket runs on our strand, so call send_message()
+ * from a handler on get_strand().
  */
 class OSCServer
 {
@@ -23,10 +25,14 @@ public:
 	OSCServer(boost::asio::io_service& _ioService, uint16_t port, std::shared_ptr<oscapi::Processor> _handler);
 
 	void start();
-	void send_message(const std::shared_ptr<xymsg::msg_t> msg);
+	void send_message(const xymsg::msg_t& msg);
 	void send_message(const std::string& path, const std::vector<int> & params = {});
+	void send_messages(const std::vector<xymsg::msg_t>& msgs);
 	boost::system::error_code set_current_destination(std::string ip_address, uint16_t port_num);
 
+	using strand_t = boost::asio::strand<boost::asio::io_context::executor_type>;
+	const strand_t& get_strand() const { return strand; }
+
 	static const int kBufSize = 1024;
 	using buf_t = std::array<uint8_t, kBufSize>;
 private:
@@ -35,6 +41,7 @@ private:
 	void send_handler(boost::system::error_code ec, std::size_t bytes_recvd, std::shared_ptr<buf_t> buf, std::shared_ptr<udp::endpoint> endp);
 
 	udp::socket socket;
+	strand_t strand;
 	udp::endpoint currentDestination;
 	boost::asio::signal_set sigWaiter;
 	boost::asio::io_service& ioService;
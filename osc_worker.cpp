@@ -2,9 +2,7 @@
 
 #include <spdlog/spdlog.h>
 
-#include <chrono>
-
-using namespace std::chrono_literals;
+#include <boost/asio/post.hpp>
 
 using spdlog::info;
 using spdlog::error;
@@ -13,65 +11,78 @@ using spdlog::warn;
 
 /*!
  * \class OSCWorker
- *   the bit that does stuff. we run in our own thread, outside of the asio threadpool. we are basically scanning our messsage queue
- * and broadcasting anything appropriate to the OSC socket. Presumably this queue is added to be either from the duino via the spi input, or by any locally
- * connected midi ports
+ *   the bit that does stuff. we don't have a thread of our own: we run as a handler on the osc server's strand, in the asio threadpool,
+ * so sends go straight to the socket without a thread hop, and the socket is only ever touched from the one strand. we are basically
+ * draining our messsage queue and broadcasting anything appropriate to the OSC socket. the queue wakes us through an AsioWaker
+ * when something is pushed after we've run dry. Presumably this queue is added to be either from the duino via the spi input,
+ * or by any locally connected midi ports
  *  TODO:
  * - some commonality with the ws/json api worker
  */
 
-OSCWorker::OSCWorker(OSCServer &_oscurver, xymsg::q_t& _msgq)
-	: oscurver(_oscurver), msgq(_msgq)
-{}
+namespace {
+	constexpr int maxRounds = 4; //!< batches we send before yielding the strand to the socket's other handlers
+}
+
+OSCWorker::OSCWorker(asio::io_service& ioService, OSCServer &_oscurver, xymsg::q_t& _msgq)
+	: oscurver(_oscurver), msgq(_msgq), waker(ioService, _oscurver.get_strand()), sigWaiter(ioService, SIGINT, SIGTERM)
+{
+	batch.reserve(xymsg::maxBatch);
+}
 
 OSCWorker::~OSCWorker() { stop(); }
 
 /*!
- * launch the OSCWorker and return immediately. we check that the dongle is open here, and if we have enough permission,
- * we list whatever files we find.
+ * hook the queue up to the io context and return immediately. the queue's drain never blocks: we ask it to notify us instead.
  */
 void OSCWorker::run()
 {
 	if (!isRunning.exchange(true)) {
-		debug("OSCWorker::run() launching main thread");
-		myThread = std::thread([this]() { runner(); });
+		debug("OSCWorker::run() attaching to the io context");
+		msgq.disableWait();
+		msgq.setNotify([this]() { waker.notify(); });
+		msgq.enable();
+		waker.start([this]() { onReady(); });
+		asio::post(oscurver.get_strand(), [this]() { onReady(); });
+		sigWaiter.async_wait([this](boost::system::error_code ec, int) {
+			if (!ec) stop();
+		});
 	}
 }
 
 /*!
- * stop the worker thread and wait until it completes. then clean up the dongle
+ * stop taking messages, and let go of the io context
  */
 void OSCWorker::stop()
 {
 	if (isRunning.exchange(false)) {
-		msgq.disableWait();
 		msgq.enable(false);
-		if (myThread.joinable()) myThread.join();
+		msgq.disarm();
+		waker.stop();
+		boost::system::error_code ec;
+		sigWaiter.cancel(ec);
 	}
 }
 
 /*!
- * main body of the work queue processor
+ * main body of the work queue processor. runs on the strand whenever the queue has data for us
  */
-void OSCWorker::runner()
+void OSCWorker::onReady()
 {
-	msgq.enable();
-	msgq.enableWait();
-	while (isRunning) {
-		// TODO: perhaps the whole current queue could be bundled
-		auto optMsg = msgq.front();
-		if (optMsg.second) {
-			// specifically make a new reference to the shared_ptr to work with, so we can leave the work at the top of q
-			// workRef should still be valid even if it is no longer front
-			auto& msg = optMsg.first;
+	for (int round = 0; isRunning && round < maxRounds; ++round) {
+		// TODO: perhaps the whole current batch could be bundled
+		if (msgq.drain(batch, xymsg::maxBatch) == 0) break;
+		for (const auto& msg : batch) {
 			try {
 				oscurver.send_message(msg);
 			} catch (const std::exception& e) {
 				error("OSCWorker() gets exception: {}", e.what());
 			}
-			msgq.remove(optMsg.first); // now it's safe to remove!
-		} else {
-			if (isRunning && !msgq.waitEnabled()) std::this_thread::sleep_for(10us);
 		}
+		batch.clear(); // drop our references now, rather than holding them until the next batch
+	}
+	// either there's nothing left and the next push notifies us, or there's more now and we go round again after the socket's had a turn
+	if (isRunning && msgq.arm()) {
+		asio::post(oscurver.get_strand(), [this]() { onReady(); });
 	}
 }
@@ -1,27 +1,32 @@
 #pragma once
 
+#include "asio_waker.h"
 #include "message.h"
 #include "osc_server.h"
 
 #include <atomic>
-#include <thread>
+#include <vector>
+
+#include <boost/asio/signal_set.hpp>
 
 class OSCWorker
 {
 public:
-	OSCWorker(OSCServer &_oscurver, xymsg::q_t& msgq);
+	OSCWorker(asio::io_service& ioService, OSCServer &_oscurver, xymsg::q_t& msgq);
 	~OSCWorker();
 
 	void run();
 	void stop();
 
 private:
-	void runner();
+	void onReady();
 
 private:
-	std::atomic<bool> isRunning;
-	std::thread myThread;
+	std::atomic<bool> isRunning{ false };
 
 	OSCServer &oscurver;
 	xymsg::q_t& msgq;
+	AsioWaker waker;
+	asio::signal_set sigWaiter;
+	std::vector<xymsg::msg_t> batch;
 };
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <iostream>
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cstring>
 #include <spdlog/spdlog.h>
 
 using namespace std::chrono_literals;
@@ -10,34 +12,151 @@ using spdlog::error;
 using spdlog::debug;
 using spdlog::warn;
 
-#include <wiringPiSPI.h>
-
 #include "pi_spi.h"
-#include "xypiduino/include/xyspi.h"
+#include "router.h"
 
 
-constexpr int SPIchannel = 0;
-constexpr int SPIclockSpeed = 1000000;
+constexpr auto pingInterval = 10ms; //!< how long we wait for something to send before we ping the duino anyway
 
-PiSpi::PiSpi(xymsg::q_t& _inQ, xymsg::q_t& _outQ)
-	: inQ(_inQ), outQ(_outQ), isSpiOpen(false), isRunning(false)
+/*!
+ * pack a message on the end of the frame
+ *  \return false if it doesn't fit, leaving the frame as it was
+ */
+bool spi_frame_t::add(const xymsg::msg_t& msg)
 {
-	// For the SPI clock speed we use 1 MHz. With WiringPi and Raspberry Pi you can choose a clock speed between 500 kHz and 32 MHz.
-	// different SPI modes: 0, 1, 2 and 3 –Here we are using mode 0, which is the default mode on Arduino.
-	int fd = wiringPiSPISetupMode(SPIchannel, SPIclockSpeed, 0);
-	if (fd >= 0) {
-		isSpiOpen = true;
-	} else {
-		std::cerr << "Failed to init SPI communication.\n";	
+	switch (xymsg::typeOf(msg)) {
+		case xymsg::typ::midi:
+			return addMidi(std::get<xymsg::MidiMsg>(msg.body).midi);
+		case xymsg::typ::midi_list: {
+			const auto oldLen = len;
+			const auto oldMidiAt = midiAt;
+			const auto oldRun = oldMidiAt != npos ? buf[oldMidiAt] : 0;
+			for (const auto &m: *std::get<xymsg::MidiListMsg>(msg.body)) {
+				if (!addMidi(m)) {
+					len = oldLen;
+					midiAt = oldMidiAt;
+					if (midiAt != npos) buf[midiAt] = oldRun;
+					return false;
+				}
+			}
+			return true;
+		}
+		case xymsg::typ::config_button: {
+			const auto &mmsg = *std::get<xymsg::ConfigButtonMsg>(msg.body);
+			return addConfig(xyspi::cmd_t::cfg_button, mmsg.which, &mmsg.cfg, sizeof(config::button));
+		}
+		case xymsg::typ::config_pedal: {
+			const auto &mmsg = *std::get<xymsg::ConfigPedalMsg>(msg.body);
+			return addConfig(xyspi::cmd_t::cfg_pedal, mmsg.which, &mmsg.cfg, sizeof(config::pedal));
+		}
+		case xymsg::typ::config_xlrm8r: {
+			const auto &mmsg = *std::get<xymsg::ConfigXlm8rMsg>(msg.body);
+			return addConfig(xyspi::cmd_t::cfg_xlrm8, mmsg.which, &mmsg.cfg, sizeof(config::xlrm8r));
+		}
+		case xymsg::typ::tempo: {
+			const float tempo = std::get<xymsg::TempoMsg>(msg.body).tempo;
+			if (room() < 1 + sizeof(tempo)) return false;
+			buf[len] = xyspi::cmd_t::tempo;
+			std::memcpy(&buf[len + 1], &tempo, sizeof(tempo));
+			len += 1 + sizeof(tempo);
+			break;
+		}
+		case xymsg::typ::duino_cmd:
+			if (room() < 1) return false;
+			buf[len++] = std::get<xymsg::CmdMsg>(msg.body).cmd;
+			break;
+		case xymsg::typ::none:
+		default:
+			if (room() < 1) return false;
+			buf[len++] = xyspi::cmd_t::null;
+			break;
 	}
+	midiAt = npos;
+	return true;
+}
+
+/*!
+ * a midi message goes on the end of the run of midi the frame ends with, if there is one with room, or starts a new run
+ */
+bool spi_frame_t::addMidi(const xymidi::msg& m)
+{
+	if (midiAt == npos || (buf[midiAt] & 0x7f) >= maxMidiRun) {
+		if (room() < 4) return false;
+		midiAt = len;
+		buf[len++] = xyspi::cmd_t::midi;
+	} else if (room() < 3) {
+		return false;
+	}
+	++buf[midiAt];
+	buf[len++] = m.cmd;
+	buf[len++] = m.val1;
+	buf[len++] = m.val2;
+	return true;
+}
+
+bool spi_frame_t::addConfig(uint8_t cmd, uint8_t which, const void* cfg, std::size_t cfgLen)
+{
+	if (room() < cfgLen + 3) return false;
+	buf[len] = cmd;
+	buf[len + 1] = which;
+	buf[len + 2] = static_cast<uint8_t>(cfgLen);
+	std::memcpy(&buf[len + 3], cfg, cfgLen);
+	len += cfgLen + 3;
+	midiAt = npos;
+	return true;
+}
+
+/*!
+ * as much of a sysex chunk as fits, from pos, as a sysex frame
+ *  \return how many of its bytes went in
+ */
+std::size_t spi_frame_t::addSysx(const xymsg::SysxChunk& chunk, std::size_t pos)
+{
+	if (room() < 3) return 0;
+	const auto n = std::min({ sysxFrameLen, room() - 2, chunk.len - pos });
+	buf[len] = spiSysx;
+	buf[len + 1] = static_cast<uint8_t>(n)
+		| (chunk.first && pos == 0 ? sysxFirst : 0)
+		| (chunk.last && pos + n == chunk.len ? sysxLast : 0);
+	std::memcpy(&buf[len + 2], chunk.begin() + pos, n);
+	len += n + 2;
+	midiAt = npos;
+	return n;
+}
+
+/*!
+ * fill the frame out to n bytes with nulls, which the duino skips, to read more of what it has to send back
+ */
+void spi_frame_t::pad(std::size_t n)
+{
+	n = std::min(n, buf.size());
+	if (n > len) std::fill(buf.begin() + len, buf.begin() + n, xyspi::cmd_t::null);
+	len = std::max(len, n);
+	midiAt = npos;
+}
+
+/*!
+ * \class PiSpi
+ * frames are at least xyspi::maxCmdLen, so any one message fits. a larger frame only works with a duino built to take it
+ */
+PiSpi::PiSpi(xymsg::q_t& _inQ, xymsg::Router& _router, std::unique_ptr<SpiTransport> _transport, std::size_t _frameLen)
+	: isRunning(false), frameLen(std::max(_frameLen, xyspi::maxCmdLen)), inQ(_inQ), router(_router), transport(std::move(_transport))
+{
+	sysxOut.reserve(xymsg::poolSize<xymsg::SysxChunk>);
+}
+
+PiSpi::~PiSpi()
+{
+	stop();
 }
 
 bool PiSpi::start() {
-	if (!isSpiOpen) {
+	if (!transport) {
 		return false;
 	}
 	if (!isRunning.exchange(true)) {
-		spiThread = std::thread(spiRunner, this);
+		info("PiSpi talking to the duino over {}", transport->name());
+		spiThread = std::thread([this]() { spiRunner(); });
 	}
 	return isRunning;
 }
@@ -54,175 +173,224 @@ void PiSpi::stop()
 	}
 }
 
+PiSpi::counters_t PiSpi::counters() const
+{
+	counters_t c;
+	c.transfers = transfers.load(std::memory_order_relaxed);
+	c.bytes = bytes.load(std::memory_order_relaxed);
+	c.sent = sent.load(std::memory_order_relaxed);
+	c.carried = carried.load(std::memory_order_relaxed);
+	c.received = received.load(std::memory_order_relaxed);
+	c.pongs = pongs.load(std::memory_order_relaxed);
+	return c;
+}
 
-void PiSpi::spiRunner()
+/*!
+ * pass on something from the duino
+ */
+void PiSpi::emit(xymsg::msg_t&& msg)
 {
-	std::array<uint8_t, xyspi::maxCmdLen> buf;
-
-	static auto processNextSpiByte = [this] (const uint8_t bytIn) -> bool {
-		switch (spi_in_state) {
-			case command_byte:
-				if (bytIn & xyspi::midi) {
-					spi_in_state = midi_data;
-					n_midi_cmd_incoming = bytIn & 0x7f;
-				} else {
-					switch (bytIn) {
-						case xyspi::null:
-							break;
-						case xyspi::pong:
-							return true;
-						case xyspi::ping:
-							break;
-						case xyspi::send_tempo:
-							tempo_requested = true;
-							break;
-						case xyspi::tempo:
-							spi_in_state = tempo_data;
-							set_tempo = false;
-							break;
-						case xyspi::diag_message:
-							break;
-					}			
-				}
-				break;
-			case midi_data:
-				cmd_in = bytIn;
-				spi_in_state = midi_data_1;
-				break;
-			case midi_data_1:
-				val1_in = bytIn;
-				spi_in_state = midi_data_2;
-				break;
-			case midi_data_2:
-				val2_in = bytIn;
-				if (!deviceMidiOut.addToBuf(cmd_in, val1_in, val2_in)) {
-					dropped_midi_in = true;
-				}
-				spi_in_state = (--n_midi_cmd_incoming > 0)? midi_data: command_byte;
-				break;
-			case tempo_data:
-				spi_in_state = tempo_data_1;
-				((uint8_t*)&incoming_tempo)[0] = bytIn;
-				break;
-			case tempo_data_1:
-				spi_in_state = tempo_data_2;
-				((uint8_t*)&incoming_tempo)[1] = bytIn;
-				break;
-			case tempo_data_2:
-				spi_in_state = tempo_data_3;
-				((uint8_t*)&incoming_tempo)[2] = bytIn;
-				break;
-			case tempo_data_3:
+	received.fetch_add(1, std::memory_order_relaxed);
+	router.route(xymsg::source::spi, std::move(msg));
+}
+
+/*!
+ * hold on to a chunk of sysex for the duino. a sysex only goes once we have its last chunk, so one that lost a chunk on the way, or
+ * was cut short, can be dropped whole instead of reaching the duino in pieces
+ */
+void PiSpi::takeSysx(xymsg::msg_t&& msg)
+{
+	const auto& chunk = *std::get<xymsg::SysxMsg>(msg.body);
+	const bool unfinished = sysxOut.size() > sysxReady;
+	if (chunk.first && unfinished) sysxOut.erase(sysxOut.begin() + sysxReady, sysxOut.end());
+	if (!sysxCheck.next(chunk)) {
+		if (unfinished || chunk.first) warn("PiSpi dropping a sysex that lost a chunk or was cut short");
+		sysxOut.erase(sysxOut.begin() + sysxReady, sysxOut.end());
+		return;
+	}
+	const bool last = chunk.last;
+	sysxOut.push_back(std::move(msg));
+	if (last) sysxReady = sysxOut.size();
+}
+
+/*!
+ * take the next byte the duino sent us
+ *  \return true if it was a pong
+ */
+bool PiSpi::processNextSpiByte(const uint8_t bytIn)
+{
+	const auto emitSysx = [this](xymsg::msg_t&& msg) { emit(std::move(msg)); };
+	switch (spi_in_state) {
+		case command_byte:
+			if (bytIn & xyspi::midi) {
+				n_midi_cmd_incoming = bytIn & 0x7f;
+				if (n_midi_cmd_incoming > 0) spi_in_state = midi_data;
+			} else {
+				switch (bytIn) {
+					case xyspi::null:
+						break;
+					case xyspi::pong:
+						pongs.fetch_add(1, std::memory_order_relaxed);
+						return true;
+					case xyspi::ping:
+						break;
+					case xyspi::send_tempo:
+						tempo_requested = true;
+						debug("PiSpi: the duino asks for the tempo");
+						break;
+					case xyspi::tempo:
+						spi_in_state = tempo_data;
+						set_tempo = false;
+						break;
+					case xyspi::diag_message:
+						break;
+					case spiSysx:
+						spi_in_state = sysx_header;
+						break;
+				}			
+			}
+			break;
+		case midi_data:
+			cmd_in = bytIn;
+			spi_in_state = midi_data_1;
+			break;
+		case midi_data_1:
+			val1_in = bytIn;
+			spi_in_state = midi_data_2;
+			break;
+		case midi_data_2:
+			val2_in = bytIn;
+			emit(xymsg::MidiMsg{ xymidi::msg(cmd_in, val1_in, val2_in) });
+			spi_in_state = (--n_midi_cmd_incoming > 0)? midi_data: command_byte;
+			break;
+		case tempo_data:
+			spi_in_state = tempo_data_1;
+			((uint8_t*)&incoming_tempo)[0] = bytIn;
+			break;
+		case tempo_data_1:
+			spi_in_state = tempo_data_2;
+			((uint8_t*)&incoming_tempo)[1] = bytIn;
+			break;
+		case tempo_data_2:
+			spi_in_state = tempo_data_3;
+			((uint8_t*)&incoming_tempo)[2] = bytIn;
+			break;
+		case tempo_data_3:
+			spi_in_state = command_byte;
+			((uint8_t*)&incoming_tempo)[3] = bytIn;
+			set_tempo = true;
+			emit(xymsg::TempoMsg(incoming_tempo));
+			break;
+		case sysx_header:
+			sysx_in_flags = bytIn;
+			n_sysx_incoming = bytIn & sysxLenMask;
+			if (sysx_in_flags & sysxFirst) sysxIn.start(0, emitSysx);
+			if (n_sysx_incoming > 0) {
+				spi_in_state = sysx_data;
+			} else {
+				if (sysx_in_flags & sysxLast) sysxIn.finish(emitSysx);
 				spi_in_state = command_byte;
-				((uint8_t*)&incoming_tempo)[3] = bytIn;
-				set_tempo = true;
-				break;
-			default:
+			}
+			break;
+		case sysx_data:
+			sysxIn.append(&bytIn, 1, emitSysx);
+			if (--n_sysx_incoming == 0) {
+				if (sysx_in_flags & sysxLast) sysxIn.finish(emitSysx);
 				spi_in_state = command_byte;
-				break;
-	
-		}
-		return false;
-	};
-	
+			}
+			break;
+		default:
+			spi_in_state = command_byte;
+			break;
+
+	}
+	return false;
+}
+
+/*!
+ * each time round, top up what's waiting to go from the queue, highest priority first, pack as much of it into a frame as fits,
+ * with sysex after it, and send the frame in one transfer. what doesn't fit goes first next time. what's drained before its send
+ * time is scheduled instead, and goes first once it's due, so we never wait on the queue past the next of those. with nothing to
+ * send we ping the duino, and while it has more to send back we pad the ping out to a whole frame to read it all the sooner
+ */
+void PiSpi::spiRunner()
+{
+	spi_frame_t frame(frameLen);
 
 	inQ.enable();
 	inQ.enableWait();
+	std::vector<xymsg::msg_t> batch;
+	std::vector<xymsg::msg_t> pending;	//!< drained, in priority order, but not sent yet
+	const std::size_t maxPending = frameLen / 3;
+	bool readMore = false;	//!< the duino had something to say last time, so it may have more
+	
+	std::vector<xymsg::msg_t> due;	//!< released from the scheduler this time round
+	due.reserve(MidiScheduler::capacity);
 	
 	while (isRunning) {
-		auto optMsg = inQ.front(timeout);
-		int msgLen = 0;
-		if (optMsg.second) {
-			auto msg = optMsg.first;
-			switch (msg->type) {
-				case xymsg::typ::midi: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::MidiMsg>(msg);
-					buf[0] = xyspi::cmd_t::midi | 1;
-					buf[1] = mmsg->midi.cmd;
-					buf[2] = mmsg->midi.val1;
-					buf[3] = mmsg->midi.val2;
-					msgLen = 4;
-					break;
-				}
-				case xymsg::typ::midi_list: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::MidiListMsg>(msg);
-					auto l = mmsg->midi.size();
-					if (l > 127) {
-						error("midi list too long. skipping.");
-						break;
-					}
-					buf[0] = xyspi::cmd_t::midi | mmsg->midi.size();
-					uint8_t *p = &buf[0];
-					for (const auto &m: mmsg->midi) {
-						buf[++msgLen] = m.cmd;
-						buf[++msgLen] = m.val1;
-						buf[++msgLen] = m.val2;
-					}
-					++msgLen;
-					break;
+		const bool idle = pending.empty() && sysxReady == 0 && !readMore;
+		if (pending.size() < maxPending) {
+			auto wait = idle ? std::chrono::steady_clock::duration(pingInterval) : 0ms;
+			if (!scheduler.empty()) wait = std::max<std::chrono::steady_clock::duration>(0ms, std::min(wait, scheduler.nextDue() - std::chrono::steady_clock::now()));
+			inQ.drain(batch, maxPending - pending.size(), wait);
+			const auto now = std::chrono::steady_clock::now();
+			for (auto& msg : batch) {
+				if (xymsg::typeOf(msg) == xymsg::typ::sysx) {
+					takeSysx(std::move(msg));
+				} else if (!(msg.hasDue() && msg.due() > now && scheduler.schedule(std::move(msg)))) {
+					pending.push_back(std::move(msg));
 				}
-				case xymsg::typ::config_button: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::ConfigButtonMsg>(msg);
-					buf[0] = xyspi::cmd_t::cfg_button;
-					buf[1] = mmsg->which;
-					buf[2] = sizeof(config::button);
-					std::memcpy(&buf[3], &mmsg->cfg, sizeof(config::button));
-					msgLen = sizeof(config::button) + 3;
-					break;
-				}
-				case xymsg::typ::config_pedal: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::ConfigPedalMsg>(msg);
-					buf[0] = xyspi::cmd_t::cfg_pedal;
-					buf[1] = mmsg->which;
-					buf[2] = sizeof(config::pedal);
-					std::memcpy(&buf[3], &mmsg->cfg, sizeof(config::pedal));
-					msgLen = sizeof(config::pedal) + 3;
-					break;
-				}
-				case xymsg::typ::config_xlrm8r: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::ConfigXlm8rMsg>(msg);
-					buf[0] = xyspi::cmd_t::cfg_xlrm8;
-					buf[1] = mmsg->which;
-					buf[2] = sizeof(config::xlrm8r);
-					std::memcpy(&buf[3], &mmsg->cfg, sizeof(config::xlrm8r));
-					msgLen = sizeof(config::xlrm8r) + 3;
-					break;
-				}
-				case xymsg::typ::tempo: {
-					const auto &mmsg = std::static_pointer_cast<xymsg::TempoMsg>(msg);
-					buf[0] = xyspi::cmd_t::tempo;
-					*(reinterpret_cast<float*>(&buf[1])) = mmsg->tempo;
-					msgLen = 5;
-					break;
-				}
-				case xymsg::typ::duino_cmd: {
-					buf[0] = std::static_pointer_cast<xymsg::CmdMsg>(msg)->cmd;
-					msgLen = 1;
-					break;
-				}
-				case xymsg::typ::none:
-				default:
-					buf[0] = xyspi::cmd_t::null;
-					msgLen = 1;
-					break;
 			}
-		} else {
-			buf[0] = xyspi::cmd_t::ping;
-			msgLen = 1;
+			batch.clear();
+		}
+		if (!scheduler.empty()) {
+			scheduler.release(std::chrono::steady_clock::now(), [&due](const xymsg::msg_t& msg) { due.push_back(msg); });
+			pending.insert(pending.begin(), std::make_move_iterator(due.begin()), std::make_move_iterator(due.end()));
+			due.clear();
 		}
 
+		frame.clear();
+		std::size_t nPacked = 0;
+		while (nPacked < pending.size() && frame.add(pending[nPacked])) ++nPacked;
+		std::size_t sysxDone = 0;
+		while (sysxDone < sysxReady && frame.room() > 2) {
+			const auto &chunk = *std::get<xymsg::SysxMsg>(sysxOut[sysxDone].body);
+			sysxOutPos += frame.addSysx(chunk, sysxOutPos);
+			if (sysxOutPos < chunk.len) break;
+			sysxOutPos = 0;
+			++sysxDone;
+		}
+		if (frame.size() == 0) {
+			if (!readMore && !inQ.empty()) continue;
+			frame.add(xymsg::CmdMsg(xyspi::cmd_t::ping));
+			if (readMore) frame.pad(frameLen);
+		}
+
+		transport->transfer(frame.data(), frame.size());
+		transfers.fetch_add(1, std::memory_order_relaxed);
+		bytes.fetch_add(frame.size(), std::memory_order_relaxed);
+		for (std::size_t i = 0; i < nPacked; ++i) xymsg::latency().record(pending[i], xymsg::sink::spi);
+		for (std::size_t i = 0; i < sysxDone; ++i) xymsg::latency().record(sysxOut[i], xymsg::sink::spi);
+		sent.fetch_add(nPacked, std::memory_order_relaxed);
+		carried.fetch_add(pending.size() - nPacked, std::memory_order_relaxed);
+		pending.erase(pending.begin(), pending.begin() + nPacked);
+		sysxOut.erase(sysxOut.begin(), sysxOut.begin() + sysxDone);
+		sysxReady -= sysxDone;
+
 		bool wasPonged = false;
-		if (msgLen > 0) {
-			wiringPiSPIDataRW(SPIchannel, buf, msgLen);
-			for (auto i=0; i<msgLen; i++) {
-				wasPonged = processNextSpiByte(buf[i]);
-			}
+		readMore = false;
+		const uint8_t* in = frame.data();
+		for (std::size_t i = 0; i < frame.size(); ++i) {
+			const bool pong = processNextSpiByte(in[i]);
+			wasPonged |= pong;
+			readMore |= !pong && in[i] != xyspi::cmd_t::null;
 		}
+		readMore |= spi_in_state != command_byte;
 
 		if (isRunning) {
 			if (!wasPonged || !inQ.empty()) {
 				/* not really a sleep. but we'll yield otherwise, we wait for
-				 incoming with wait on a condition variable with a timeout inside front()
+				 incoming with wait on a condition variable with a timeout inside drain()
 				 at the start of the loop */
 				std::this_thread::sleep_for(10us);
 			}
@@ -1,7 +1,25 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <thread>
+#include <vector>
 #include "message.h"
+#include "midi_scheduler.h"
+#include "router.h"
+#include "spi_transport.h"
+#include "xypiduino/include/xyspi.h"
+
+/*!
+ * sysex goes over spi in frames of [spiSysx, flags | length, data...], as many as it takes, between whatever else we have to send.
+ * xyspi.h has no command for it yet, so this must be kept in step with the duino.
+ */
+constexpr uint8_t spiSysx = xyspi::cmd_t::cfg_xlrm8 + 1;
+constexpr uint8_t sysxFirst = 0x80;	//!< the frame starts a sysex
+constexpr uint8_t sysxLast = 0x40;	//!< the frame ends one
+constexpr uint8_t sysxLenMask = 0x3f;
+constexpr std::size_t sysxFrameLen = xyspi::maxCmdLen - 2;	//!< most sysex bytes in a frame
+static_assert(sysxFrameLen <= sysxLenMask, "sysex frame length has to fit in its header");
 
 
 enum spi_io_state_t: uint8_t {
@@ -16,21 +34,70 @@ enum spi_io_state_t: uint8_t {
 	diag_message_length = 8,
 	diag_message_data = 9,
 	filler = 10,
+	sysx_header = 11,	//!< the flags and length of a sysex frame
+	sysx_data = 12,		//!< processing sysex bytes
 };
 
 
+/*!
+ * the bytes for one transfer to the duino, packed with as many messages as fit. a run of midi messages shares one midi command,
+ * as long as the command stays within what the duino takes at once
+ */
+struct spi_frame_t {
+	static constexpr std::size_t maxMidiRun = (xyspi::maxCmdLen - 1) / 3;	//!< midi messages under one command
+
+	explicit spi_frame_t(std::size_t size) : buf(size) {}
+
+	void clear() { len = 0; midiAt = npos; }
+	bool add(const xymsg::msg_t& msg);
+	std::size_t addSysx(const xymsg::SysxChunk& chunk, std::size_t pos);
+	void pad(std::size_t n);
+
+	uint8_t* data() { return buf.data(); }
+	std::size_t size() const { return len; }
+	std::size_t room() const { return buf.size() - len; }
+
+private:
+	static constexpr std::size_t npos = ~std::size_t(0);
+
+	bool addMidi(const xymidi::msg& m);
+	bool addConfig(uint8_t cmd, uint8_t which, const void* cfg, std::size_t cfgLen);
+
+	std::vector<uint8_t> buf;
+	std::size_t len = 0;
+	std::size_t midiAt = npos;	//!< the midi command heading the run of midi at the end of the frame, if it ends with one
+};
+
+/*!
+ * talks to the duino over spi, on a thread of its own: sends what the router queues for it, and routes what comes back. each
+ * transfer carries as many of the queued messages as fit in a frame, highest priority first, with sysex frames filling what's
+ * left, and what comes back is parsed in one pass. anything with a send time in the future, like the clock's ticks and the
+ * sequencer's notes, waits in a scheduler until it's due, and then goes ahead of the rest. the spi port itself is a transport, so
+ * the same code runs against a simulated duino off the pi
+ */
 class PiSpi {
 public:
-	PiSpi(xymsg::q_t& _inQ, xymsg::q_t& _outQ);
+	PiSpi(xymsg::q_t& _inQ, xymsg::Router& _router, std::unique_ptr<SpiTransport> _transport, std::size_t _frameLen = xyspi::maxCmdLen);
 	~PiSpi();
 
 	bool start();
 	void stop();
 
+	struct counters_t {
+		uint64_t transfers = 0;
+		uint64_t bytes = 0;		//!< each way
+		uint64_t sent = 0;		//!< messages sent to the duino, pings and sysex frames aside
+		uint64_t carried = 0;	//!< messages that didn't fit in the frame they were drained for, and went in the next
+		uint64_t received = 0;	//!< messages from the duino
+		uint64_t pongs = 0;
+	};
+	counters_t counters() const;
+	MidiScheduler::stats_t schedulerStats() const { return scheduler.stats(); }
+	const SpiTransport& spiTransport() const { return *transport; }
+
 protected:
 	std::thread spiThread;
 	std::atomic<bool> isRunning;
-	bool isSpiOpen;
 
 	spi_io_state_t spi_in_state = command_byte;
 	float incoming_tempo;
@@ -40,12 +107,31 @@ protected:
 	uint8_t cmd_in = 0;
 	uint8_t val1_in = 0;
 	uint8_t val2_in = 0;
+	uint8_t sysx_in_flags = 0;
+	uint8_t n_sysx_incoming = 0;
+	xymsg::sysx_builder sysxIn;	//!< sysex from the duino, rebuilt from its frames
 
+	std::vector<xymsg::msg_t> sysxOut;	//!< sysex chunks waiting to go to the duino, a frame at a time
+	std::size_t sysxReady = 0;			//!< how many of them are of sysex we have all of, and can send
+	std::size_t sysxOutPos = 0;			//!< how far we are through the first of them
+	xymsg::sysx_check sysxCheck;		//!< that we have every chunk of the sysex coming in
+	std::size_t frameLen;
+	MidiScheduler scheduler;	//!< what isn't due to go yet
 
 
 	xymsg::q_t& inQ;
-	xymsg::q_t& outQ;
+	xymsg::Router& router;
+	std::unique_ptr<SpiTransport> transport;
+
+	std::atomic<uint64_t> transfers{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+	std::atomic<uint64_t> sent{ 0 };
+	std::atomic<uint64_t> carried{ 0 };
+	std::atomic<uint64_t> received{ 0 };
+	std::atomic<uint64_t> pongs{ 0 };
 
 	void spiRunner();
-	void processNextSpiByte(const uint8_t bytIn);
-};
\ No newline at end of file
+	void takeSysx(xymsg::msg_t&& msg);
+	bool processNextSpiByte(const uint8_t bytIn);
+	void emit(xymsg::msg_t&& msg);
+};
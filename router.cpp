@@ -0,0 +1,336 @@
+#include "router.h"
+#include "coalescer.h"
+#include "state_cache.h"
+#include "journal.h"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using json = nlohmann::json;
+using spdlog::info;
+using spdlog::debug;
+
+namespace xymsg {
+
+namespace {
+
+//! names of the midi status classes, by statusClass(). the gaps are undefined status bytes
+constexpr std::array<const char*, 24> statusNames = {
+	"noteOff", "noteOn", "keyPress", "ctrl", "prog", "chanPress", "bend", "",
+	"sysxStart", "timeCode", "songPos", "songSel", "", "cableMsg", "tuneReq", "sysxEnd",
+	"clock", "", "start", "cont", "stop", "", "sensing", "sysReset"
+};
+
+template<std::size_t N>
+std::size_t indexOf(const std::array<const char*, N>& names, const std::string& name, const char* what)
+{
+	for (std::size_t i = 0; i < N; ++i) {
+		if (name == names[i]) return i;
+	}
+	throw std::invalid_argument("Unknown " + std::string(what) + " '" + name + "' in routes");
+}
+
+/*!
+ * a bit mask from a json list of names, or of numbers from 'base'. a missing field gives every bit.
+ */
+template<typename M, std::size_t N>
+M maskOf(const json& j, const char* field, const std::array<const char*, N>& names, const char* what)
+{
+	if (!j.contains(field)) return static_cast<M>(~M(0));
+	M m = 0;
+	for (const auto& v : j.at(field)) m |= M(1) << indexOf(names, v.get<std::string>(), what);
+	return m;
+}
+
+template<typename M>
+M numberMask(const json& j, const char* field, unsigned base, unsigned n, const char* what)
+{
+	if (!j.contains(field)) return static_cast<M>(~M(0));
+	M m = 0;
+	for (const auto& v : j.at(field)) {
+		const auto i = v.get<unsigned>();
+		if (i < base || i >= base + n) throw std::invalid_argument("Bad " + std::string(what) + " " + std::to_string(i) + " in routes");
+		m |= M(1) << (i - base);
+	}
+	return m;
+}
+
+template<typename M, std::size_t N>
+json namesOf(M m, const std::array<const char*, N>& names)
+{
+	json l = json::array();
+	for (std::size_t i = 0; i < N; ++i) {
+		if ((m & (M(1) << i)) && names[i][0] != '\0') l.push_back(names[i]);
+	}
+	return l;
+}
+
+template<typename M>
+json numbersOf(M m, unsigned base, unsigned n)
+{
+	json l = json::array();
+	for (unsigned i = 0; i < n; ++i) {
+		if (m & (M(1) << i)) l.push_back(base + i);
+	}
+	return l;
+}
+
+}
+
+/*!
+ * note that a message has gone out to a sink. messages that were never stamped, like those we make up ourselves, aren't counted.
+ * a message held back until a send time counts from then, rather than from when it came in.
+ */
+void latency_meter::record(const msg_t& msg, sink to)
+{
+	if (msg.t == std::chrono::steady_clock::time_point{}) return;
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - msg.due()).count();
+	hists[static_cast<std::size_t>(msg.from)][static_cast<std::size_t>(to)].record(us > 0 ? static_cast<uint64_t>(us) : 0);
+}
+
+locked::dwell_hist_t latency_meter::snapshot(source from, sink to) const
+{
+	return hists[static_cast<std::size_t>(from)][static_cast<std::size_t>(to)].snapshot();
+}
+
+/*!
+ * the one latency meter every sink records into
+ */
+latency_meter& latency()
+{
+	static latency_meter meter;
+	return meter;
+}
+
+/*!
+ * \class Router
+ * takes every message coming into the hub, and pushes it to whichever of the outgoing queues the routing matrix says want it
+ */
+Router::Router(q_t& oscQ, q_t& spiQ, q_t& midiQ)
+	: sinks{ &oscQ, &spiQ, &midiQ }
+{
+	setRoutes(defaultRoutes());
+}
+
+/*!
+ * send a message from the given source to the sinks that want it. the last sink gets the message itself, the others get copies.
+ * the message is marked with its source, and stamped with the time now unless whoever read it in knew better. anything the clock
+ * tap takes counts as routed, as does anything the coalescer holds back.
+ */
+void Router::route(source from, msg_t&& msg)
+{
+	const auto src = static_cast<std::size_t>(from);
+	msg.from = from;
+	if (msg.t == std::chrono::steady_clock::time_point{}) msg.t = std::chrono::steady_clock::now();
+	const bool tapped = clockTap && from != source::clock && isClock(msg) && clockTap(from, msg);
+	auto to = tapped ? 0 : sinksFor(from, msg);
+	if (journal && from != source::clock && from != source::seq) journal->record(msg, to);
+	if (tapped) {
+		routed[src].fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	if (state) state->update(msg);
+	if (to == 0) {
+		dropped[src].fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	routed[src].fetch_add(1, std::memory_order_relaxed);
+	for (std::size_t s = 0; to != 0; ++s, to >>= 1) {
+		if ((to & 1) == 0) continue;
+		if (coalescer && coalescer->offer(static_cast<sink>(s), msg)) continue;
+		if (to == 1) {
+			sinks[s]->push(std::move(msg));
+		} else {
+			sinks[s]->push(msg);
+		}
+	}
+}
+
+/*!
+ * look up the sinks for a message
+ *  \return a bit mask of sinks
+ */
+uint8_t Router::sinksFor(source from, const msg_t& msg)
+{
+	const auto src = static_cast<std::size_t>(from);
+	for (;;) {
+		const auto i = current.load();
+		readers[i].fetch_add(1);
+		if (current.load() == i) {
+			const auto& t = tables[i];
+			uint8_t to;
+			if (typeOf(msg) == typ::midi) {
+				const auto& m = std::get<MidiMsg>(msg.body).midi;
+				const std::size_t row = m.port == xymidi::allPorts ? nPorts : std::min<std::size_t>(m.port, nPorts - 1);
+				to = t.midi[src][row][m.cmd];
+			} else {
+				to = t.other[src][msg.body.index()];
+			}
+			readers[i].fetch_sub(1, std::memory_order_release);
+			return to;
+		}
+		// the tables were swapped as we arrived, so this one may be about to be rewritten
+		readers[i].fetch_sub(1, std::memory_order_release);
+	}
+}
+
+/*!
+ * replace the routing matrix. safe while messages are being routed: they see either the old rules or the new
+ */
+void Router::setRoutes(const std::vector<route_t>& routes)
+{
+	const std::unique_lock<std::mutex> lock(writeMutex);
+	const auto next = 1 - current.load();
+	while (readers[next].load(std::memory_order_acquire) != 0) std::this_thread::yield();
+	compile(routes, tables[next]);
+	current.store(next);
+	rules = routes;
+	debug("Router::setRoutes() {} routes", rules.size());
+}
+
+std::vector<route_t> Router::routes()
+{
+	const std::unique_lock<std::mutex> lock(writeMutex);
+	return rules;
+}
+
+Router::counters_t Router::counters(source from) const
+{
+	const auto src = static_cast<std::size_t>(from);
+	return { routed[src].load(std::memory_order_relaxed), dropped[src].load(std::memory_order_relaxed) };
+}
+
+/*!
+ * is a message something the clock engine wants to see: tempo, or midi clock, start, continue, stop or song position
+ */
+bool Router::isClock(const msg_t& msg)
+{
+	switch (typeOf(msg)) {
+	case typ::tempo:
+		return true;
+	case typ::midi:
+		switch (static_cast<xymidi::cmd>(std::get<MidiMsg>(msg.body).midi.cmd)) {
+		case xymidi::cmd::clock:
+		case xymidi::cmd::start:
+		case xymidi::cmd::cont:
+		case xymidi::cmd::stop:
+		case xymidi::cmd::songPos:
+			return true;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
+}
+
+void Router::compile(const std::vector<route_t>& routes, table_t& table)
+{
+	table = table_t{};
+	constexpr auto midiBit = 1u << static_cast<unsigned>(typ::midi);
+	for (const auto& r : routes) {
+		const auto src = static_cast<std::size_t>(r.from);
+		for (std::size_t t = 0; t < typNames.size(); ++t) {
+			if (t != static_cast<std::size_t>(typ::midi) && (r.types & (1u << t))) table.other[src][t] |= r.to;
+		}
+		if ((r.types & midiBit) == 0) continue;
+		// midi for every port, like the clock's, goes wherever a route takes midi from any of its ports
+		for (std::size_t p = 0; p <= nPorts; ++p) {
+			if (p < nPorts ? (r.ports & (1u << p)) == 0 : r.ports == 0) continue;
+			for (unsigned s = 0x80; s <= 0xff; ++s) {
+				const bool channelOk = s >= 0xf0 || (r.channels & (1u << (s & 0x0f)));
+				if (channelOk && (r.statuses & (1u << statusClass(s)))) table.midi[src][p][s] |= r.to;
+			}
+		}
+	}
+}
+
+/*!
+ * what we did before there was a routing matrix: midi in goes out over osc and to the duino, osc goes to the duino, and the duino
+ * goes out over osc and midi. except that active sensing now stops at the source. midi and sysex sent over the ws api go to the
+ * duino and the midi ports, and the hub's own clock and sequencer go everywhere, though only the duino takes the clock's tempo
+ */
+std::vector<route_t> Router::defaultRoutes()
+{
+	const auto bit = [](sink s) { return static_cast<uint8_t>(1u << static_cast<unsigned>(s)); };
+	const uint32_t noSensing = ~(1u << statusClass((uint8_t)xymidi::cmd::sensing));
+	std::vector<route_t> routes(7);
+	routes[0].from = source::midi;
+	routes[0].to = bit(sink::osc) | bit(sink::spi);
+	routes[1].from = source::osc;
+	routes[1].to = bit(sink::spi);
+	routes[2].from = source::spi;
+	routes[2].to = bit(sink::osc) | bit(sink::midi);
+	routes[3].from = source::ws;
+	routes[3].to = bit(sink::spi) | bit(sink::midi);
+	routes[3].types = 1u << static_cast<unsigned>(typ::midi) | 1u << static_cast<unsigned>(typ::sysx);
+	routes[4].from = source::clock;
+	routes[4].to = bit(sink::spi);
+	routes[5].from = source::clock;
+	routes[5].to = bit(sink::osc) | bit(sink::midi);
+	routes[5].types = 1u << static_cast<unsigned>(typ::midi);
+	routes[6].from = source::seq;
+	routes[6].to = bit(sink::osc) | bit(sink::spi) | bit(sink::midi);
+	for (auto& r : routes) r.statuses = noSensing;
+	return routes;
+}
+
+/*!
+ * read routes from json: a list of objects like
+ *	{"from": "midi", "to": ["osc", "spi"], "ports": [0, 1], "channels": [1, 10], "status": ["noteOn", "noteOff"], "types": ["midi"]}
+ * all but 'from' and 'to' are optional, and "except": [<status>, ...] may be given instead of "status".
+ *  \throws std::invalid_argument on badly formed routes
+ */
+std::vector<route_t> Router::parseRoutes(const json& j)
+{
+	if (!j.is_array()) throw std::invalid_argument("Routes should be a list");
+	std::vector<route_t> routes;
+	try {
+		for (const auto& jr : j) {
+			route_t r;
+			r.from = static_cast<source>(indexOf(sourceNames, jr.at("from").get<std::string>(), "source"));
+			r.to = maskOf<uint8_t>(jr, "to", sinkNames, "sink") & ((1u << nSinks) - 1);
+			r.ports = numberMask<uint16_t>(jr, "ports", 0, nPorts, "port");
+			r.channels = numberMask<uint16_t>(jr, "channels", 1, 16, "channel");
+			r.types = maskOf<uint32_t>(jr, "types", typNames, "type");
+			r.statuses = maskOf<uint32_t>(jr, "status", statusNames, "status");
+			if (jr.contains("except")) r.statuses &= ~maskOf<uint32_t>(jr, "except", statusNames, "status");
+			routes.push_back(r);
+		}
+	} catch (const json::exception& e) {
+		throw std::invalid_argument(std::string("Bad routes: ") + e.what());
+	}
+	return routes;
+}
+
+json Router::toJson(const std::vector<route_t>& routes)
+{
+	json j = json::array();
+	for (const auto& r : routes) {
+		json jr;
+		jr["from"] = sourceNames[static_cast<std::size_t>(r.from)];
+		jr["to"] = namesOf(r.to, sinkNames);
+		if (r.ports != 0xffff) jr["ports"] = numbersOf(r.ports, 0, nPorts);
+		if (r.channels != 0xffff) jr["channels"] = numbersOf(r.channels, 1, 16);
+		if (r.statuses != 0xffffffff) {
+			auto in = namesOf(r.statuses, statusNames);
+			auto out = namesOf(~r.statuses, statusNames);
+			if (out.size() < in.size()) {
+				jr["except"] = out;
+			} else {
+				jr["status"] = in;
+			}
+		}
+		if (r.types != 0xffffffff) jr["types"] = namesOf(r.types, typNames);
+		j.push_back(jr);
+	}
+	return j;
+}
+
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "message.h"
+#include "locked/meter.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace xymsg {
+
+class Coalescer;
+class StateCache;
+class Journal;
+
+/*!
+ * where messages go: each sink is one of the hub's outgoing queues
+ */
+enum class sink : uint8_t {
+	osc = 0,	//!< oscInQ, to the osc worker
+	spi = 1,	//!< spiInQ, to the duino
+	midi = 2	//!< midiOutQ, to the local midi ports
+};
+constexpr std::size_t nSinks = 3;
+constexpr std::array<const char*, nSinks> sinkNames = { "osc", "spi", "midi" };
+
+constexpr std::size_t nPorts = 16;	//!< midi ports we route separately. higher port numbers share the last one's routes
+
+/*!
+ * how long messages take from coming into the hub to leaving it, by the source they came from and the sink they leave by. each sink
+ * records its messages as they go out on the wire, so this covers the queues, the workers and any batching on the way.
+ */
+class latency_meter
+{
+public:
+	void record(const msg_t& msg, sink to);
+	locked::dwell_hist_t snapshot(source from, sink to) const;
+
+private:
+	std::array<std::array<locked::hist_meter, nSinks>, nSources> hists;
+};
+
+latency_meter& latency();
+
+/*!
+ * one rule of the routing matrix: messages from a source that pass all the filters go to the sinks. the filters only narrow things
+ * down, so a rule with none sends everything from its source. the matrix is the union of its rules.
+ */
+struct route_t {
+	source from = source::midi;
+	uint8_t to = 0;					//!< bit mask of sinks
+	uint16_t ports = 0xffff;		//!< bit mask of midi ports
+	uint16_t channels = 0xffff;		//!< bit mask of midi channels, bit 0 for channel 1. system messages ignore this
+	uint32_t statuses = 0xffffffff;	//!< bit mask of midi status classes, see statusClass()
+	uint32_t types = 0xffffffff;	//!< bit mask of message typ
+};
+
+/*!
+ * bit for a midi status byte in route_t::statuses: 0-6 for the channel messages, noteOff to bend, and 8-23 for 0xf0-0xff
+ */
+inline uint32_t statusClass(uint8_t status) { return status >= 0xf0 ? 8 + (status & 0x0f) : (status >> 4) - 8; }
+
+/*!
+ * the routing matrix, compiled into flat tables so that routing a message is one lookup, by source, midi port and status byte for midi
+ * messages and by source and type for everything else. anything no sink wants is dropped right there, and counted.
+ * the rules may be changed at any time. we keep two tables and swap between them: routers announce which one they are reading, and
+ * the writer waits for the spare table to be free before compiling into it, so routing never takes a lock.
+ */
+class Router
+{
+public:
+	Router(q_t& oscQ, q_t& spiQ, q_t& midiQ);
+
+	void route(source from, msg_t&& msg);
+	uint8_t sinksFor(source from, const msg_t& msg);
+
+	/*!
+	 * sees midi clock, transport and tempo coming in from anywhere but the clock itself, before it is routed
+	 *  \return true to take the message, so it goes no further
+	 */
+	using clock_tap_t = std::function<bool(source from, const msg_t& msg)>;
+	void setClockTap(clock_tap_t tap) { clockTap = std::move(tap); }
+
+	/*!
+	 * offer everything on its way to a sink to the coalescer first. set before anything is routed
+	 */
+	void setCoalescer(Coalescer* _coalescer) { coalescer = _coalescer; }
+
+	/*!
+	 * keep the state cache up with everything routed, whether any sink wants it or not. set before anything is routed
+	 */
+	void setStateCache(StateCache* _state) { state = _state; }
+
+	/*!
+	 * record everything that comes in, but for our own clock and sequencer, with the sinks it goes to. set before anything is routed
+	 */
+	void setJournal(Journal* _journal) { journal = _journal; }
+
+	void setRoutes(const std::vector<route_t>& routes);
+	std::vector<route_t> routes();
+
+	struct counters_t {
+		uint64_t routed = 0;
+		uint64_t dropped = 0;	//!< messages no sink wanted
+	};
+	counters_t counters(source from) const;
+
+	static std::vector<route_t> defaultRoutes();
+	static std::vector<route_t> parseRoutes(const nlohmann::json& j);
+	static nlohmann::json toJson(const std::vector<route_t>& routes);
+
+private:
+	struct table_t {
+		std::array<std::array<std::array<uint8_t, 256>, nPorts + 1>, nSources> midi{};	//!< sinks by source, port and status byte. the last row is for allPorts
+		std::array<std::array<uint8_t, typNames.size()>, nSources> other{};		//!< sinks by source and message type
+	};
+	static void compile(const std::vector<route_t>& routes, table_t& table);
+	static bool isClock(const msg_t& msg);
+
+	std::array<q_t*, nSinks> sinks;
+	std::array<table_t, 2> tables;
+	std::atomic<uint32_t> current{ 0 };	//!< the table routers should read
+	std::array<std::atomic<uint32_t>, 2> readers{};	//!< routers reading each table
+	std::mutex writeMutex;
+	std::vector<route_t> rules;
+	clock_tap_t clockTap;	//!< set before anything is routed
+	Coalescer* coalescer = nullptr;
+	StateCache* state = nullptr;
+	Journal* journal = nullptr;
+	std::array<std::atomic<uint64_t>, nSources> routed{};
+	std::array<std::atomic<uint64_t>, nSources> dropped{};
+};
+
+}
@@ -0,0 +1,285 @@
+#include "sequencer.h"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+using json = nlohmann::json;
+using spdlog::debug;
+using spdlog::info;
+
+constexpr double maxSteps = 1024;
+
+namespace {
+
+bool isOff(const xymidi::msg& m) { return (m.cmd & 0xf0) == (uint8_t)xymidi::cmd::noteOff; }
+
+/*!
+ * an optional whole number field, checked against its range
+ *  \throws std::invalid_argument if it's out of range
+ */
+int intOf(const json& j, const char* name, int lo, int hi, int dflt)
+{
+	const int v = j.value(name, dflt);
+	if (v < lo || v > hi) throw std::invalid_argument(fmt::format("'{}' should be from {} to {}", name, lo, hi));
+	return v;
+}
+
+Sequencer::clock_t::duration usOf(double us)
+{
+	return std::chrono::duration_cast<Sequencer::clock_t::duration>(std::chrono::duration<double, std::micro>(us));
+}
+
+}
+
+/*!
+ * work out a pattern's events from json like
+ *	{"steps": 16, "steps_per_beat": 4, "swing": 0.6, "events": [{"step": 0, "note": 36, "vel": 100, "len": 1, "chan": 10, "port": 0},
+ *		{"step": 2.5, "cc": 74, "value": 64}, {"step": 4, "prog": 3}, {"step": 8, "bend": 8192}]}
+ * steps may be fractional, and a note's 'len' is in steps. 'swing' is how much of each pair of steps the first of them takes, from
+ * 0.5, which is straight, to 0.75: the first step of a pair is stretched to match and the second squeezed, each evenly over its
+ * length. 'chan' counts from 1, and all but 'step' and what the event is have defaults.
+ *  \throws std::invalid_argument on a badly formed pattern
+ */
+seq_pattern_t seq_pattern_t::parse(const json& j)
+{
+	seq_pattern_t p;
+	try {
+		const auto steps = j.value("steps", 16.0);
+		const auto perBeat = j.value("steps_per_beat", 4.0);
+		const auto swing = j.value("swing", 0.5);
+		if (steps < 1 || steps > maxSteps) throw std::invalid_argument(fmt::format("A pattern should have from 1 to {} steps", maxSteps));
+		if (perBeat <= 0 || perBeat > ClockEngine::ppqn) throw std::invalid_argument(fmt::format("'steps_per_beat' should be up to {}", ClockEngine::ppqn));
+		if (swing < 0.5 || swing > 0.75) throw std::invalid_argument("'swing' should be from 0.5 to 0.75");
+		const double ticksPerStep = ClockEngine::ppqn / perBeat;
+		// each pair of steps keeps its length, with the first step stretched to take 'swing' of it and the second squeezed
+		// into the rest, so what's inside a step keeps its order and its place in the step
+		const auto tickOf = [&](double step) {
+			const auto pair = 2 * std::floor(step / 2);
+			const auto at = step - pair;
+			return (pair + (at < 1 ? at * 2 * swing : 2 * swing + (at - 1) * (2 - 2 * swing))) * ticksPerStep;
+		};
+		p.length = steps * ticksPerStep;
+		for (const auto& je : j.at("events")) {
+			const auto step = je.at("step").get<double>();
+			if (step < 0 || step >= steps) throw std::invalid_argument(fmt::format("Step {} is outside the pattern", step));
+			const auto chan = static_cast<uint8_t>(intOf(je, "chan", 1, 16, 1) - 1);
+			const auto port = static_cast<uint8_t>(intOf(je, "port", 0, xymsg::nPorts - 1, 0));
+			const auto add = [&](double at, xymidi::msg m) {
+				m.port = port;
+				p.events.push_back({ at, m });
+			};
+			if (je.contains("note")) {
+				const auto note = static_cast<uint8_t>(intOf(je, "note", 0, 127, 0));
+				const auto len = je.value("len", 1.0);
+				if (len <= 0) throw std::invalid_argument("A note's 'len' should be more than 0");
+				add(tickOf(step), xymidi::msg::noteon(chan, note, static_cast<uint8_t>(intOf(je, "vel", 1, 127, 100))));
+				add(tickOf(step + len), xymidi::msg::noteoff(chan, note, 0));
+			} else if (je.contains("cc")) {
+				add(tickOf(step), xymidi::msg::control(chan, static_cast<uint8_t>(intOf(je, "cc", 0, 127, 0)), static_cast<uint8_t>(intOf(je, "value", 0, 127, 0))));
+			} else if (je.contains("prog")) {
+				add(tickOf(step), xymidi::msg::prog(chan, static_cast<uint8_t>(intOf(je, "prog", 0, 127, 0))));
+			} else if (je.contains("bend")) {
+				const auto bend = intOf(je, "bend", 0, 16383, 8192);
+				add(tickOf(step), { xymidi::cmd::bend | chan, static_cast<uint8_t>(bend & 0x7f), static_cast<uint8_t>(bend >> 7) });
+			} else {
+				throw std::invalid_argument("An event should have a 'note', 'cc', 'prog' or 'bend'");
+			}
+		}
+	} catch (const json::exception& e) {
+		throw std::invalid_argument(std::string("Bad pattern: ") + e.what());
+	}
+	std::stable_sort(p.events.begin(), p.events.end(), [](const event_t& a, const event_t& b) {
+		return a.at != b.at ? a.at < b.at : isOff(a.midi) && !isOff(b.midi);
+	});
+	return p;
+}
+
+/*!
+ * \class Sequencer
+ * plays patterns along with the hub's clock
+ */
+Sequencer::Sequencer(xymsg::Router& _router)
+	: router(_router)
+{
+}
+
+/*!
+ * load patterns, and the chain to play them in, from json like
+ *	{"patterns": {"<name>": <pattern>, ...}, "chain": ["<name>", ...], "clear": true}
+ * patterns replace any of the same name, or all of them with 'clear'. a new chain starts when the pattern playing finishes, and
+ * every pattern in it must be loaded. nothing changes unless it's all good
+ *  \throws std::invalid_argument on bad patterns, or a chain with patterns we don't have
+ */
+void Sequencer::load(const json& j)
+{
+	std::map<std::string, seq_pattern_t> loaded;
+	if (j.contains("patterns")) {
+		if (!j["patterns"].is_object()) throw std::invalid_argument("'patterns' should be an object of patterns by name");
+		for (const auto& [name, jp] : j["patterns"].items()) {
+			try {
+				loaded[name] = seq_pattern_t::parse(jp);
+			} catch (const std::invalid_argument& e) {
+				throw std::invalid_argument(fmt::format("Pattern '{}': {}", name, e.what()));
+			}
+		}
+	}
+	std::vector<std::string> newChain;
+	const bool hasChain = j.contains("chain");
+	if (hasChain) {
+		try {
+			newChain = j["chain"].get<std::vector<std::string>>();
+		} catch (const json::exception& e) {
+			throw std::invalid_argument("'chain' should be a list of pattern names");
+		}
+	}
+	const bool clear = j.value("clear", false);
+
+	const std::unique_lock<std::mutex> lock(mutex);
+	const auto have = [&](const std::string& name) { return loaded.count(name) || (!clear && patterns.count(name)); };
+	for (const auto& name : hasChain ? newChain : chain) {
+		if (!have(name)) throw std::invalid_argument(fmt::format("There's no pattern '{}' for the chain", name));
+	}
+	if (clear) patterns.clear();
+	for (auto& [name, p] : loaded) patterns[name] = std::move(p);
+	if (hasChain) {
+		if (chain.empty()) nextStart = std::max(nextStart, static_cast<double>(lastPos + 1));
+		chain = std::move(newChain);
+		next = 0;
+	}
+	info("Sequencer has {} patterns, chain of {}", patterns.size(), chain.size());
+}
+
+/*!
+ * the clock's tick listener. on start or continue we find our place in the chain from the song position, and on stop we let go of
+ * the notes playing. while the transport runs we queue the patterns that start before the next tick, and send the events that fall
+ * before it, each at its own time
+ */
+void Sequencer::onTick(const ClockEngine::tick_t& tick)
+{
+	out.clear();
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		lastPos = tick.pos;
+		if (tick.transport == (uint8_t)xymidi::cmd::start || tick.transport == (uint8_t)xymidi::cmd::cont) {
+			release(tick.due);
+			locate(tick.pos);
+		} else if (!tick.running && playing) {
+			release(tick.due);
+		}
+		if (playing) {
+			const double end = static_cast<double>(tick.pos + 1);
+			while (!chain.empty() && nextStart < end) {
+				const auto& p = patterns.at(chain[next]);
+				enqueue(p, nextStart);
+				position = next;
+				nextStart += p.length;
+				next = (next + 1) % chain.size();
+			}
+			while (!schedule.empty() && schedule.front().at < end) {
+				std::pop_heap(schedule.begin(), schedule.end(), std::greater<>());
+				const auto& s = schedule.back();
+				out.emplace_back(s.midi, tick.due + usOf(std::max(0.0, s.at - tick.pos) * tick.periodUs));
+				schedule.pop_back();
+			}
+			++ticks;
+		}
+	}
+	if (out.empty()) return;
+	for (const auto& [m, due] : out) {
+		xymsg::msg_t msg = xymsg::MidiMsg{ m };
+		msg.setDue(due);
+		router.route(xymsg::source::seq, std::move(msg));
+	}
+	const auto now = clock_t::now();
+	const auto late = std::count_if(out.begin(), out.end(), [now](const auto& e) { return e.second < now; });
+	lateness.record(static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(now - out.front().second).count())));
+	events.fetch_add(out.size(), std::memory_order_relaxed);
+	lateEvents.fetch_add(static_cast<uint64_t>(late), std::memory_order_relaxed);
+}
+
+/*!
+ * start playing from a place in the song, partway through whichever pattern in the chain it falls in. call with the mutex held
+ */
+void Sequencer::locate(uint64_t pos)
+{
+	playing = true;
+	next = 0;
+	nextStart = static_cast<double>(pos);
+	double total = 0;
+	for (const auto& name : chain) total += patterns.at(name).length;
+	if (total == 0) return;
+	const double into = std::fmod(static_cast<double>(pos), total);
+	double at = 0;
+	for (std::size_t i = 0; i < chain.size(); ++i) {
+		const auto& p = patterns.at(chain[i]);
+		if (into < at + p.length) {
+			const double start = static_cast<double>(pos) - (into - at);
+			enqueue(p, start, static_cast<double>(pos));
+			position = i;
+			nextStart = start + p.length;
+			next = (i + 1) % chain.size();
+			break;
+		}
+		at += p.length;
+	}
+	debug("Sequencer plays from tick {}, pattern {} of the chain", pos, position);
+}
+
+/*!
+ * queue a pattern's events to play from the given tick, leaving out any before 'from'. call with the mutex held
+ */
+void Sequencer::enqueue(const seq_pattern_t& p, double start, double from)
+{
+	for (const auto& e : p.events) {
+		if (start + e.at < from) continue;
+		schedule.push_back({ start + e.at, e.midi });
+		std::push_heap(schedule.begin(), schedule.end(), std::greater<>());
+	}
+}
+
+/*!
+ * stop: send the note offs still waiting, now, and drop everything else. call with the mutex held
+ */
+void Sequencer::release(clock_t::time_point due)
+{
+	for (const auto& s : schedule) {
+		if (isOff(s.midi)) out.emplace_back(s.midi, due);
+	}
+	schedule.clear();
+	playing = false;
+}
+
+Sequencer::stats_t Sequencer::stats()
+{
+	stats_t s;
+	{
+		const std::unique_lock<std::mutex> lock(mutex);
+		s.playing = playing;
+		for (const auto& p : patterns) s.patterns.push_back(p.first);
+		s.chain = chain;
+		s.position = position;
+		s.ticks = ticks;
+	}
+	s.events = events.load(std::memory_order_relaxed);
+	s.lateEvents = lateEvents.load(std::memory_order_relaxed);
+	s.lateness = lateness.snapshot();
+	return s;
+}
+
+/*!
+ * the stats as json, with the lateness in microseconds
+ */
+json Sequencer::toJson(const stats_t& s)
+{
+	const auto& d = s.lateness;
+	return {
+		{"playing", s.playing}, {"patterns", s.patterns}, {"chain", s.chain}, {"position", s.position},
+		{"ticks", s.ticks}, {"events", s.events}, {"lateEvents", s.lateEvents},
+		{"latenessUs", { {"count", d.count}, {"mean", d.meanUs()}, {"p50", d.percentile(0.5)}, {"p99", d.percentile(0.99)}, {"max", d.maxUs} }}
+	};
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "clock_engine.h"
+#include "message.h"
+#include "router.h"
+#include "locked/meter.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json_fwd.hpp>
+
+/*!
+ * a pattern made ready to play: its events in time order, in clock ticks from its start, with the swing already in them. note offs
+ * may fall after the end, and ring on into whatever plays next
+ */
+struct seq_pattern_t {
+	struct event_t {
+		double at = 0;	//!< ticks from the start of the pattern
+		xymidi::msg midi;
+	};
+
+	double length = 0;	//!< in ticks
+	std::vector<event_t> events;
+
+	static seq_pattern_t parse(const nlohmann::json& j);
+};
+
+/*!
+ * the hub's step sequencer: patterns loaded over the ws api, played in a chain that loops, in time with the hub's clock. each
+ * pattern is worked out once when it's loaded, into a list of events in time order, and each clock tick we send the events that
+ * fall before the next one, from the seq source, with their times set to where they fall between the two. the ticks go out a
+ * lookahead ahead of their time, so the midi ports' and the duino's schedulers send every event exactly on time, swing and all,
+ * osc sends each in a bundle timetagged with its time, and a tempo change or external clock carries the patterns along with it.
+ * we're driven from the clock thread, by its tick listener: the sequencer plays while the transport runs, from the song position,
+ * and stops every note it started when the transport stops.
+ */
+class Sequencer
+{
+public:
+	using clock_t = ClockEngine::clock_t;
+
+	explicit Sequencer(xymsg::Router& _router);
+
+	void onTick(const ClockEngine::tick_t& tick);
+	void load(const nlohmann::json& j);
+
+	struct stats_t {
+		bool playing = false;
+		std::vector<std::string> patterns;
+		std::vector<std::string> chain;
+		std::size_t position = 0;	//!< in the chain, of the pattern playing
+		uint64_t ticks = 0;		//!< ticks played
+		uint64_t events = 0;	//!< events sent
+		uint64_t lateEvents = 0;	//!< those sent after their time, which go out late
+		locked::dwell_hist_t lateness;	//!< how far behind its earliest event each tick with events was sent, in microseconds
+	};
+	stats_t stats();
+	static nlohmann::json toJson(const stats_t& s);
+
+private:
+	/*!
+	 * an event waiting to go, in ticks since the start of the song. a note off goes before anything else at the same time, so a
+	 * note played again straight after itself isn't cut short
+	 */
+	struct scheduled_t {
+		double at;
+		xymidi::msg midi;
+		bool isOff() const { return (midi.cmd & 0xf0) == (uint8_t)xymidi::cmd::noteOff; }
+		bool operator>(const scheduled_t& other) const { return at != other.at ? at > other.at : !isOff() && other.isOff(); }
+	};
+
+	void locate(uint64_t pos);
+	void enqueue(const seq_pattern_t& p, double start, double from = 0);
+	void release(clock_t::time_point due);
+
+	xymsg::Router& router;
+	std::mutex mutex;	//!< everything below, between the clock thread and the api
+	std::map<std::string, seq_pattern_t> patterns;
+	std::vector<std::string> chain;	//!< patterns by name, all of them loaded
+	std::size_t next = 0;	//!< in the chain, of the pattern to queue next
+	double nextStart = 0;	//!< the tick it starts on
+	std::size_t position = 0;	//!< in the chain, of the pattern last queued
+	bool playing = false;
+	uint64_t lastPos = 0;	//!< of the last tick
+	std::vector<scheduled_t> schedule;	//!< a min heap by time
+	uint64_t ticks = 0;
+
+	std::vector<std::pair<xymidi::msg, clock_t::time_point>> out;	//!< what goes out with this tick. only the clock thread touches it
+	std::atomic<uint64_t> events{ 0 };
+	std::atomic<uint64_t> lateEvents{ 0 };
+	locked::hist_meter lateness;
+};
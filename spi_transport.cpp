@@ -0,0 +1,32 @@
+#include "spi_transport.h"
+#include "duino_sim.h"
+
+#include <nlohmann/json.hpp>
+
+/*!
+ * what the transport is, for the stats
+ */
+nlohmann::json SpiTransport::toJson() const
+{
+	return { {"transport", name()} };
+}
+
+/*!
+ * the transport the config asks for, or none
+ *  \throws std::system_error if the spi port can't be opened, or std::invalid_argument if we're built without it
+ */
+std::unique_ptr<SpiTransport> SpiTransport::create(const spi_config_t& config)
+{
+	switch (config.backend) {
+	case spi_backend::wiringpi:
+#ifdef WIRING_PI
+		return std::make_unique<WiringPiSpi>(config.clockHz);
+#else
+		throw std::invalid_argument("Built without wiringPi, so there's no spi port to the duino");
+#endif
+	case spi_backend::sim:
+		return std::make_unique<DuinoSim>(config);
+	default:
+		return nullptr;
+	}
+}
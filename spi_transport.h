@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <nlohmann/json_fwd.hpp>
+
+#include "xypiduino/include/xyspi.h"
+
+/*!
+ * what carries the hub's spi traffic to the duino
+ */
+enum class spi_backend : uint8_t {
+	none = 0,		//!< no spi at all
+	wiringpi = 1,	//!< the pi's spi port, through wiringPi, if we're built with it
+	sim = 2			//!< a duino simulated in process, for running and measuring the spi path anywhere
+};
+constexpr std::array<const char*, 3> spiBackendNames = { "none", "wiringpi", "sim" };
+
+/*!
+ *  \throws std::invalid_argument for anything but the names in spiBackendNames
+ */
+inline spi_backend parseSpiBackend(const std::string& name)
+{
+	for (std::size_t i = 0; i < spiBackendNames.size(); ++i) {
+		if (name == spiBackendNames[i]) return static_cast<spi_backend>(i);
+	}
+	throw std::invalid_argument("Unknown spi backend '" + name + "'");
+}
+
+struct spi_config_t {
+	spi_backend backend = spi_backend::none;
+	uint32_t clockHz = 1000000;	//!< wiringPi allows from 500kHz to 32MHz
+	std::size_t frameLen = xyspi::maxCmdLen;	//!< most bytes in a transfer. more than maxCmdLen needs a duino built to take it
+	std::chrono::microseconds latency{ 20 };	//!< the simulator's overhead on each transfer, on top of the time the bytes take
+	bool echo = false;	//!< the simulator sends the midi it gets back again, so there's traffic both ways
+};
+
+/*!
+ * a full duplex spi link: each transfer sends a buffer and reads back as many bytes into it. transfers come from the one spi
+ * thread, so a transport needs no locking of its own
+ */
+class SpiTransport
+{
+public:
+	virtual ~SpiTransport() = default;
+
+	virtual void transfer(uint8_t* buf, std::size_t len) = 0;
+	virtual const char* name() const = 0;
+	virtual nlohmann::json toJson() const;
+
+	static std::unique_ptr<SpiTransport> create(const spi_config_t& config);
+};
+
+/*!
+ * the pi's spi port, on channel 0 in mode 0, which is the arduino's default
+ */
+class WiringPiSpi : public SpiTransport
+{
+public:
+	explicit WiringPiSpi(uint32_t clockHz);
+
+	void transfer(uint8_t* buf, std::size_t len) override;
+	const char* name() const override { return "wiringpi"; }
+};
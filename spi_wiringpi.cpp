@@ -0,0 +1,25 @@
+#include "spi_transport.h"
+
+#include <cerrno>
+#include <system_error>
+
+#include <wiringPiSPI.h>
+
+constexpr int SPIchannel = 0;
+
+/*!
+ * \class WiringPiSpi
+ * open the spi port. with wiringPi on the pi the clock can be anything from 500kHz to 32MHz
+ *  \throws std::system_error if it can't be opened
+ */
+WiringPiSpi::WiringPiSpi(uint32_t clockHz)
+{
+	if (wiringPiSPISetupMode(SPIchannel, static_cast<int>(clockHz), 0) < 0) {
+		throw std::system_error(errno, std::generic_category(), "WiringPiSpi: failed to open spi channel 0");
+	}
+}
+
+void WiringPiSpi::transfer(uint8_t* buf, std::size_t len)
+{
+	wiringPiSPIDataRW(SPIchannel, buf, static_cast<int>(len));
+}
@@ -0,0 +1,271 @@
+#include "state_cache.h"
+
+#include <cstring>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+namespace xymsg {
+
+namespace {
+
+constexpr unsigned valueBits = 16;
+constexpr uint64_t valueMask = (1u << valueBits) - 1;
+constexpr int settleTries = 64;	//!< times changes() looks for no change in flight before it settles for the last it found
+
+inline uint64_t changeOf(uint64_t e) { return e >> valueBits; }
+inline uint16_t valueOf(uint64_t e) { return static_cast<uint16_t>(e & valueMask); }
+
+/*!
+ * the entries of one kind, set since the given change, as a list of [<channel>, <value>], or [<channel>, <number>, <value>] for
+ * those kept by controller or note. channels count from 1, as in the routes. released notes are left out of a full snapshot
+ */
+template<std::size_t N>
+json entriesOf(const std::array<std::atomic<uint64_t>, N>& entries, uint64_t since, bool skipZero = false)
+{
+	json l = json::array();
+	for (std::size_t i = 0; i < N; ++i) {
+		const auto e = entries[i].load(std::memory_order_relaxed);
+		if (e == 0 || changeOf(e) <= since || (skipZero && since == 0 && valueOf(e) == 0)) continue;
+		if (N > 16) {
+			l.push_back({ i / 128 + 1, i % 128, valueOf(e) });
+		} else {
+			l.push_back({ i + 1, valueOf(e) });
+		}
+	}
+	return l;
+}
+
+std::string hexOf(const void* data, std::size_t len)
+{
+	static constexpr char digits[] = "0123456789abcdef";
+	std::string s;
+	s.reserve(len * 2);
+	for (std::size_t i = 0; i < len; ++i) {
+		const auto b = static_cast<const uint8_t*>(data)[i];
+		s += digits[b >> 4];
+		s += digits[b & 0x0f];
+	}
+	return s;
+}
+
+}
+
+/*!
+ * \class StateCache
+ * keeps up with the state of everything the hub passes messages about
+ */
+StateCache::StateCache()
+	: ports(std::make_unique<std::array<port_t, nPorts>>()), configs(std::make_unique<configs_t>())
+{
+}
+
+/*!
+ * note what a message changes. called by the router for everything it routes, from any thread
+ */
+void StateCache::update(const msg_t& msg)
+{
+	switch (typeOf(msg)) {
+	case typ::midi:
+		updateMidi(std::get<MidiMsg>(msg.body).midi);
+		break;
+	case typ::midi_list:
+		for (const auto& m : *std::get<MidiListMsg>(msg.body)) updateMidi(m);
+		break;
+	case typ::config_button: {
+		const auto& c = *std::get<ConfigButtonMsg>(msg.body);
+		setConfig(configs->button[c.which], c.cfg);
+		break;
+	}
+	case typ::config_pedal: {
+		const auto& c = *std::get<ConfigPedalMsg>(msg.body);
+		setConfig(configs->pedal[c.which], c.cfg);
+		break;
+	}
+	case typ::config_xlrm8r: {
+		const auto& c = *std::get<ConfigXlm8rMsg>(msg.body);
+		setConfig(configs->xlrm8r[c.which], c.cfg);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/*!
+ * set an entry to a value, as the next change. if two routers race to set the same entry, the later change wins. we count the
+ * change done once it's in place, which is what changes() goes by
+ */
+void StateCache::set(entry_t& e, uint16_t value)
+{
+	const auto change = changeCount.fetch_add(1, std::memory_order_relaxed) + 1;
+	const auto packed = change << valueBits | value;
+	auto old = e.load(std::memory_order_relaxed);
+	while (changeOf(old) < change && !e.compare_exchange_weak(old, packed, std::memory_order_release, std::memory_order_relaxed)) {}
+	doneCount.fetch_add(1, std::memory_order_release);
+}
+
+/*!
+ * the last change that is in place along with every change before it. that's the count of those done, at a moment when as many
+ * have been done as started. if the routers are too busy for us to catch one, we give the last we did, which is only older
+ */
+uint64_t StateCache::changes() const
+{
+	for (int i = 0; i < settleTries; ++i) {
+		const auto done = doneCount.load(std::memory_order_acquire);
+		if (changeCount.load(std::memory_order_relaxed) != done) continue;
+		auto last = settled.load(std::memory_order_relaxed);
+		while (last < done && !settled.compare_exchange_weak(last, done, std::memory_order_relaxed)) {}
+		return done;
+	}
+	return settled.load(std::memory_order_relaxed);
+}
+
+/*!
+ * channel messages on the ports we route separately. midi for higher ports, or for every port, isn't kept
+ */
+void StateCache::updateMidi(const midi_t& m)
+{
+	if (m.port >= nPorts || m.cmd < 0x80 || m.cmd >= 0xf0) return;
+	auto& p = (*ports)[m.port];
+	const auto chan = m.cmd & 0x0f;
+	switch (static_cast<xymidi::cmd>(m.cmd & 0xf0)) {
+	case xymidi::cmd::noteOn:
+		set(p.notes[chan * 128 + (m.val1 & 0x7f)], m.val2 & 0x7f);
+		break;
+	case xymidi::cmd::noteOff:
+		set(p.notes[chan * 128 + (m.val1 & 0x7f)], 0);
+		break;
+	case xymidi::cmd::ctrl:
+		set(p.cc[chan * 128 + (m.val1 & 0x7f)], m.val2 & 0x7f);
+		if (m.val1 == (uint8_t)xymidi::midi_ctrl::all_notes_off) {
+			for (std::size_t n = 0; n < 128; ++n) {
+				if (valueOf(p.notes[chan * 128 + n].load(std::memory_order_relaxed)) != 0) set(p.notes[chan * 128 + n], 0);
+			}
+		}
+		break;
+	case xymidi::cmd::prog:
+		set(p.program[chan], m.val1 & 0x7f);
+		break;
+	case xymidi::cmd::chanPress:
+		set(p.pressure[chan], m.val1 & 0x7f);
+		break;
+	case xymidi::cmd::bend:
+		set(p.bend[chan], static_cast<uint16_t>((m.val1 & 0x7f) | (m.val2 & 0x7f) << 7));
+		break;
+	default:
+		break;
+	}
+}
+
+template<typename T>
+void StateCache::setConfig(config_t<T>& c, const T& value)
+{
+	std::array<uint64_t, config_t<T>::nWords> words{};
+	std::memcpy(words.data(), &value, sizeof(T));
+	auto v = c.version.load(std::memory_order_relaxed);
+	do {
+		while (v & 1) v = c.version.load(std::memory_order_relaxed);
+	} while (!c.version.compare_exchange_weak(v, v + 1, std::memory_order_acquire, std::memory_order_relaxed));
+	std::atomic_thread_fence(std::memory_order_release);
+	for (std::size_t i = 0; i < words.size(); ++i) c.words[i].store(words[i], std::memory_order_relaxed);
+	set(c.changed, 0);
+	c.version.store(v + 2, std::memory_order_release);
+}
+
+/*!
+ * a consistent copy of a config
+ *  \return the change that set it, or 0 if it never was
+ */
+template<typename T>
+uint64_t StateCache::readConfig(const config_t<T>& c, T& value)
+{
+	std::array<uint64_t, config_t<T>::nWords> words;
+	uint32_t v;
+	uint64_t changed;
+	do {
+		do {
+			v = c.version.load(std::memory_order_acquire);
+		} while (v & 1);
+		changed = c.changed.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < words.size(); ++i) words[i] = c.words[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while (c.version.load(std::memory_order_relaxed) != v);
+	std::memcpy(&value, words.data(), sizeof(T));
+	return changeOf(changed);
+}
+
+template<typename T>
+void StateCache::configJson(json& j, const std::array<config_t<T>, nConfigs>& cs, uint64_t since)
+{
+	j = json::object();
+	for (std::size_t i = 0; i < nConfigs; ++i) {
+		if (changeOf(cs[i].changed.load(std::memory_order_relaxed)) <= since) continue;
+		T value;
+		if (readConfig(cs[i], value) > since) j[std::to_string(i)] = hexOf(&value, sizeof(T));
+	}
+}
+
+/*!
+ * everything that has changed since the given change, or everything there is for 0, as
+ *	{"changes": <the last change>, "ports": {"<port>": {"cc": [[<channel>, <controller>, <value>], ...], "notes": [[<channel>, <note>, <velocity>], ...],
+ *		"bend": [[<channel>, <value>], ...], "program": [...], "pressure": [...]}, ...},
+ *	 "config": {"button": {"<which>": "<hex>", ...}, "pedal": {...}, "xlrm8r": {...}}}
+ * a note with a velocity of 0 has been released. ask again with 'changes' for what's changed since. every change up to 'changes'
+ * is in this answer, and one made while we're reading may be as well, but is always in the next
+ */
+json StateCache::toJson(uint64_t since) const
+{
+	json j;
+	j["changes"] = changes();
+	j["ports"] = json::object();
+	for (std::size_t n = 0; n < nPorts; ++n) {
+		const auto& p = (*ports)[n];
+		json jp;
+		const auto add = [&jp](const char* name, json&& l) { if (!l.empty()) jp[name] = std::move(l); };
+		add("cc", entriesOf(p.cc, since));
+		add("notes", entriesOf(p.notes, since, true));
+		add("bend", entriesOf(p.bend, since));
+		add("program", entriesOf(p.program, since));
+		add("pressure", entriesOf(p.pressure, since));
+		if (!jp.is_null()) j["ports"][std::to_string(n)] = std::move(jp);
+	}
+	configJson(j["config"]["button"], configs->button, since);
+	configJson(j["config"]["pedal"], configs->pedal, since);
+	configJson(j["config"]["xlrm8r"], configs->xlrm8r, since);
+	return j;
+}
+
+/*!
+ * the midi state as messages, for a sink that only speaks midi to catch up with: every controller, program, pressure and bend
+ * that has been set, and every note held. the controllers go before the program, so a bank select comes before the program
+ * it picks from
+ */
+void StateCache::replayMidi(const std::function<void(msg_t&&)>& f) const
+{
+	for (std::size_t n = 0; n < nPorts; ++n) {
+		const auto& p = (*ports)[n];
+		const auto port = static_cast<uint8_t>(n);
+		for (uint8_t chan = 0; chan < nChannels; ++chan) {
+			uint64_t e;
+			for (uint8_t c = 0; c < 128; ++c) {
+				e = p.cc[chan * 128 + c].load(std::memory_order_relaxed);
+				if (e != 0) f(MidiMsg{ midi_t(xymidi::cmd::ctrl | chan, c, static_cast<uint8_t>(valueOf(e)), port) });
+			}
+			e = p.program[chan].load(std::memory_order_relaxed);
+			if (e != 0) f(MidiMsg{ midi_t(xymidi::cmd::prog | chan, static_cast<uint8_t>(valueOf(e)), 0, port) });
+			e = p.pressure[chan].load(std::memory_order_relaxed);
+			if (e != 0) f(MidiMsg{ midi_t(xymidi::cmd::chanPress | chan, static_cast<uint8_t>(valueOf(e)), 0, port) });
+			e = p.bend[chan].load(std::memory_order_relaxed);
+			if (e != 0) f(MidiMsg{ midi_t(xymidi::cmd::bend | chan, valueOf(e) & 0x7f, (valueOf(e) >> 7) & 0x7f, port) });
+			for (uint8_t note = 0; note < 128; ++note) {
+				e = p.notes[chan * 128 + note].load(std::memory_order_relaxed);
+				if (valueOf(e) != 0) f(MidiMsg{ midi_t(xymidi::cmd::noteOn | chan, note, static_cast<uint8_t>(valueOf(e)), port) });
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "message.h"
+#include "router.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <nlohmann/json_fwd.hpp>
+
+namespace xymsg {
+
+/*!
+ * where every controller, note and config stands, as the messages through the router left them, so a client that has just
+ * connected can catch up in one go instead of waiting for traffic. for each midi port we route separately there's every
+ * controller, the bend, program and channel pressure of each channel, and the notes held, and there's the last config for each
+ * button, pedal and xlrm8r.
+ * everything is kept in atomics, each value packed with the number of the change that set it, so the router updates it without
+ * a lock, and anyone can read it at any time. a reader asks for everything changed since the last change it saw, which is
+ * everything the first time, and the deltas after that. the last change a reader is told of is one that every earlier change is
+ * in place for, so racing writers can't leave one of theirs out of the deltas.
+ */
+class StateCache
+{
+public:
+	static constexpr std::size_t nChannels = 16;
+	static constexpr std::size_t nConfigs = 256;	//!< of each kind, by 'which'
+
+	StateCache();
+
+	void update(const msg_t& msg);
+	uint64_t changes() const;
+
+	nlohmann::json toJson(uint64_t since = 0) const;
+	void replayMidi(const std::function<void(msg_t&&)>& f) const;
+
+private:
+	/*!
+	 * a value, with the change that set it in the top 48 bits. 0 was never set
+	 */
+	using entry_t = std::atomic<uint64_t>;
+
+	struct port_t {
+		std::array<entry_t, nChannels * 128> cc;
+		std::array<entry_t, nChannels * 128> notes;	//!< velocity of the notes held, 0 once released
+		std::array<entry_t, nChannels> bend;
+		std::array<entry_t, nChannels> program;
+		std::array<entry_t, nChannels> pressure;
+	};
+
+	/*!
+	 * a config, copied in and out a word at a time under a sequence lock: the version is odd while it's being written, and a
+	 * reader that sees it change tries again
+	 */
+	template<typename T>
+	struct config_t {
+		static constexpr std::size_t nWords = (sizeof(T) + 7) / 8;
+		std::atomic<uint32_t> version;
+		entry_t changed;	//!< the change that last set it, as an entry with no value
+		std::array<std::atomic<uint64_t>, nWords> words;
+	};
+
+	struct configs_t {
+		std::array<config_t<config::button>, nConfigs> button;
+		std::array<config_t<config::pedal>, nConfigs> pedal;
+		std::array<config_t<config::xlrm8r>, nConfigs> xlrm8r;
+	};
+
+	void set(entry_t& e, uint16_t value);
+	void updateMidi(const midi_t& m);
+	template<typename T> void setConfig(config_t<T>& c, const T& value);
+	template<typename T> static uint64_t readConfig(const config_t<T>& c, T& value);
+	template<typename T> static void configJson(nlohmann::json& j, const std::array<config_t<T>, nConfigs>& cs, uint64_t since);
+
+	std::atomic<uint64_t> changeCount{ 0 };	//!< changes started, so the last one handed out
+	std::atomic<uint64_t> doneCount{ 0 };	//!< changes in place
+	mutable std::atomic<uint64_t> settled{ 0 };	//!< the last changes() found with none in flight
+	std::unique_ptr<std::array<port_t, nPorts>> ports;	//!< half a megabyte, so it lives on the heap
+	std::unique_ptr<configs_t> configs;
+};
+
+}
@@ -1,11 +1,12 @@
 #pragma once
 
 // TODO: ASAP find a better solution than this
-#include "locked/map.h"
-#include "locked/queue.h"
+#include "locked/expiring_map.h"
+#include "locked/ticket_queue.h"
 
 #include <cstdint>
 #include <memory>
+#include <string>
 
 #include <nlohmann/json.hpp>
 
@@ -38,17 +39,21 @@ struct cmd_t {
 };
 
 /*!
- * base class for cmd results
+ * base class for cmd results. the result is serialized as it's stored, so it can be handed back to a client any number of ways
+ * without another dump, and takes a fraction of the memory of the json DOM
  */
 struct result_t {
-	result_t(cmd_id i, const nlohmann::json r) : id(i), result(std::move(r)) {}
+	result_t(cmd_id i, const nlohmann::json& r) : id(i), result(r.dump()) {}
 	result_t() : id(0) {}
 
+	/*! \return roughly what we cost, for the results store memory cap */
+	std::size_t bytes() const { return sizeof(result_t) + result.capacity(); }
+
 	cmd_id id = 0;
-	nlohmann::json result;
+	std::string result; //!< json text
 };
 
-using cmdq_t = locked::queue<std::shared_ptr<cmd_t>>;
-using results_t = locked::map<uint32_t, result_t>;
+using cmdq_t = locked::ticket_queue<cmd_id, std::shared_ptr<cmd_t>>;
+using results_t = locked::expiring_map<cmd_id, result_t>;
 
 };
\ No newline at end of file
@@ -1,8 +1,13 @@
 #include "wsapi_handler.h"
 
+#include "clock_engine.h"
+#include "sequencer.h"
+#include "journal.h"
+#include "state_cache.h"
 #include "jsonutil.h"
 #include "wsapi_cmd.h"
 
+#include <chrono>
 #include <functional>
 
 #include <nlohmann/json.hpp>
@@ -18,7 +23,7 @@ std::atomic<wsapi::cmd_id> WSApiHandler::cmdid = 0;
 
 //! essential data for describing an api command
 struct api_t {
-	std::function<json(WSApiHandler*, const json&)> immediateProcessor;
+	std::function<std::string(WSApiHandler*, const json&)> immediateProcessor;
 	std::function<std::shared_ptr<wsapi::cmd_t>(const std::string&, wsapi::cmd_id, const json&)> workQueueFactory;
 	bool urgent;
 };
@@ -28,14 +33,21 @@ struct api_t {
 std::unordered_map<std::string, api_t> api {
 //	{"ping",		{nullptr,				&PingWork::create,				true}},
 	{"get",			{&WSApiHandler::getCmd,	nullptr,						false}},
-	{"list",		{&WSApiHandler::listCmd,	nullptr,						false}}
+	{"list",		{&WSApiHandler::listCmd,	nullptr,						false}},
+	{"stats",		{&WSApiHandler::statsCmd,	nullptr,						false}},
+	{"routes",		{&WSApiHandler::routesCmd,	nullptr,						false}},
+	{"midi",		{&WSApiHandler::midiCmd,	nullptr,						false}},
+	{"sysx",		{&WSApiHandler::sysxCmd,	nullptr,						false}},
+	{"clock",		{&WSApiHandler::clockCmd,	nullptr,						false}},
+	{"state",		{&WSApiHandler::stateCmd,	nullptr,						false}},
+	{"seq",			{&WSApiHandler::seqCmd,	nullptr,						false}}
 };
 // clang-format on
 
 /*!
  */
-WSApiHandler::WSApiHandler(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, wsapi::cmdq_t& _cmdq, wsapi::results_t& _results)
-	: spiInQ(_spiInQ), oscInQ(_oscInQ), cmdq(_cmdq), results(_results) {}
+WSApiHandler::WSApiHandler(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, wsapi::cmdq_t& _cmdq, wsapi::results_t& _results, xymsg::Router& _router)
+	: spiInQ(_spiInQ), oscInQ(_oscInQ), cmdq(_cmdq), results(_results), router(_router) {}
 
 /*!
  * main processing hook:
@@ -49,36 +61,40 @@ std::pair<bool, std::string> WSApiHandler::process(const std::string& request_s)
 	auto urgent = !jutil::opt_s(request, "urgent", "").empty();
 	info("JSONHandler::process('{}')", cmd);
 	auto ait = api.find(cmd);
-	if (ait == api.end()) return {true, jutil::errorJSON(fmt::format("Command '{}' not implemented.", cmd))};
+	if (ait == api.end()) return {true, jutil::errorJSON(fmt::format("Command '{}' not implemented.", cmd)).dump()};
 
 	json response;
 	try {
 		auto api_inf = ait->second;
 		if (api_inf.immediateProcessor) {
-			response = api_inf.immediateProcessor(this, request);
+			// immediate processors may splice stored results straight into their response, so they hand back serialized json
+			return {true, api_inf.immediateProcessor(this, request)};
 		} else {
 			auto id = ++cmdid;
 			auto work = api_inf.workQueueFactory(cmd, id, request);
 			auto result = work->process();
 			if (result.first == wsapi::cmd_t::status::CMD_SCHEDULED) {
+				if (journal) journal->recordCmd(request_s);
 				if (urgent || api_inf.urgent) {
-					cmdq.push_front(std::move(work));
+					cmdq.push_front(id, std::move(work));
 				} else {
-					cmdq.push(std::move(work));
+					cmdq.push(id, std::move(work));
 				}
 				debug("queueing command {} with id {}", cmd, id);
 			} else {
-				results.insert(id, wsapi::result_t(id, result));
+				wsapi::result_t r(id, result.second);
+				const auto bytes = r.bytes();
+				results.insert(id, std::move(r), bytes);
 				debug("storing immediate results for command {} with id {}", cmd, id);
 			}
 			response["id"] = id;
 		}
 	} catch (const nlohmann::json::type_error& e) {
 		// from here, probably a bad conversion
-		return jutil::errorJSON(fmt::format("JSON type error, {}", e.what()));
+		return {true, jutil::errorJSON(fmt::format("JSON type error, {}", e.what())).dump()};
 	} catch (const nlohmann::json::out_of_range& e) {
 		// probably from json attempt to access a non-existent field
-		return jutil::errorJSON(fmt::format("JSON out of range, {}", e.what()));
+		return {true, jutil::errorJSON(fmt::format("JSON out of range, {}", e.what())).dump()};
 	}
 
 	auto serialized = response.dump();
@@ -90,51 +106,230 @@ std::pair<bool, std::string> WSApiHandler::process(const std::string& request_s)
 /*!
  * handle a 'get' command.
  *  \param json request we expect exactly 1 request parameter, 'id' which corresponds to the id of a previously queued request
+ *  \return the serialized response. a completed result is spliced in as it was stored, without another dump
  */
-json WSApiHandler::getCmd(json request)
+std::string WSApiHandler::getCmd(json request)
 {
 	const wsapi::cmd_id id = std::stoul(jutil::need_s(request, "id"));
 	debug("getCmd({})", id);
 	json response;
-	if (id == 0) return jutil::errorJSON("Bad request id 0");
+	if (id == 0) return jutil::errorJSON("Bad request id 0").dump();
 	auto result = results.fetch(id);
 	if (result.second) {
-		response["state"] = "done";
-		response["resp"] = result.first.result;
+		return R"({"state":"done","resp":)" + result.first.result + "}";
 	} else {
-		auto qorder = cmdq.find_qorder([id](const std::shared_ptr<wsapi::cmd_t>& v) -> bool { return v->id == id; });
-		if (qorder >= 0) {
+		auto qorder = cmdq.find(id);
+		if (qorder.first == wsapi::cmdq_t::state::queued) {
 			response["state"] = "enqueued";
-			response["pos"] = qorder;
+			response["pos"] = qorder.second;
+		} else if (qorder.first == wsapi::cmdq_t::state::running) {
+			response["state"] = "running";
 		} else {
-			return jutil::errorJSON(fmt::format("Requested id, {}, is neither queued or completed", id));
+			return jutil::errorJSON(fmt::format("Requested id, {}, is neither queued or completed", id)).dump();
 		}
 	}
 
-	return response;
+	return response.dump();
 }
 
 /*!
  * handle 'list' api command.
  * an instant commant that takes no parameters, and dumps the contensts of the current queues and maps
  */
-json WSApiHandler::listCmd(json request)
+std::string WSApiHandler::listCmd(json request)
 {
-	json response;
-	json workList;
-	json resultList;
+	json workList = json::object();
+	std::string resultList;
 
 	cmdq.foreach([&workList](const std::shared_ptr<wsapi::cmd_t>& v) { workList[std::to_string(v->id)] = v->toJson(); });
-	results.foreach([&resultList](const wsapi::cmd_id& k, const wsapi::result_t& v) { resultList[std::to_string(k)] = v.result; });
+	results.foreach([&resultList](const wsapi::cmd_id& k, const wsapi::result_t& v) {
+		if (!resultList.empty()) resultList += ',';
+		resultList += '"' + std::to_string(k) + R"(":)" + v.result;
+	});
+
+	return R"({"requests":)" + workList.dump() + R"(,"responses":{)" + resultList + "}}";
+}
+
+/*!
+ * handle 'stats' api command.
+ * an instant command that takes no parameters, and reports depth, throughput and dwell times for each of the hub's queues, and
+ * the occupancy of its message pools
+ */
+std::string WSApiHandler::statsCmd(json request)
+{
+	if (!statsSource) return jutil::errorJSON("No stats available").dump();
+	return statsSource().dump();
+}
+
+/*!
+ * handle 'routes' api command.
+ * an instant command that reports the routing matrix. with a 'routes' parameter, a list of routes in the same form, the matrix is
+ * replaced first
+ */
+std::string WSApiHandler::routesCmd(json request)
+{
+	if (request.contains("routes")) {
+		try {
+			router.setRoutes(xymsg::Router::parseRoutes(request["routes"]));
+		} catch (const std::invalid_argument& e) {
+			return jutil::errorJSON(e.what()).dump();
+		}
+	}
+	json response;
+	response["routes"] = xymsg::Router::toJson(router.routes());
+	return response.dump();
+}
+
+namespace {
+
+/*!
+ * bytes from a string of hex, spaces optional
+ *  \return false if the string isn't all hex pairs
+ */
+bool parseHex(const std::string& hex, std::string& bytes)
+{
+	auto nibble = [](char c) -> int {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	};
+	bytes.reserve(hex.size() / 2);
+	for (std::size_t i = 0; i < hex.size(); ) {
+		if (hex[i] == ' ') {
+			++i;
+			continue;
+		}
+		const auto hi = nibble(hex[i]);
+		const auto lo = i + 1 < hex.size() ? nibble(hex[i + 1]) : -1;
+		if (hi < 0 || lo < 0) return false;
+		bytes.push_back(static_cast<char>(hi << 4 | lo));
+		i += 2;
+	}
+	return true;
+}
+
+}
+
+/*!
+ * handle 'midi' api command.
+ * an instant command that sends midi, given as 'data', a string of hex bytes, spaces optional, holding one or more short messages,
+ * to an optional midi 'port'. with 'delay_us', it is sent that many microseconds from now, on the midi out scheduler
+ */
+std::string WSApiHandler::midiCmd(json request)
+{
+	std::string bytes;
+	if (!parseHex(jutil::need_s(request, "data"), bytes)) return jutil::errorJSON("Bad hex in midi").dump();
+	const auto port = static_cast<uint8_t>(jutil::opt_ull(request, "port", 0));
+	const auto delay = std::chrono::microseconds(jutil::opt_ull(request, "delay_us", 0));
+	const auto due = std::chrono::steady_clock::now() + delay;
+	std::size_t sent = 0;
+	for (std::size_t i = 0; i < bytes.size(); ) {
+		const auto status = static_cast<uint8_t>(bytes[i]);
+		if (!xymidi::isCmdByte(status) || status == (uint8_t)xymidi::cmd::sysxStart) {
+			return jutil::errorJSON(fmt::format("Expected a status byte at {} in midi. send sysex with 'sysx'", i)).dump();
+		}
+		std::size_t n = 1;
+		while (i + n < bytes.size() && n < 3 && !xymidi::isCmdByte(static_cast<uint8_t>(bytes[i + n]))) ++n;
+		xymsg::MidiMsg mmsg;
+		mmsg.midi = xymidi::msg(status, n > 1 ? static_cast<uint8_t>(bytes[i + 1]) : 0, n > 2 ? static_cast<uint8_t>(bytes[i + 2]) : 0, port);
+		xymsg::msg_t msg(mmsg);
+		if (delay.count() > 0) msg.setDue(due);
+		router.route(xymsg::source::ws, std::move(msg));
+		++sent;
+		i += n;
+	}
+	json response;
+	response["sent"] = sent;
+	return response.dump();
+}
+
+/*!
+ * handle 'sysx' api command.
+ * an instant command that sends a sysex, given as 'data', a string of hex bytes from the f0 to the f7, spaces optional, to an
+ * optional midi 'port'. it goes through the router in chunks, like any other sysex, from the ws source
+ */
+std::string WSApiHandler::sysxCmd(json request)
+{
+	std::string bytes;
+	if (!parseHex(jutil::need_s(request, "data"), bytes)) return jutil::errorJSON("Bad hex in sysex").dump();
+	const auto port = static_cast<uint8_t>(jutil::opt_ull(request, "port", 0));
+	if (bytes.size() < 2 || (uint8_t)bytes.front() != (uint8_t)xymidi::cmd::sysxStart || (uint8_t)bytes.back() != (uint8_t)xymidi::cmd::sysxEnd) {
+		return jutil::errorJSON("A sysex should start with f0 and end with f7").dump();
+	}
+
+	xymsg::sysx_builder sysx;
+	auto emit = [this](xymsg::msg_t&& msg) { router.route(xymsg::source::ws, std::move(msg)); };
+	sysx.start(port, emit);
+	sysx.append(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(), emit);
+	sysx.finish(emit);
+	if (sysx.droppedCount() > 0) return jutil::errorJSON("Out of sysex buffers, the sysex was cut short").dump();
+	json response;
+	response["sent"] = bytes.size();
+	return response.dump();
+}
+
+/*!
+ * handle 'clock' api command.
+ * an instant command that reports the clock's tempo, transport, jitter and drift. 'sync' (off, internal or external), 'tempo' in
+ * bpm, 'song_pos' in sixteenths and 'transport' (start, stop or continue) change it first, in that order
+ */
+std::string WSApiHandler::clockCmd(json request)
+{
+	if (!clock) return jutil::errorJSON("No clock available").dump();
+	try {
+		if (request.contains("sync")) clock->setSync(parseClockSync(jutil::need_s(request, "sync")));
+		if (request.contains("tempo")) clock->setTempo(request["tempo"].get<float>());
+		if (request.contains("song_pos")) clock->setSongPos(static_cast<uint16_t>(jutil::opt_ull(request, "song_pos", 0)));
+		const auto transport = jutil::opt_s(request, "transport", "");
+		if (transport == "start") {
+			clock->startTransport();
+		} else if (transport == "stop") {
+			clock->stopTransport();
+		} else if (transport == "continue") {
+			clock->continueTransport();
+		} else if (!transport.empty()) {
+			return jutil::errorJSON(fmt::format("Unknown transport '{}'", transport)).dump();
+		}
+	} catch (const std::invalid_argument& e) {
+		return jutil::errorJSON(e.what()).dump();
+	} catch (const json::exception& e) {
+		return jutil::errorJSON(e.what()).dump();
+	}
+	return ClockEngine::toJson(clock->stats()).dump();
+}
 
-	response["requests"] = workList;
-	response["responses"] = resultList;
-	return response;
+/*!
+ * handle 'state' api command.
+ * an instant command that reports where every controller, note and config stands. a client catching up asks with no parameters
+ * for everything, then with 'since', the 'changes' from the last answer, for only what has changed since
+ */
+std::string WSApiHandler::stateCmd(json request)
+{
+	if (!state) return jutil::errorJSON("No state available").dump();
+	return state->toJson(jutil::opt_ull(request, "since", 0)).dump();
+}
+
+/*!
+ * handle 'seq' api command.
+ * an instant command that reports the sequencer's patterns, chain and lateness. 'patterns', 'chain' and 'clear' load patterns and
+ * the chain to play them in first, as for Sequencer::load(). the sequencer plays with the clock's transport
+ */
+std::string WSApiHandler::seqCmd(json request)
+{
+	if (!sequencer) return jutil::errorJSON("No sequencer available").dump();
+	try {
+		if (request.contains("patterns") || request.contains("chain") || request.contains("clear")) sequencer->load(request);
+	} catch (const std::invalid_argument& e) {
+		return jutil::errorJSON(e.what()).dump();
+	}
+	return Sequencer::toJson(sequencer->stats()).dump();
 }
 
 void WSApiHandler::debugDump()
 {
 	debug("api handler, current job id {}", (int)cmdid);
-	results.foreach([](uint32_t k, wsapi::result_t v) { debug("> result id {}", k); });
+	debug("results store {} bytes, {} expired, {} evicted", results.bytes(), results.expiredCount(), results.evictedCount());
+	results.foreach([](uint32_t k, const wsapi::result_t& v) { debug("> result id {}", k); });
 	cmdq.foreach([](const std::shared_ptr<wsapi::cmd_t>& v) { debug("> work id {}", v->id); });
 }
@@ -2,10 +2,16 @@
 
 #include "wsapi_cmd.h"
 #include "message.h"
+#include "router.h"
 
 #include <atomic>
+#include <functional>
 #include <tuple>
 
+class ClockEngine;
+class Sequencer;
+namespace xymsg { class StateCache; class Journal; }
+
 /*!
  * \brief does the processing of web socket commands, json or otherwise, and returns an appropriate response. anything that can be handled without delay is handled directly
  *  and anything that will delay the io thread will be submitted to a worker
@@ -13,12 +19,25 @@
 class WSApiHandler
 {
 public:
-	WSApiHandler(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, wsapi::cmdq_t& _cmdQ, wsapi::results_t& results);
+	WSApiHandler(xymsg::q_t &_spiInQ, xymsg::q_t &_oscInQ, wsapi::cmdq_t& _cmdQ, wsapi::results_t& results, xymsg::Router& router);
 
 	std::pair<bool, std::string> process(const std::string & request);
 
-	nlohmann::json getCmd(nlohmann::json request);
-	nlohmann::json listCmd(nlohmann::json request);
+	std::string getCmd(nlohmann::json request);
+	std::string listCmd(nlohmann::json request);
+	std::string statsCmd(nlohmann::json request);
+	std::string routesCmd(nlohmann::json request);
+	std::string midiCmd(nlohmann::json request);
+	std::string sysxCmd(nlohmann::json request);
+	std::string clockCmd(nlohmann::json request);
+	std::string stateCmd(nlohmann::json request);
+	std::string seqCmd(nlohmann::json request);
+
+	void setStatsSource(std::function<nlohmann::json()> source) { statsSource = std::move(source); }
+	void setClock(ClockEngine* _clock) { clock = _clock; }
+	void setSequencer(Sequencer* _sequencer) { sequencer = _sequencer; }
+	void setStateCache(const xymsg::StateCache* _state) { state = _state; }
+	void setJournal(xymsg::Journal* _journal) { journal = _journal; }
 
 	void debugDump();
 
@@ -27,5 +46,11 @@ private:
 	xymsg::q_t& oscInQ;
 	wsapi::cmdq_t& cmdq;
 	wsapi::results_t& results;
+	xymsg::Router& router;
+	std::function<nlohmann::json()> statsSource;	//!< the hub's queue and pool stats
+	ClockEngine* clock = nullptr;	//!< the hub's, which outlives us
+	Sequencer* sequencer = nullptr;	//!< likewise
+	const xymsg::StateCache* state = nullptr;	//!< likewise
+	xymsg::Journal* journal = nullptr;	//!< records the commands that go to the command queue, if we're recording
 	static std::atomic<wsapi::cmd_id> cmdid;
 };
@@ -11,6 +11,8 @@ using spdlog::error;
 using spdlog::debug;
 using spdlog::warn;
 
+constexpr std::size_t maxCmdBatch = 16; //!< most commands we take off the queue at a time
+
 /*!
  * \class JSApiWorker
  *	mainly here to do things that can't be done immediately in the io thread and which would unduly block that, in particular
@@ -42,6 +44,7 @@ void WSApiWorker::stop()
 {
 	if (isRunning.exchange(false)) {
 		cmdq.disableWait();
+		cmdq.enable(false);
 		if (myThread.joinable()) myThread.join();
 	}
 }
@@ -51,32 +54,33 @@ void WSApiWorker::stop()
  */
 void WSApiWorker::runner()
 {
+	cmdq.enable();
 	cmdq.enableWait();
+	std::vector<std::shared_ptr<wsapi::cmd_t>> batch;
+	batch.reserve(maxCmdBatch);
 	while (isRunning) {
-		auto optWork = cmdq.front();
-		if (optWork.second) {
-			// specifically make a new reference to the shared_ptr to work with, so we can leave the work at the top of q
-			// workRef should still be valid even if it is no longer front ("ping" is pushed to front, not end of q)
-			// work in process should still be marked as in queue in case we get polled while in progress (it would be highly
-			// embarassing for a "get" to not be able to find an item just because we were working on it)
-			auto& work = optWork.first;
-			auto currentResultId = work->id;
-
-			try {
-				auto res = work->process();
-				auto &r = res.second;
-				debug("processed!");
-				if (res.first == wsapi::cmd_t::status::CMD_ERROR) {
-					debug("JSApiWorker({}) fails with error message {}", currentResultId, r["error"].get<std::string>());
+		// the queue marks the batch as running until we report each command done, so a "get" while we're working on it still
+		// finds it (it would be highly embarassing for a "get" to not be able to find an item just because we were working on it)
+		if (cmdq.drain(batch, maxCmdBatch) > 0) {
+			for (const auto& work : batch) {
+				auto currentResultId = work->id;
+				try {
+					auto res = work->process();
+					auto &r = res.second;
+					debug("processed!");
+					if (res.first == wsapi::cmd_t::status::CMD_ERROR) {
+						debug("JSApiWorker({}) fails with error message {}", currentResultId, r["error"].get<std::string>());
+					}
+					wsapi::result_t result(currentResultId, r);
+					const auto bytes = result.bytes();
+					results.insert(currentResultId, std::move(result), bytes);
+				} catch (const std::exception& e) {
+					error("JSApiWorker() gets exception: {}", e.what());
 				}
-				results.insert(currentResultId, wsapi::result_t(currentResultId, r));
-			} catch (const std::exception& e) {
-				error("JSApiWorker() gets exception: {}", e.what());
+				// we've either done a thing, or had an exception. the result is in place before we stop reporting it as running
+				cmdq.done(currentResultId);
 			}
-			// we've either done a thing, or had an exception
-			// so now take the item from the queue. as we push to either end of the queue, our front element from before
-			// is not necessarily still the front element, but the optWork ref will still be valid
-			cmdq.remove(optWork.first);
+			batch.clear();
 		} else {
 			if (isRunning && !cmdq.waitEnabled()) std::this_thread::sleep_for(10us);
 		}
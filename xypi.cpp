@@ -1,6 +1,7 @@
 #include "xypi_hub.h"
 
 #include <boost/program_options.hpp>
+#include <nlohmann/json.hpp>
 #include <iostream>
 #include <spdlog/spdlog.h>
 #include <stdlib.h>
@@ -9,6 +10,12 @@
 using spdlog::info;
 using spdlog::debug;
 
+#ifdef WIRING_PI
+constexpr const char* defaultSpi = "wiringpi";	//!< on the pi, we talk to the duino
+#else
+constexpr const char* defaultSpi = "none";
+#endif
+
 /*!
  * sets the logging level to a value from 0 (logging completely off) to 4 (full debug nonsense)
  */
@@ -99,6 +106,29 @@ int main(int argc, char** argv)
 		("osc_dst_port,p",	options::value<uint16_t>()->default_value(57120),			"set osc target port")
 		("osc_rcv_port,q",	options::value<uint16_t>()->default_value(5505),			"set osc listening port")
 		("ws_port,r",		options::value<uint16_t>()->default_value(8080),			"set ws listening port")
+		("spi_q",			options::value<std::string>()->default_value("512:coalesce"),	"set spi out queue bounds, for each of its priority lanes, as <capacity>[:<policy>[:<timeout ms>]]")
+		("osc_q",			options::value<std::string>()->default_value("1024:drop_oldest"),	"set osc out queue bounds, per lane. policy is drop_oldest, drop_newest, block or coalesce")
+		("midi_q",			options::value<std::string>()->default_value("1024:drop_oldest"),	"set midi out queue bounds, per lane. a capacity of 0 is unbounded")
+		("lanes",			options::value<std::string>()->default_value(""),			"move message types between priority lanes, as <type>=<lane>,...")
+		("lane_policy",		options::value<std::string>()->default_value("strict"),		"set lane dequeue policy: strict or weighted:<w0>,<w1>,...")
+		("coalesce",		options::value<std::string>()->default_value(""),			"send each controller to a sink at most so often, last value wins, as <sink>=<updates/s>,...")
+		("routes",			options::value<std::string>()->default_value(""),			"replace the default routes with a json list of {\"from\": <source>, \"to\": [<sink>...], ...}")
+		("result_ttl",		options::value<uint32_t>()->default_value(300),				"set how long ws api results are kept, in seconds")
+		("result_mem",		options::value<uint32_t>()->default_value(4096),			"set memory cap for ws api results, in kB. 0 is unlimited")
+		("midi_port_q",		options::value<std::string>()->default_value("256:drop_oldest"),	"set bounds on each lane of each midi output port's queue. block holds up the other ports")
+		("midi_scan",		options::value<uint32_t>()->default_value(2000),			"set how often we look for midi ports coming and going, in ms. 0 only looks at startup")
+		("alsa_seq",																	"use the alsa sequencer for midi, rather than rtmidi (if built with ALSA_MIDI)")
+		("clock",			options::value<std::string>()->default_value("off"),		"set where the midi clock comes from: off, internal or external (locked to clock coming in)")
+		("tempo",			options::value<float>()->default_value(120),				"set the internal clock's tempo, in bpm")
+		("journal",			options::value<std::string>()->default_value(""),			"record all the hub's traffic to a journal file")
+		("journal_size",	options::value<uint32_t>()->default_value(64),				"set the most the journal may hold, in MB")
+		("replay",			options::value<std::string>()->default_value(""),			"play a journal back into the hub")
+		("replay_speed",	options::value<double>()->default_value(1),				"set how fast to play the journal back. 2 is twice as fast, 0 as fast as we can")
+		("spi",				options::value<std::string>()->default_value(defaultSpi),		"set how we get to the duino: none, wiringpi (the pi's spi port) or sim (a duino simulated in process)")
+		("spi_hz",			options::value<uint32_t>()->default_value(1000000),			"set the spi clock rate, in Hz")
+		("spi_frame",		options::value<uint32_t>()->default_value(0),				"set the most bytes in an spi transfer. 0 is what the duino takes as standard")
+		("spi_latency",		options::value<uint32_t>()->default_value(20),				"set the simulated duino's overhead on each transfer, in us")
+		("spi_echo",																	"have the simulated duino send the midi it gets back")
 		("threads,t",		options::value<uint16_t>()->default_value(1), 				"set io thread count (0 uses the default hardware concurrency)")
 		("log-level,l",		options::value<uint16_t>()->default_value(4),				"set log level from 0 (off) to 4 (debug) and 5 (ridiculous)")
 		;
@@ -116,6 +146,45 @@ int main(int argc, char** argv)
 	auto oscDstPort = vars["osc_dst_port"].as<uint16_t>();
 	auto oscRcvPort = vars["osc_rcv_port"].as<uint16_t>();
 	auto wsPort = vars["ws_port"].as<uint16_t>();
+	queue_config_t qConfig;
+	midi_config_t mConfig;
+	clock_config_t cConfig;
+	spi_config_t sConfig;
+	try {
+		qConfig.spiIn = locked::parseBounds(vars["spi_q"].as<std::string>());
+		qConfig.oscIn = locked::parseBounds(vars["osc_q"].as<std::string>());
+		qConfig.midiOut = locked::parseBounds(vars["midi_q"].as<std::string>());
+		mConfig.portQ = locked::parseBounds(vars["midi_port_q"].as<std::string>());
+		qConfig.lanes = xymsg::parseLaneMap(vars["lanes"].as<std::string>());
+		qConfig.lanePolicy = locked::parseLanePolicy(vars["lane_policy"].as<std::string>());
+		qConfig.coalesce = xymsg::parseCoalesce(vars["coalesce"].as<std::string>());
+		cConfig.sync = parseClockSync(vars["clock"].as<std::string>());
+		sConfig.backend = parseSpiBackend(vars["spi"].as<std::string>());
+		const auto routes = vars["routes"].as<std::string>();
+		if (!routes.empty()) {
+			qConfig.routes = xymsg::Router::parseRoutes(nlohmann::json::parse(routes, nullptr, false));
+		}
+	} catch (const std::invalid_argument& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	results_config_t rConfig;
+	rConfig.ttl = std::chrono::seconds(vars["result_ttl"].as<uint32_t>());
+	rConfig.maxBytes = static_cast<std::size_t>(vars["result_mem"].as<uint32_t>()) * 1024;
+	mConfig.alsaSeq = vars.count("alsa_seq") > 0;
+	mConfig.scanInterval = std::chrono::milliseconds(vars["midi_scan"].as<uint32_t>());
+	mConfig.lanes = qConfig.lanes;
+	mConfig.lanePolicy = qConfig.lanePolicy;
+	cConfig.tempo = vars["tempo"].as<float>();
+	journal_config_t jConfig;
+	jConfig.record = vars["journal"].as<std::string>();
+	jConfig.capacity = static_cast<std::size_t>(vars["journal_size"].as<uint32_t>()) << 20;
+	jConfig.replay = vars["replay"].as<std::string>();
+	jConfig.speed = vars["replay_speed"].as<double>();
+	sConfig.clockHz = vars["spi_hz"].as<uint32_t>();
+	if (vars["spi_frame"].as<uint32_t>() > 0) sConfig.frameLen = vars["spi_frame"].as<uint32_t>();
+	sConfig.latency = std::chrono::microseconds(vars["spi_latency"].as<uint32_t>());
+	sConfig.echo = vars.count("spi_echo") > 0;
 	auto threadCount = vars["threads"].as<uint16_t>();
 	if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
 	auto logLevel = vars["log-level"].as<uint16_t>();
@@ -123,8 +192,13 @@ int main(int argc, char** argv)
 
 	info("starting xypi hub {}", std::string("a string"));
 
-	XypiHub xypi(oscDstAddr, oscDstPort, oscRcvPort, wsPort, threadCount);
-	xypi.run();
+	try {
+		XypiHub xypi(oscDstAddr, oscDstPort, oscRcvPort, wsPort, qConfig, rConfig, mConfig, cConfig, jConfig, sConfig, threadCount);
+		xypi.run();
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
 #endif
 	return 0;
 }
\ No newline at end of file
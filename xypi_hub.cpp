@@ -3,12 +3,18 @@
 #include "osc_handler.h"
 #include "osc_server.h"
 #include "osc_worker.h"
+#include "pi_spi.h"
 #include "wsapi_handler.h"
 #include "wsapi_worker.h"
 #include "ws_server.h"
 
 #include "spdlog/spdlog.h"
 
+#include <csignal>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
 using spdlog::info;
 using spdlog::debug;
 
@@ -21,41 +27,96 @@ using spdlog::debug;
 /*!
  * create our hub
  *  \param serverPort uint16_t what is says on the box
+ *	\param qConfig queue_config_t capacity, overflow policy, priority lanes, routes and controller rates for the spi, osc and midi queues
+ *	\param rConfig results_config_t lifetime and memory cap for ws api results
+ *	\param mConfig midi_config_t how we drive the midi ports, and the bounds on each output port's queue
+ *	\param cConfig clock_config_t where the hub's midi clock comes from, and its tempo
+ *	\param jConfig journal_config_t journals to record the hub's traffic to, and to play back into it
+ *	\param sConfig spi_config_t how we get to the duino: the pi's spi port, a simulated duino, or not at all
+ *  \throws std::system_error or std::invalid_argument if a journal or the spi port can't be opened
  *	\param threadCount uint16_t number of threads to launch. if 0, we'll make a reasonable estimate
  */
-XypiHub::XypiHub(std::string dst_osc_adr, uint16_t dst_osc_prt, uint16_t rcv_osc_port, uint16_t ws_port, uint16_t threadCount)
-	: threadCount(threadCount > 0 ? threadCount : 1)
+XypiHub::XypiHub(std::string dst_osc_adr, uint16_t dst_osc_prt, uint16_t rcv_osc_port, uint16_t ws_port,
+		const queue_config_t& qConfig, const results_config_t& rConfig, const midi_config_t& mConfig, const clock_config_t& cConfig, const journal_config_t& jConfig,
+		const spi_config_t& sConfig, uint16_t threadCount)
+	: statsSignal(ioService, SIGINT, SIGTERM), router(oscInQ, spiInQ, midiOutQ),
+		coalescer(oscInQ, spiInQ, midiOutQ, qConfig.coalesce), sequencer(router), threadCount(threadCount > 0 ? threadCount : 1)
 {
 	info("Xypi servers running on {} threads: OSC server on port {}, WS server on port {}.", threadCount, rcv_osc_port, ws_port);
-	oscParser = std::make_shared<oscapi::Processor>(spiInQ);
+	spiInQ.setBounds(qConfig.spiIn, xymsg::coalesceKey);
+	oscInQ.setBounds(qConfig.oscIn, xymsg::coalesceKey);
+	midiOutQ.setBounds(qConfig.midiOut, xymsg::coalesceKey);
+	for (auto q : { &spiInQ, &oscInQ, &midiOutQ }) {
+		q->setClassifier(qConfig.lanes);
+		q->setPolicy(qConfig.lanePolicy);
+	}
+	router.setRoutes(qConfig.routes);
+	router.setCoalescer(&coalescer);
+	router.setStateCache(&state);
+	if (!jConfig.record.empty()) {
+		journal = std::make_unique<xymsg::Journal>(jConfig.record, jConfig.capacity);
+		router.setJournal(journal.get());
+	}
+	results.configure(rConfig.ttl, rConfig.maxBytes);
+#ifdef SIGUSR1
+	statsSignal.add(SIGUSR1);
+#endif
+	oscParser = std::make_shared<oscapi::Processor>(router);
+	oscParser->setStateRequest([this]() {
+		// past oscInQ: the whole state at once would overrun its lanes, and be dropped or crowd out what's live
+		std::vector<xymsg::msg_t> msgs;
+		state.replayMidi([&msgs](xymsg::msg_t&& msg) { msgs.push_back(std::move(msg)); });
+		oscServer->send_messages(msgs);
+	});
 	oscServer = std::make_unique<OSCServer>(ioService, rcv_osc_port, oscParser);
 	oscServer->set_current_destination(dst_osc_adr, dst_osc_prt);
-	oscWorker = std::make_unique<OSCWorker>(*oscServer.get(), oscInQ);
+	oscWorker = std::make_unique<OSCWorker>(ioService, *oscServer.get(), oscInQ);
 
 	auto const ws_address = asio::ip::make_address("ws:://localhost");
 	auto const ws_endpoint = tcp::endpoint(ws_address, ws_port);
-	wsapiHandler = std::make_shared<WSApiHandler>(spiInQ, oscInQ, cmdQ, wsapi::results_t()); // TODO: really not sure what to do with these results
+	wsapiHandler = std::make_shared<WSApiHandler>(spiInQ, oscInQ, cmdQ, results, router);
+	wsapiHandler->setStatsSource([this]() { return stats(); });
 	wsServer = std::make_unique<WSServer>(ioService, ws_endpoint, wsapiHandler);
-	wsapiWorker = std::make_unique<WSApiWorker>(cmdQ, wsapi::results_t());
+	wsapiWorker = std::make_unique<WSApiWorker>(cmdQ, results);
+
+	midiWorker = std::make_unique<MidiWorker>(ioService, router, midiOutQ, mConfig);
+	if (auto transport = SpiTransport::create(sConfig)) {
+		piSpi = std::make_unique<PiSpi>(spiInQ, router, std::move(transport), sConfig.frameLen);
+	}
 
-	midiWorker = std::make_unique<MidiWorker>(spiInQ, oscInQ, midiOutQ);
+	clockEngine = std::make_unique<ClockEngine>(router, cConfig);
+	router.setClockTap([this](xymsg::source from, const xymsg::msg_t& msg) { return clockEngine->tap(from, msg); });
+	clockEngine->setTickListener([this](const ClockEngine::tick_t& tick) { sequencer.onTick(tick); });
+	wsapiHandler->setClock(clockEngine.get());
+	wsapiHandler->setSequencer(&sequencer);
+	wsapiHandler->setStateCache(&state);
+	wsapiHandler->setJournal(journal.get());
+	if (!jConfig.replay.empty()) {
+		replay = std::make_unique<xymsg::JournalReplay>(jConfig.replay, router, jConfig.speed, [this](const std::string& request) { wsapiHandler->process(request); });
+	}
 }
 
 XypiHub::~XypiHub() = default;
 
 /*!
- * sets up the server, starts the worker thread, and runs the io context on a thread pool.
+ * sets up the server, attaches the osc worker to the io context, starts the ws api worker thread, and runs the io context on a thread pool.
  * does not return unless we've been specifically cancelled.
  */
 void XypiHub::run()
 {
 	spiInQ.disableWait();
-	oscInQ.enableWait();
 	cmdQ.enableWait();
 	
+	coalescer.run();
 	oscServer->start();
 	oscWorker->run();
+	wsapiWorker->run();
+	midiWorker->run();
+	if (piSpi) piSpi->start();
+	clockEngine->run();
 	wsServer->start();
+	if (replay) replay->run();
+	awaitStatsSignal();
 	info("Xypi::run(): Servers started and worker running ;)");
 #ifdef SINGLE_THREADED_IO
 	ioService.run();
@@ -70,10 +131,217 @@ void XypiHub::run()
 	}
 #endif
 	info("Xypi::run(): io_context threads joined and completed. :o");
+	if (replay) replay->stop();
+	clockEngine->stop();
+	coalescer.stop();
 	oscWorker->stop();
+	wsapiWorker->stop();
+	midiWorker->stop();
+	if (piSpi) piSpi->stop();
+	logStats();
 	info("Xypi::run() shut down successfully. :)");
 }
 
+namespace {
+
+json toJson(const locked::queue_stats_t& s)
+{
+	return {
+		{"depth", s.depth}, {"enqueued", s.enqueued}, {"dequeued", s.dequeued},
+		{"enqueueRate", s.enqueueRate}, {"dequeueRate", s.dequeueRate},
+		{"dwellUs", {{"mean", s.meanUs}, {"p50", s.p50Us}, {"p99", s.p99Us}, {"max", s.maxUs}}}
+	};
+}
+
+json toJson(xymsg::q_t& q)
+{
+	auto j = toJson(q.stats());
+	const auto c = q.counters();
+	j["highWater"] = c.highWater;
+	j["overflows"] = c.overflows;
+	j["coalesced"] = c.coalesced;
+	for (std::size_t l = 0; l < q.laneCount(); ++l) {
+		j["lanes"][xymsg::laneNames[l]] = toJson(q.stats(l));
+	}
+	return j;
+}
+
+json toJson(const locked::pool_counters_t& c)
+{
+	return { {"capacity", c.capacity}, {"inUse", c.inUse}, {"highWater", c.highWater}, {"acquired", c.acquired}, {"exhausted", c.exhausted} };
+}
+
+json toJson(const locked::dwell_hist_t& d)
+{
+	return { {"count", d.count}, {"mean", d.meanUs()}, {"p50", d.percentile(0.5)}, {"p99", d.percentile(0.99)}, {"max", d.maxUs} };
+}
+
+/*!
+ * latency histograms for each route from a source to a sink that has carried anything
+ */
+template<typename F>
+void forEachLatency(F f)
+{
+	for (std::size_t src = 0; src < xymsg::nSources; ++src) {
+		for (std::size_t snk = 0; snk < xymsg::nSinks; ++snk) {
+			const auto d = xymsg::latency().snapshot(static_cast<xymsg::source>(src), static_cast<xymsg::sink>(snk));
+			if (d.count > 0) f(xymsg::sourceNames[src], xymsg::sinkNames[snk], d);
+		}
+	}
+}
+
+/*!
+ * counters for each of the message pools, by message type
+ */
+template<typename F>
+void forEachPool(F f)
+{
+	f(xymsg::typNames[(std::size_t)xymsg::typ::midi_list], xymsg::poolOf<xymsg::MidiList>().counters());
+	f(xymsg::typNames[(std::size_t)xymsg::typ::config_button], xymsg::poolOf<xymsg::ConfigButton>().counters());
+	f(xymsg::typNames[(std::size_t)xymsg::typ::config_pedal], xymsg::poolOf<xymsg::ConfigPedal>().counters());
+	f(xymsg::typNames[(std::size_t)xymsg::typ::config_xlrm8r], xymsg::poolOf<xymsg::ConfigXlm8r>().counters());
+	f(xymsg::typNames[(std::size_t)xymsg::typ::sysx], xymsg::poolOf<xymsg::SysxChunk>().counters());
+}
+
+void logStats(const std::string& name, const locked::queue_stats_t& s)
+{
+	info("{}: depth {}, {} in ({:.1f}/s), {} out ({:.1f}/s), dwell mean {}us, p50 {}us, p99 {}us, max {}us",
+		name, s.depth, s.enqueued, s.enqueueRate, s.dequeued, s.dequeueRate, s.meanUs, s.p50Us, s.p99Us, s.maxUs);
+}
+
+}
+
+/*!
+ * everything the hub measures, as json: its queues and their lanes, the routes, the workers and their schedulers, the clock,
+ * the sequencer, the journal, the latency from each source to each sink, and the message pools. times are in microseconds.
+ * rates are since the last time the stats were taken, by anyone.
+ */
+json XypiHub::stats()
+{
+	json j;
+	j["queues"]["spiInQ"] = toJson(spiInQ);
+	j["queues"]["oscInQ"] = toJson(oscInQ);
+	j["queues"]["midiOutQ"] = toJson(midiOutQ);
+	j["queues"]["cmdQ"] = toJson(cmdQ.stats());
+	for (std::size_t src = 0; src < xymsg::nSources; ++src) {
+		const auto c = router.counters(static_cast<xymsg::source>(src));
+		j["routes"][xymsg::sourceNames[src]] = { {"routed", c.routed}, {"dropped", c.dropped} };
+	}
+	for (std::size_t snk = 0; snk < xymsg::nSinks; ++snk) {
+		const auto c = coalescer.counters(static_cast<xymsg::sink>(snk));
+		j["coalesced"][xymsg::sinkNames[snk]] = { {"held", c.held}, {"merged", c.merged}, {"pending", c.pending} };
+	}
+	j["midiPorts"] = json::object();
+	midiWorker->forEachOutPort([&j](MidiOutPort& p) {
+		const auto sched = p.schedulerStats();
+		auto& jp = j["midiPorts"][p.name()];
+		jp["port"] = p.port();
+		jp["queue"] = toJson(p.queue());
+		jp["scheduler"] = { {"pending", sched.pending}, {"scheduled", sched.scheduled}, {"overflows", sched.overflows}, {"latenessUs", toJson(sched.lateness)} };
+	});
+	j["midiUnknownPort"] = midiWorker->unknownPortCount();
+	if (piSpi) {
+		const auto c = piSpi->counters();
+		j["spi"] = piSpi->spiTransport().toJson();
+		j["spi"].update({ {"transfers", c.transfers}, {"bytes", c.bytes}, {"sent", c.sent}, {"carried", c.carried}, {"received", c.received}, {"pongs", c.pongs} });
+		const auto sched = piSpi->schedulerStats();
+		j["spi"]["scheduler"] = { {"pending", sched.pending}, {"scheduled", sched.scheduled}, {"overflows", sched.overflows}, {"latenessUs", toJson(sched.lateness)} };
+	}
+	j["clock"] = ClockEngine::toJson(clockEngine->stats());
+	j["sequencer"] = Sequencer::toJson(sequencer.stats());
+	if (journal) {
+		const auto c = journal->counters();
+		j["journal"] = { {"records", c.records}, {"dropped", c.dropped}, {"bytes", c.bytes}, {"capacity", c.capacity} };
+	}
+	if (replay) {
+		const auto s = replay->stats();
+		j["replay"] = { {"done", replay->done()}, {"replayed", s.replayed}, {"skipped", s.skipped}, {"total", s.total}, {"latenessUs", toJson(s.lateness)} };
+	}
+	j["latencyUs"] = json::object();
+	forEachLatency([&j](const char* src, const char* snk, const locked::dwell_hist_t& d) { j["latencyUs"][src][snk] = toJson(d); });
+	j["pools"] = json::object();
+	forEachPool([&j](const char* name, const locked::pool_counters_t& c) { j["pools"][name] = toJson(c); });
+	return j;
+}
+
+/*!
+ * report how the queues, routes and pools are doing, and how close we came to the limits on the bounded ones
+ */
+void XypiHub::logStats()
+{
+	auto log = [](const char* name, xymsg::q_t& q) {
+		::logStats(name, q.stats());
+		const auto c = q.counters();
+		info("  high water {}, overflows {}, coalesced {}", c.highWater, c.overflows, c.coalesced);
+		for (std::size_t l = 0; l < q.laneCount(); ++l) {
+			::logStats(fmt::format("  {} lane", xymsg::laneNames[l]), q.stats(l));
+		}
+	};
+	log("spiInQ", spiInQ);
+	log("oscInQ", oscInQ);
+	log("midiOutQ", midiOutQ);
+	::logStats("cmdQ", cmdQ.stats());
+	for (std::size_t src = 0; src < xymsg::nSources; ++src) {
+		const auto c = router.counters(static_cast<xymsg::source>(src));
+		info("from {}: {} routed, {} dropped", xymsg::sourceNames[src], c.routed, c.dropped);
+	}
+	for (std::size_t snk = 0; snk < xymsg::nSinks; ++snk) {
+		const auto c = coalescer.counters(static_cast<xymsg::sink>(snk));
+		info("controllers to {}: {} held back, {} merged, {} pending", xymsg::sinkNames[snk], c.held, c.merged, c.pending);
+	}
+	midiWorker->forEachOutPort([&log](MidiOutPort& p) {
+		log(fmt::format("midi port {} ({})", p.port(), p.name()).c_str(), p.queue());
+		const auto sched = p.schedulerStats();
+		info("  scheduler: {} pending, {} scheduled, {} overflows, late mean {}us, p50 {}us, p99 {}us, max {}us", sched.pending, sched.scheduled,
+			sched.overflows, sched.lateness.meanUs(), sched.lateness.percentile(0.5), sched.lateness.percentile(0.99), sched.lateness.maxUs);
+	});
+	info("midi for ports we don't have: {}", midiWorker->unknownPortCount());
+	if (piSpi) {
+		const auto c = piSpi->counters();
+		info("spi over {}: {} transfers, {} bytes, {} messages sent, {} carried to the next frame, {} received, {} pongs", piSpi->spiTransport().name(),
+			c.transfers, c.bytes, c.sent, c.carried, c.received, c.pongs);
+		const auto sched = piSpi->schedulerStats();
+		info("  scheduler: {} pending, {} scheduled, {} overflows, late mean {}us, p50 {}us, p99 {}us, max {}us", sched.pending, sched.scheduled,
+			sched.overflows, sched.lateness.meanUs(), sched.lateness.percentile(0.5), sched.lateness.percentile(0.99), sched.lateness.maxUs);
+	}
+	const auto clock = clockEngine->stats();
+	info("clock {}{}: {:.1f}bpm, {} ticks, {} late, jitter p99 {}us, max {}us, drift {}us, p99 {}us", clockSyncNames[(std::size_t)clock.sync],
+		clock.locked ? " (locked)" : "", clock.tempo, clock.ticks, clock.lateTicks, clock.jitter.percentile(0.99), clock.jitter.maxUs,
+		clock.driftUs, clock.drift.percentile(0.99));
+	const auto seq = sequencer.stats();
+	info("sequencer{}: {} patterns, chain of {}, {} ticks, {} events, {} late, lateness p99 {}us, max {}us", seq.playing ? " playing" : "",
+		seq.patterns.size(), seq.chain.size(), seq.ticks, seq.events, seq.lateEvents, seq.lateness.percentile(0.99), seq.lateness.maxUs);
+	if (journal) {
+		const auto c = journal->counters();
+		info("journal: {} records, {} dropped, {} of {} bytes", c.records, c.dropped, c.bytes, c.capacity);
+	}
+	if (replay) {
+		const auto s = replay->stats();
+		info("replay{}: {} of {} replayed, {} skipped, late p99 {}us, max {}us", replay->done() ? " done" : "", s.replayed, s.total, s.skipped,
+			s.lateness.percentile(0.99), s.lateness.maxUs);
+	}
+	forEachLatency([](const char* src, const char* snk, const locked::dwell_hist_t& d) {
+		info("{} to {}: {} messages, latency mean {}us, p50 {}us, p99 {}us, max {}us", src, snk, d.count, d.meanUs(), d.percentile(0.5), d.percentile(0.99), d.maxUs);
+	});
+	forEachPool([](const char* name, const locked::pool_counters_t& c) {
+		info("{} pool: {} of {} in use, high water {}, {} acquired, {} exhausted", name, c.inUse, c.capacity, c.highWater, c.acquired, c.exhausted);
+	});
+}
+
+/*!
+ * log the stats whenever we get a SIGUSR1. we listen for SIGINT and SIGTERM too, so we know to stop listening
+ */
+void XypiHub::awaitStatsSignal()
+{
+#ifdef SIGUSR1
+	statsSignal.async_wait([this](boost::system::error_code ec, int sig) {
+		if (ec || sig != SIGUSR1) return;
+		logStats();
+		awaitStatsSignal();
+	});
+#endif
+}
+
 /*!
  * just finish! probably not safely. not sure if we need this even
  */
@@ -82,4 +350,6 @@ void XypiHub::stop()
 	ioService.stop(); // should be posted perhaps?
 	// it would be polite to wait for all those loose threads in the local ioThreads vector. TODO: perhaps make the vector of threads a member so we can do that.
 	oscWorker->stop();
+	wsapiWorker->stop();
+	midiWorker->stop();
 }
\ No newline at end of file
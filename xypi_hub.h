@@ -1,34 +1,97 @@
 #pragma once
 
 #include "message.h"
+#include "router.h"
+#include "coalescer.h"
+#include "state_cache.h"
+#include "journal.h"
 #include "wsapi_cmd.h"
 #include "midi_worker.h"
+#include "clock_engine.h"
+#include "sequencer.h"
+#include "spi_transport.h"
 
+#include <chrono>
 #include <memory>
 
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/signal_set.hpp>
 
 class OSCServer;
 class OSCWorker;
 class WSApiHandler;
 class WSServer;
 class WSApiWorker;
+class PiSpi;
 
 namespace oscapi {
 	class Processor;
 }
 
+/*!
+ * capacity and overflow handling for each lane of the hub's message queues, how they sort messages into priority lanes, which
+ * messages are routed to them, and how often they take new controller values
+ */
+struct queue_config_t {
+	locked::bounds_t spiIn;
+	locked::bounds_t oscIn;
+	locked::bounds_t midiOut;
+	xymsg::lane_map_t lanes;
+	locked::lane_policy_t lanePolicy;
+	std::vector<xymsg::route_t> routes = xymsg::Router::defaultRoutes();
+	xymsg::coalesce_config_t coalesce;
+};
+
+/*!
+ * how long we keep the results of ws api commands for clients to 'get', and how much memory they may take
+ */
+struct results_config_t {
+	std::chrono::seconds ttl{ 300 };
+	std::size_t maxBytes = 4 << 20;
+};
+
+/*!
+ * a journal to record the hub's traffic to, and one to play back into it
+ */
+struct journal_config_t {
+	std::string record;
+	std::size_t capacity = 64 << 20;	//!< bytes of records the journal may hold
+	std::string replay;
+	double speed = 1;	//!< how fast to play back, against the time it was recorded in. 0 is as fast as we can
+};
+
 class XypiHub
 {
 public:
-	XypiHub(std::string dst_osc_adr, uint16_t dst_osc_prt, uint16_t rcv_osc_port, uint16_t ws_port, uint16_t threadCount = 1);
+	XypiHub(std::string dst_osc_adr, uint16_t dst_osc_prt, uint16_t rcv_osc_port, uint16_t ws_port,
+		const queue_config_t& qConfig, const results_config_t& rConfig, const midi_config_t& mConfig, const clock_config_t& cConfig, const journal_config_t& jConfig,
+		const spi_config_t& sConfig, uint16_t threadCount = 1);
 	~XypiHub();
 
 	void run();
 	void stop();
 
+	nlohmann::json stats();
+
 private:
+	void logStats();
+	void awaitStatsSignal();
+
 	boost::asio::io_service ioService;
+	boost::asio::signal_set statsSignal; //!< SIGUSR1 logs the queue stats
+
+	// the shared queues and maps come before the workers, so they outlive them
+	xymsg::q_t spiInQ;
+	xymsg::q_t oscInQ;
+	xymsg::q_t midiOutQ;
+	wsapi::cmdq_t cmdQ;
+	wsapi::results_t results;
+	xymsg::Router router;
+	xymsg::Coalescer coalescer;
+	xymsg::StateCache state;	//!< where the controllers, notes and configs stand, for clients catching up
+	std::unique_ptr<xymsg::Journal> journal;
+	Sequencer sequencer;	//!< plays along with the clock engine, so it must outlive it
+	std::unique_ptr<ClockEngine> clockEngine;	//!< the router's clock tap calls it for whatever the workers route, so it outlives them
 
 	std::shared_ptr<oscapi::Processor> oscParser; //!<< we should be able to get away with sharing the one
 	std::unique_ptr<OSCServer> oscServer;
@@ -37,11 +100,8 @@ private:
 	std::unique_ptr<WSServer> wsServer;
 	std::unique_ptr<WSApiWorker> wsapiWorker;
 	std::unique_ptr<MidiWorker> midiWorker;
-
-	xymsg::q_t spiInQ;
-	xymsg::q_t oscInQ;
-	xymsg::q_t midiOutQ;
-	wsapi::cmdq_t cmdQ;
+	std::unique_ptr<PiSpi> piSpi;	//!< if we have a way to the duino
+	std::unique_ptr<xymsg::JournalReplay> replay;	//!< routes like any worker, and hands commands to the ws api handler, so it goes first
 
 	uint16_t threadCount;
 };
\ No newline at end of file
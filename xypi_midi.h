@@ -103,6 +103,8 @@ enum class midi_ctrl : uint8_t {
 	tempo_change	= 0x51
 };
 
+constexpr uint8_t allPorts = 0xff;	//!< a port number for a message that goes out of every midi port
+
 #pragma pack(push, 1)
 
 struct msg {